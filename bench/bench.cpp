@@ -0,0 +1,239 @@
+/**
+ * @brief Interpreter benchmarks
+ * @details Runs the same guest code through each of the cpu's run loops and
+ * reports millions of guest instructions per second, with and without a
+ * recording journal attached. Build with CMAKE_BUILD_TYPE=Release so that
+ * asserts are compiled out.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "../src/dev/timer.h"
+#include "../src/vm/cpu.h"
+#include "../src/vm/flat_bus.h"
+#include "../src/vm/journal.h"
+
+using namespace std;
+using namespace mercury;
+
+/**
+ * @brief Assembles guest code into a byte buffer
+ */
+struct program {
+    vector<uint8_t> code;
+    uint64_t instructions = 0;
+
+    void emit(uint32_t word, std::initializer_list<uint64_t> operands = {}) {
+        auto at = code.size();
+
+        code.resize(at + sizeof(word) + operands.size() * sizeof(uint64_t));
+        memcpy(&code[at], &word, sizeof(word));
+        at += sizeof(word);
+
+        for (auto operand : operands) {
+            memcpy(&code[at], &operand, sizeof(operand));
+            at += sizeof(operand);
+        }
+
+        instructions++;
+    }
+};
+
+/**
+ * @brief Integer register arithmetic, including fusable shl/add pairs
+ */
+program integer_program(int blocks) {
+    program p;
+
+    for (auto i = 0; i < blocks; i++) {
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::register_direct), {r0, r1});
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::immediate), {r1, 3});
+        p.emit(opc2(opcode::_sub, addressing::register_direct, addressing::register_direct), {r2, r0});
+        p.emit(opc2(opcode::_xor, addressing::register_direct, addressing::register_direct), {r3, r2});
+        p.emit(opc1(opcode::_inc, addressing::register_direct), {r4});
+        p.emit(opc1(opcode::_dec, addressing::register_direct), {r5});
+        p.emit(opc2(opcode::_shl, addressing::register_direct, addressing::immediate), {r6, 1});
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::register_direct), {r6, r4});
+        p.emit(opc0(opcode::_nop));
+    }
+
+    p.emit(opc0(opcode::_hlt));
+
+    return p;
+}
+
+/**
+ * @brief Scalar double arithmetic on the floating point registers
+ */
+program float_program(int blocks) {
+    program p;
+    reg scale = {.f = 1.000001};
+
+    p.emit(opc1(opcode::_fld1, addressing::register_direct), {f0});
+    p.emit(opc2(opcode::_fld, addressing::register_direct, addressing::immediate), {f1, scale.q});
+
+    for (auto i = 0; i < blocks; i++) {
+        p.emit(opc2(opcode::_fmul, addressing::register_direct, addressing::register_direct), {f0, f1});
+        p.emit(opc2(opcode::_fadd, addressing::register_direct, addressing::register_direct), {f2, f0});
+        p.emit(opc2(opcode::_fsub, addressing::register_direct, addressing::register_direct), {f3, f1});
+        p.emit(opc2(opcode::_fdiv, addressing::register_direct, addressing::register_direct), {f2, f1});
+        p.emit(opc2(opcode::_fsqrt, addressing::register_direct, addressing::register_direct), {f4, f2});
+        p.emit(opc2(opcode::_fcom, addressing::register_direct, addressing::register_direct), {f4, f0});
+    }
+
+    p.emit(opc2(opcode::_fist, addressing::register_direct, addressing::register_direct), {r0, f2});
+    p.emit(opc0(opcode::_hlt));
+
+    return p;
+}
+
+static constexpr uint64_t timer_base = 0x1000000;  /* above the code of every program */
+
+/**
+ * @brief Integer register arithmetic that reads the timer's clock once a block
+ * @details Every device read misses the direct memory path, so a recording
+ * journal logs each one.
+ */
+program device_program(int blocks) {
+    program p;
+
+    for (auto i = 0; i < blocks; i++) {
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::register_direct), {r0, r1});
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::immediate), {r1, 3});
+        p.emit(opc2(opcode::_xor, addressing::register_direct, addressing::register_direct), {r3, r0});
+        p.emit(opc1(opcode::_inc, addressing::register_direct), {r4});
+        p.emit(opc2(opcode::_add, addressing::register_direct, addressing::direct), {r2, timer_base + timer::reg_time});
+    }
+
+    p.emit(opc0(opcode::_hlt));
+
+    return p;
+}
+
+/**
+ * @brief Packed integer and float arithmetic on the vector registers
+ */
+program vector_program(int blocks) {
+    program p;
+
+    p.emit(opc2(opcode::_vmovdqu, addressing::register_direct, addressing::direct), {v0, 0});
+    p.emit(opc2(opcode::_vpbroadcastq, addressing::register_direct, addressing::immediate), {v1, 0x3ff0000000000000});
+
+    for (auto i = 0; i < blocks; i++) {
+        p.emit(opc3(opcode::_vpaddd, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v2, v2, v0});
+        p.emit(opc3(opcode::_vpmulld, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v3, v2, v0});
+        p.emit(opc3(opcode::_vpxor, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v4, v4, v3});
+        p.emit(opc3(opcode::_vpshufd, addressing::register_direct, addressing::register_direct, addressing::immediate), {v5, v4, 0x1b});
+        p.emit(opc3(opcode::_vaddpd, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v6, v6, v1});
+        p.emit(opc3(opcode::_vmulpd, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v7, v6, v1});
+        p.emit(opc3(opcode::_vcmpltpd, addressing::register_direct, addressing::register_direct, addressing::register_direct), {v5, v7, v6});
+    }
+
+    p.emit(opc3(opcode::_vpextrq, addressing::register_direct, addressing::register_direct, addressing::immediate), {r0, v4, 0});
+    p.emit(opc0(opcode::_hlt));
+
+    return p;
+}
+
+/**
+ * @brief Runs a program repeatedly through a run loop and reports the throughput
+ * @details A journal, if given, is attached for the whole measurement. The
+ * timer is only mapped for programs that read it.
+ */
+void measure(const char *name, const program &p, int runs, const function<void(cpu &)> &run,
+             const journal_ptr &journal = nullptr, bool devices = false) {
+    auto bus = make_shared<flat_bus>(p.code.size() + 64);
+    bus->load(0, p.code.data(), p.code.size());
+
+    cpu vm;
+    vm.reset();
+    vm.attach(bus);
+    vm.set_journal(journal);
+
+    // never armed, so it schedules nothing on the cpu it outlives
+    if (devices) {
+        bus->map(timer_base, make_shared<timer>(vm));
+    }
+
+    auto go = [&]() {
+        vm.pc().q = 0;
+
+        try {
+            run(vm);
+        } catch (const halted_exception &) {
+        }
+    };
+
+    // the first run fills the decode cache
+    go();
+
+    auto start = chrono::steady_clock::now();
+
+    for (auto i = 0; i < runs; i++) {
+        go();
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    auto mips = (double)p.instructions * runs / elapsed.count() / 1e6;
+
+    cout << name << ": " << mips << " MIPS (r0=" << vm.r0().q << ")" << endl;
+}
+
+int main(int argc, char **argv) {
+    auto runs = argc > 1 ? atoi(argv[1]) : 2000;
+    auto integer = integer_program(512);
+
+    measure("integer/stepped", integer, runs, [](cpu &vm) { vm.run_stepped(); });
+#if defined(__GNUC__)
+    measure("integer/threaded", integer, runs, [](cpu &vm) { vm.run_threaded(); });
+#endif
+
+    auto floating = float_program(512);
+
+    measure("float/stepped", floating, runs, [](cpu &vm) { vm.run_stepped(); });
+#if defined(__GNUC__)
+    measure("float/threaded", floating, runs, [](cpu &vm) { vm.run_threaded(); });
+#endif
+
+    // recording must cost next to nothing when the guest touches no devices
+    ostringstream recording;
+    auto journal = journal::record(recording);
+
+    measure("integer/stepped/recorded", integer, runs, [](cpu &vm) { vm.run_stepped(); }, journal);
+    measure("float/stepped/recorded", floating, runs, [](cpu &vm) { vm.run_stepped(); }, journal);
+#if defined(__GNUC__)
+    measure("integer/threaded/recorded", integer, runs, [](cpu &vm) { vm.run_threaded(); }, journal);
+    measure("float/threaded/recorded", floating, runs, [](cpu &vm) { vm.run_threaded(); }, journal);
+#endif
+
+    // a guest polling a device pays for one journal entry per read
+    auto device = device_program(512);
+
+    measure("device/stepped", device, runs, [](cpu &vm) { vm.run_stepped(); }, nullptr, true);
+    measure("device/stepped/recorded", device, runs, [](cpu &vm) { vm.run_stepped(); }, journal, true);
+#if defined(__GNUC__)
+    measure("device/threaded", device, runs, [](cpu &vm) { vm.run_threaded(); }, nullptr, true);
+    measure("device/threaded/recorded", device, runs, [](cpu &vm) { vm.run_threaded(); }, journal, true);
+#endif
+
+    journal->flush();
+    cout << "journal: " << recording.str().size() << " bytes" << endl;
+
+    auto vector = vector_program(512);
+
+    for (auto kernels : { &simd_kernels::portable(), simd_kernels::sse2(), simd_kernels::avx2() }) {
+        if (kernels == nullptr) {
+            continue;
+        }
+
+        auto name = string("vector/") + kernels->name;
+        measure(name.c_str(), vector, runs, [kernels](cpu &vm) { vm.use_simd(*kernels); vm.run(); });
+    }
+
+    return 0;
+}
@@ -0,0 +1,809 @@
+/**
+ * @brief Differential conformance tests across the cpu's execution engines
+ * @details Generates random programs from the opcode table and runs each one
+ * on every engine in lockstep: single steps through the unfused handlers,
+ * the decoded run loop, the threaded run loop, the run loop with coverage
+ * instrumentation and the run loop with each host SIMD kernel set. After
+ * every block of instructions the registers, memory and outcome of each
+ * engine are compared against single stepping, which also checks that each
+ * exception it delivers can be retried. A program that diverges is
+ * minimized to the fewest instructions that still diverge, then printed.
+ * Before the random programs, a few hand-written ones check results that
+ * the engines could all get wrong together.
+ */
+
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/vm/coverage.h"
+#include "../src/vm/cpu.h"
+#include "../src/vm/flat_bus.h"
+
+using namespace std;
+using namespace mercury;
+
+static constexpr uint64_t memory_size = 0x10000;
+static constexpr uint64_t data_base = 0x8000;       /* memory operands point here */
+static constexpr uint64_t data_size = 0x1000;
+static constexpr uint64_t stack_top = 0xf000;
+static constexpr uint64_t vector_table = 0xf800;   /* exception handlers, for half the programs */
+static constexpr uint64_t page_tables = 0xa000;     /* four levels of identity mapping, for half the programs */
+
+static constexpr uint64_t budget = 4096;            /* instructions per program */
+
+static uint64_t compared = 0;                       /* instructions run by the reference engine */
+static string unrestartable;                        /* an exception single stepping found changed more than its frame */
+
+/**
+ * @brief One generated instruction
+ */
+struct generated {
+    uint32_t word;
+    uint64_t operands[3];
+    int64_t target = -1;        /* the item the first operand jumps to, if any */
+};
+
+/**
+ * @brief An instruction with the setup its memory operands need
+ * @details Minimization removes whole items, so an instruction never loses
+ * the setup that points its registers at the data area.
+ */
+struct item {
+    vector<generated> insns;
+};
+
+using program = vector<item>;
+
+/**
+ * @brief Counts the operands an instruction word carries
+ */
+static int operand_count(uint32_t word) {
+    auto count = 0;
+
+    for (auto i = 0; i < 3; i++) {
+        count += ((word >> (i * 3)) & 0x7) != 0;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Lays a program out in memory, resolving jump targets to item addresses
+ * @details A target past the last item jumps to the final hlt.
+ */
+static vector<uint8_t> assemble(const program &p) {
+    vector<uint64_t> offsets;
+    uint64_t at = 0;
+
+    for (auto &it : p) {
+        offsets.push_back(at);
+
+        for (auto &g : it.insns) {
+            at += sizeof(uint32_t) + operand_count(g.word) * sizeof(uint64_t);
+        }
+    }
+
+    offsets.push_back(at);
+
+    vector<uint8_t> code;
+
+    auto emit = [&code](const void *data, size_t size) {
+        auto bytes = (const uint8_t *)data;
+        code.insert(code.end(), bytes, bytes + size);
+    };
+
+    for (auto &it : p) {
+        for (auto &g : it.insns) {
+            emit(&g.word, sizeof(g.word));
+
+            for (auto i = 0; i < operand_count(g.word); i++) {
+                auto operand = g.operands[i];
+
+                if (i == 0 && g.target >= 0) {
+                    operand = offsets[std::min<uint64_t>(g.target, p.size())];
+                }
+
+                emit(&operand, sizeof(operand));
+            }
+        }
+    }
+
+    uint32_t hlt = opc0(opcode::_hlt);
+    emit(&hlt, sizeof(hlt));
+
+    return code;
+}
+
+/**
+ * @brief Generates random programs from the opcode table
+ */
+class generator {
+public:
+    explicit generator(uint64_t seed) : _random(seed) {
+        for (auto &[word, func] : cpu::_opcode_table) {
+            auto op = word >> 16;
+
+            // the final hlt ends every program
+            if (op == opcode::_hlt) {
+                continue;
+            }
+
+            // control only moves to instruction boundaries, so that programs keep running
+            if (is_jump(op) && (word & 0x1ff) != addressing::immediate) {
+                continue;
+            }
+
+            this->_words.push_back(word);
+        }
+
+        for (auto &[pair, func] : cpu::_fusion_table) {
+            this->_pairs.push_back(pair);
+        }
+    }
+
+    /**
+     * @brief Generates a program of a number of items
+     */
+    program generate(size_t items) {
+        program p(items);
+
+        for (size_t i = 0; i < items; i++) {
+            // pairs the decoder fuses are rare by chance, so some items are one
+            if (this->pick(4) == 0) {
+                auto pair = this->_pairs[this->pick(this->_pairs.size())];
+
+                this->instruction(p, i, (uint32_t)(pair >> 32));
+                this->instruction(p, i, (uint32_t)pair);
+            } else {
+                this->instruction(p, i, this->_words[this->pick(this->_words.size())]);
+            }
+        }
+
+        return p;
+    }
+
+    /**
+     * @brief Generates the initial value of a register
+     */
+    uint64_t value(void) {
+        static const uint64_t edges[] = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x7fffffffffffffff, 0x8000000000000000, UINT64_MAX };
+
+        switch (this->pick(4)) {
+            case 0:
+                return edges[this->pick(sizeof(edges) / sizeof(edges[0]))];
+            case 1:
+                return this->pick(64);
+            default:
+                return this->_random();
+        }
+    }
+
+private:
+    static bool is_jump(uint32_t op) {
+        return (op >= opcode::_ja && op <= opcode::_jz) ||
+               (op >= opcode::_loop && op <= opcode::_loopnz) ||
+               op == opcode::_jmp || op == opcode::_call;
+    }
+
+    /**
+     * @brief Appends an instruction with random operands to an item
+     */
+    void instruction(program &p, size_t i, uint32_t word) {
+        generated g = { word, { 0, 0, 0 } };
+
+        for (auto n = 0; n < 3; n++) {
+            g.operands[n] = this->operand((addressing)((word >> (n * 3)) & 0x7), p[i]);
+        }
+
+        if (is_jump(word >> 16)) {
+            g.target = (int64_t)this->pick(p.size() + 1);
+        }
+
+        p[i].insns.push_back(g);
+    }
+
+    uint64_t pick(uint64_t n) {
+        return std::uniform_int_distribution<uint64_t>(0, n - 1)(this->_random);
+    }
+
+    /**
+     * @brief Sets a register to a value before the instruction that uses it
+     */
+    void load(item &it, uint64_t r, uint64_t value) {
+        it.insns.push_back({ opc2(opcode::_xor, addressing::register_direct, addressing::register_direct), { r, r, 0 } });
+        it.insns.push_back({ opc2(opcode::_add, addressing::register_direct, addressing::immediate), { r, value, 0 } });
+    }
+
+    /**
+     * @brief Generates an operand for an addressing mode
+     * @details Registers are drawn from r0 to r7, which also index the float
+     * and vector registers. Memory operands land in the data area, through
+     * setup instructions for the modes that address through registers.
+     */
+    uint64_t operand(addressing mode, item &it) {
+        auto offset = this->pick(data_size - 64);
+
+        switch (mode) {
+            case addressing::immediate:
+                return this->value();
+
+            case addressing::register_direct:
+                return this->pick(8);
+
+            case addressing::direct:
+                return data_base + offset;
+
+            case addressing::register_indirect: {
+                auto r = this->pick(8);
+                this->load(it, r, data_base + offset);
+                return r;
+            }
+
+            case addressing::indexed:
+                this->load(it, cpu_reg::r6, data_base);
+                return offset;
+
+            case addressing::based_indexed: {
+                auto r = this->pick(6);
+                this->load(it, cpu_reg::r6, data_base);
+                this->load(it, r, offset);
+                return r;
+            }
+
+            default:
+                return 0;
+        }
+    }
+
+    std::mt19937_64 _random;
+    vector<uint32_t> _words;
+    vector<uint64_t> _pairs;
+};
+
+/**
+ * @brief The conditions a program starts in, the same on every engine
+ */
+struct setup {
+    vector<uint64_t> registers;     /* r0 to r7, then f0 to f7 */
+    vector<uint64_t> blocks;        /* instructions to run between comparisons, in turn */
+    bool vectors;                   /* whether exceptions go to a guest handler */
+    bool paging;                    /* whether memory is reached through page tables */
+    bool read_only;                 /* whether the page tables make the data area read-only */
+    bool user = false;              /* whether the program starts in user mode, without paging */
+};
+
+/**
+ * @brief A way of executing guest code
+ */
+struct engine {
+    const char *name;
+    const simd_kernels *kernels;
+    bool coverage;
+    function<uint64_t(cpu &, uint64_t)> run;    /* runs up to a number of instructions */
+};
+
+/**
+ * @brief Retrieves the number of exceptions a cpu has raised
+ */
+static uint64_t exceptions(const cpu &vm) {
+    auto stats = vm.stats();
+
+    return stats.faults + stats.illegal;
+}
+
+/**
+ * @brief Checks that an exception delivered to a handler left the registers
+ * as they were before the instruction, apart from its frame
+ * @details The engines all share the handlers, so a handler that changes
+ * state before it faults makes them agree on the wrong result. Returning
+ * from the handler would then not retry the same instruction.
+ * @param before The registers before the instruction
+ * @param stack The supervisor sp before the instruction, which the frame goes on
+ * @return A description of what changed, or an empty string
+ */
+static string restartable(cpu &vm, const decltype(cpu_context::_r) &before, uint64_t stack) {
+    static const char *names[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7" };
+    uint64_t pc = before[cpu_reg::pc].q;
+    ostringstream out;
+
+    out << hex;
+
+    for (auto i = 0; i < 8 && out.tellp() == 0; i++) {
+        if (vm._r[i].q != before[i].q) {
+            out << names[i] << " 0x" << before[i].q << " became 0x" << vm._r[i].q;
+        }
+    }
+
+    // with paging on, the stack can run into the page tables and remap itself,
+    // and guest_memory() would walk them, setting bits the other engines do not
+    if (vm.page_table() == 0) {
+        auto frame = vm.guest_memory(vm.sp().q + 2 * sizeof(uint64_t), sizeof(uint64_t), false);
+
+        if (frame != nullptr) {
+            memcpy(&pc, frame, sizeof(pc));
+        }
+    }
+
+    if (out.tellp() == 0 && vm.sp().q != stack - 3 * sizeof(uint64_t)) {
+        out << "sp 0x" << stack << " became 0x" << vm.sp().q + 3 * sizeof(uint64_t);
+    } else if (out.tellp() == 0 && pc != before[cpu_reg::pc].q) {
+        out << "frame pc 0x" << pc << " != 0x" << before[cpu_reg::pc].q;
+    }
+
+    if (out.tellp() == 0) {
+        return {};
+    }
+
+    ostringstream at;
+    at << hex << "exception at 0x" << before[cpu_reg::pc].q << " is not restartable: " << out.str();
+
+    return at.str();
+}
+
+/**
+ * @brief Runs single steps, so that fused pairs run as their two handlers
+ * @details Also checks that every exception delivered to a handler can be
+ * retried, recording the first one that cannot in unrestartable.
+ */
+static uint64_t run_single(cpu &vm, uint64_t limit) {
+    uint64_t retired = 0;
+
+    vm._state = cpu_state::running;
+
+    while (retired < limit && vm._state == cpu_state::running) {
+        auto before = vm._r;
+        auto raised = exceptions(vm);
+        auto stack = before[cpu_reg::flags].q & cpu_flag::user ? vm.msr(msr_banked_stack) : before[cpu_reg::sp].q;
+
+        vm.step();
+        retired++;
+
+        if (exceptions(vm) != raised && unrestartable.empty()) {
+            unrestartable = restartable(vm, before, stack);
+        }
+    }
+
+    if (vm._state == cpu_state::running) {
+        vm._state = cpu_state::stopped;
+    }
+
+    return retired;
+}
+
+/**
+ * @brief A program running on one engine
+ */
+struct machine {
+    shared_ptr<flat_bus> bus;
+    coverage_ptr cover;             /* only for the engines that count edges */
+    cpu vm;
+    string outcome = "running";
+    uint64_t retired = 0;
+
+    machine(const engine &e, const vector<uint8_t> &code, const setup &s) {
+        this->bus = make_shared<flat_bus>(memory_size);
+        this->bus->load(0, code.data(), code.size());
+
+        this->vm.reset();
+
+        // every handler is the final hlt, so a delivered exception ends the program
+        if (s.vectors) {
+            uint64_t hlt = code.size() - sizeof(uint32_t);
+
+            for (uint64_t v = 0; v < 32; v++) {
+                this->bus->load(vector_table + v * sizeof(uint64_t), &hlt, sizeof(hlt));
+            }
+
+            this->vm.set_vector_table(vector_table);
+        }
+
+        this->vm.attach(this->bus);
+
+        // the accessed and dirty bits the walks set are compared with the rest of memory
+        if (s.paging) {
+            for (uint64_t level = 0; level < 3; level++) {
+                uint64_t entry = (page_tables + (level + 1) * page_size) | pte_present | pte_writable;
+                this->bus->load(page_tables + level * page_size, &entry, sizeof(entry));
+            }
+
+            for (uint64_t page = 0; page < memory_size / page_size; page++) {
+                uint64_t entry = page * page_size | pte_present;
+
+                if (!(s.read_only && page * page_size == data_base)) {
+                    entry |= pte_writable;
+                }
+
+                this->bus->load(page_tables + 3 * page_size + page * sizeof(entry), &entry, sizeof(entry));
+            }
+
+            this->vm.set_page_table(page_tables);
+        }
+
+        this->vm.use_simd(e.kernels ? *e.kernels : simd_kernels::portable());
+
+        if (e.coverage) {
+            this->cover = make_shared<coverage>();
+            this->vm.set_coverage(this->cover);
+        }
+
+        for (auto i = 0; i < 8; i++) {
+            this->vm._r[i].q = s.registers[i];
+            this->vm._f[i].q = s.registers[8 + i];
+        }
+
+        this->vm.sp().q = stack_top;
+        this->vm.pc().q = 0;
+
+        // as iret would leave it, with the handlers on the banked supervisor stack
+        if (s.user) {
+            this->vm.set_msr(msr_banked_stack, stack_top - page_size);
+            this->vm.flags().q |= cpu_flag::user;
+            this->vm.flush_tlb();
+        }
+    }
+
+    bool finished(void) const { return this->outcome != "running"; }
+
+    /**
+     * @brief Runs up to a number of instructions on an engine
+     */
+    void run(const engine &e, uint64_t limit) {
+        try {
+            e.run(this->vm, limit);
+
+            if (this->vm.state() != cpu_state::stopped) {
+                this->outcome = "state " + to_string(this->vm.state());
+            }
+        } catch (const halted_exception &) {
+            this->outcome = this->vm.flags().q & cpu_flag::illegal ? "illegal" : "halted";
+        } catch (const addressing_exception &e) {
+            this->outcome = "addressing mode " + to_string(e.mode());
+        } catch (const fault_exception &e) {
+            this->outcome = "vector " + to_string(e.vector());
+        }
+
+        this->retired = this->vm.instret();
+    }
+};
+
+/**
+ * @brief Describes the first difference between two machines, if any
+ * @return An empty string if they agree
+ */
+static string compare(machine &a, machine &b) {
+    static const char *names[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "sp", "pc", "flags" };
+    ostringstream out;
+
+    out << hex;
+
+    if (a.outcome != b.outcome) {
+        out << "outcome " << a.outcome << " != " << b.outcome;
+    } else if (a.retired != b.retired) {
+        out << "retired " << a.retired << " != " << b.retired;
+    } else {
+        for (auto i = 0; i < 11 && out.tellp() == 0; i++) {
+            if (a.vm._r[i].q != b.vm._r[i].q) {
+                out << names[i] << " 0x" << a.vm._r[i].q << " != 0x" << b.vm._r[i].q;
+            }
+        }
+
+        for (auto i = 0; i < 8 && out.tellp() == 0; i++) {
+            if (a.vm._f[i].q != b.vm._f[i].q) {
+                out << "f" << i << " 0x" << a.vm._f[i].q << " != 0x" << b.vm._f[i].q;
+            }
+
+            if (memcmp(&a.vm._v[i], &b.vm._v[i], sizeof(a.vm._v[i])) != 0) {
+                out << "v" << i;
+            }
+        }
+
+        if (out.tellp() == 0) {
+            auto ma = a.bus->memory(), mb = b.bus->memory();
+            auto diff = mismatch(ma, ma + memory_size, mb);
+
+            if (diff.first != ma + memory_size) {
+                auto address = diff.first - ma;
+                out << "memory at 0x" << address << " 0x" << (int)*diff.first << " != 0x" << (int)*diff.second;
+            }
+        }
+    }
+
+    return out.str();
+}
+
+/**
+ * @brief Runs a program on every engine in lockstep
+ * @param blocks The number of instructions to run between comparisons, in turn
+ * @return The first divergence, or an empty string if the engines agree
+ */
+static string check(const vector<engine> &engines, const program &p, const setup &s) {
+    auto code = assemble(p);
+    vector<unique_ptr<machine>> machines;
+
+    unrestartable.clear();
+
+    for (auto &e : engines) {
+        machines.push_back(make_unique<machine>(e, code, s));
+    }
+
+    for (uint64_t total = 0, n = 0; total < budget && !machines[0]->finished(); n++) {
+        auto block = s.blocks[n % s.blocks.size()];
+
+        for (size_t i = 0; i < engines.size(); i++) {
+            if (!machines[i]->finished()) {
+                machines[i]->run(engines[i], block);
+            }
+        }
+
+        if (!unrestartable.empty()) {
+            return string(engines[0].name) + " after " + to_string(machines[0]->retired) + ": " + unrestartable;
+        }
+
+        for (size_t i = 1; i < engines.size(); i++) {
+            auto diff = compare(*machines[0], *machines[i]);
+
+            if (!diff.empty()) {
+                return string(engines[i].name) + " after " + to_string(machines[0]->retired) + ": " + diff;
+            }
+        }
+
+        total += block;
+    }
+
+    compared += machines[0]->retired;
+
+    return {};
+}
+
+/**
+ * @brief Removes items while the program still diverges
+ * @details Tries removing runs of items, halving the run length down to
+ * single items, until no removal keeps the divergence.
+ */
+static program minimize(const vector<engine> &engines, program p, const setup &s) {
+    for (auto chunk = p.size() / 2; chunk > 0; chunk /= 2) {
+        for (auto removed = true; removed;) {
+            removed = false;
+
+            for (size_t at = 0; at + chunk <= p.size(); at += chunk) {
+                program smaller;
+
+                for (size_t i = 0; i < p.size(); i++) {
+                    if (i >= at && i < at + chunk) {
+                        continue;
+                    }
+
+                    smaller.push_back(p[i]);
+
+                    // keep jumps pointing at the same items
+                    for (auto &g : smaller.back().insns) {
+                        if (g.target >= (int64_t)(at + chunk)) {
+                            g.target -= (int64_t)chunk;
+                        } else if (g.target >= (int64_t)at) {
+                            g.target = (int64_t)at;
+                        }
+                    }
+                }
+
+                if (!check(engines, smaller, s).empty()) {
+                    p = std::move(smaller);
+                    removed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return p;
+}
+
+/**
+ * @brief Prints a program, one instruction per line
+ */
+static void print(const program &p) {
+    for (size_t i = 0; i < p.size(); i++) {
+        for (auto &g : p[i].insns) {
+            cout << "  " << dec << setw(3) << i << ": opcode " << (g.word >> 16) << " modes " << oct << (g.word & 0x1ff)
+                 << hex;
+
+            for (auto n = 0; n < operand_count(g.word); n++) {
+                cout << " 0x" << g.operands[n];
+            }
+
+            if (g.target >= 0) {
+                cout << dec << " -> item " << g.target;
+            }
+
+            cout << endl;
+        }
+    }
+}
+
+/**
+ * @brief A hand-written program and what every engine must leave behind
+ */
+struct directed {
+    const char *name;
+    program code;
+    setup start;
+    function<string(machine &)> expect;     /* describes what is wrong, or returns an empty string */
+};
+
+/**
+ * @brief Builds an item of one instruction with no setup
+ */
+static item one(uint32_t word, uint64_t first = 0, uint64_t second = 0) {
+    return { { { word, { first, second, 0 } } } };
+}
+
+/**
+ * @brief Builds an item of one jump to another item
+ */
+static item jump(uint32_t word, int64_t target) {
+    return { { { word, { 0, 0, 0 }, target } } };
+}
+
+/**
+ * @brief Lists the hand-written programs
+ */
+static vector<directed> directed_programs(void) {
+    constexpr auto rd = addressing::register_direct;
+    constexpr auto imm = addressing::immediate;
+
+    setup user = { vector<uint64_t>(16), { budget }, true, false, false, true };
+    setup flat = { vector<uint64_t>(16), { budget }, false, false, false };
+    setup paged = { vector<uint64_t>(16), { budget }, false, true, false };
+
+    // the jmp skips the first add, and is a coverage site taken once
+    auto counted = [](machine &m) -> string {
+        if (m.vm._r[cpu_reg::r0].q != 0 || m.vm._r[cpu_reg::r1].q != 1) {
+            return "the jmp went astray";
+        }
+
+        if (m.cover && (m.cover->sites().empty() || m.cover->sites()[0].address != 0 || m.cover->sites()[0].taken != 1)) {
+            return "the jmp is not counted";
+        }
+
+        return "";
+    };
+
+    // the first add runs once as written, then once with its immediate patched to 100
+    program patch = {
+        one(opc2(opcode::_add, rd, imm), cpu_reg::r0, 1),
+        one(opc2(opcode::_xor, addressing::direct, imm), sizeof(uint32_t) + sizeof(uint64_t), 1 ^ 100),
+        one(opc1(opcode::_inc, rd), cpu_reg::r1),
+        one(opc2(opcode::_cmp, rd, imm), cpu_reg::r1, 2),
+        jump(opc1(opcode::_jb, imm), 0),
+    };
+
+    auto patched = [](machine &m) -> string {
+        return m.vm._r[cpu_reg::r0].q == 101 ? "" : "r0 is " + to_string(m.vm._r[cpu_reg::r0].q) + ", not 101";
+    };
+
+    // only the kernel may set the system call entry
+    auto kept_out = [](machine &m) -> string {
+        return m.vm.msr(msr_syscall_entry) == 0 ? "" : "user mode ran wrmsr";
+    };
+
+    return {
+        { "and flags in user mode", {
+            one(opc2(opcode::_and, rd, imm), cpu_reg::flags, ~(uint64_t)cpu_flag::user),
+            one(opc2(opcode::_wrmsr, imm, imm), msr_syscall_entry, 0x1234),
+        }, user, kept_out },
+        { "pop flags in user mode", {
+            one(opc1(opcode::_push, imm), 0),
+            one(opc1(opcode::_pop, rd), cpu_reg::flags),
+            one(opc2(opcode::_wrmsr, imm, imm), msr_syscall_entry, 0x1234),
+        }, user, kept_out },
+        { "jmp under coverage", {
+            jump(opc1(opcode::_jmp, imm), 2),
+            one(opc2(opcode::_add, rd, imm), cpu_reg::r0, 1),
+            one(opc2(opcode::_add, rd, imm), cpu_reg::r1, 1),
+        }, flat, counted },
+        { "code that patches itself", patch, flat, patched },
+        { "code that patches itself through the page tables", patch, paged, patched },
+    };
+}
+
+int main(int argc, char **argv) {
+    auto count = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1000;
+    auto seed = argc > 2 ? strtoull(argv[2], nullptr, 0) : random_device()();
+
+    vector<engine> engines = {
+        { "single", nullptr, false, run_single },
+        { "stepped", nullptr, false, [](cpu &vm, uint64_t limit) { return vm.run_stepped(limit); } },
+        { "coverage", nullptr, true, [](cpu &vm, uint64_t limit) { return vm.run_stepped(limit); } },
+#if defined(__GNUC__)
+        { "threaded", nullptr, false, [](cpu &vm, uint64_t limit) { return vm.run_threaded(limit); } },
+#endif
+    };
+
+    for (auto kernels : { simd_kernels::sse2(), simd_kernels::avx2() }) {
+        if (kernels != nullptr) {
+            engines.push_back({ kernels->name, kernels, false, [](cpu &vm, uint64_t limit) { return vm.run_stepped(limit); } });
+        }
+    }
+
+    cout << "seed " << seed << ", engines:";
+
+    for (auto &e : engines) {
+        cout << " " << e.name;
+    }
+
+    cout << endl;
+
+    auto programs = directed_programs();
+
+    for (auto &d : programs) {
+        auto code = assemble(d.code);
+
+        for (auto &e : engines) {
+            machine m(e, code, d.start);
+            m.run(e, budget);
+
+            auto wrong = d.expect(m);
+
+            if (!wrong.empty()) {
+                cout << d.name << " fails on " << e.name << ": " << wrong << ", outcome " << m.outcome << endl;
+                return 1;
+            }
+        }
+    }
+
+    cout << programs.size() << " hand-written programs pass" << endl;
+
+    generator gen(seed);
+
+    for (uint64_t n = 0; n < count; n++) {
+        auto p = gen.generate(64);
+
+        setup s = { {}, {}, (n & 1) != 0, (n & 2) != 0, (n & 6) == 6 };
+
+        for (auto i = 0; i < 16; i++) {
+            s.registers.push_back(gen.value());
+        }
+
+        // odd block sizes end blocks in the middle of fused pairs
+        for (auto i = 0; i < 8; i++) {
+            s.blocks.push_back(1 + gen.value() % 32);
+        }
+
+        auto diff = check(engines, p, s);
+
+        if (diff.empty()) {
+            continue;
+        }
+
+        p = minimize(engines, p, s);
+
+        cout << "program " << n << " diverges: " << check(engines, p, s) << endl;
+        print(p);
+
+        cout << "  registers:" << hex;
+
+        for (auto r : s.registers) {
+            cout << " 0x" << r;
+        }
+
+        cout << endl << "  blocks:" << dec;
+
+        for (auto b : s.blocks) {
+            cout << " " << b;
+        }
+
+        cout << endl << "  exception handlers: " << (s.vectors ? "yes" : "no")
+             << ", paging: " << (s.paging ? s.read_only ? "read-only data" : "yes" : "no") << endl;
+
+        return 1;
+    }
+
+    cout << count << " programs agree over " << compared << " instructions" << endl;
+
+    return 0;
+}
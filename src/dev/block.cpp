@@ -0,0 +1,297 @@
+#include "./block.h"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /**
+     * @brief Opens the backing file
+     * @param cpu The cpu to interrupt; it must outlive the device
+     * @param bus The bus whose memory holds the ring and buffers; it must outlive the device
+     * @param path The host file
+     * @param read_only Whether to refuse writes
+     */
+    block_device::block_device(cpu &cpu, flat_bus &bus, const std::string &path, bool read_only)
+        : _cpu(cpu), _irq(cpu), _bus(bus), _read_only(read_only) {
+        this->_fd = ::open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+
+        if (this->_fd < 0) {
+            throw device_exception("Failed to open the block device file");
+        }
+
+        struct stat st = {};
+
+        if (::fstat(this->_fd, &st) != 0) {
+            ::close(this->_fd);
+            throw device_exception("Failed to stat the block device file");
+        }
+
+        this->_capacity = (uint64_t)st.st_size / block_device::sector_size;
+    }
+
+    block_device::~block_device(void) {
+        if (this->_event != 0) {
+            this->_cpu.cancel(this->_event);
+        }
+
+        ::close(this->_fd);
+    }
+
+    uint64_t block_device::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_ring:
+                return this->_ring;
+
+            case reg_size:
+                return this->_size;
+
+            case reg_vector:
+                return this->_vector;
+
+            case reg_status:
+                return this->_status;
+
+            case reg_capacity:
+                return this->_capacity;
+
+            default:
+                return 0;
+        }
+    }
+
+    void block_device::write(uint64_t offset, uint8_t /*width*/, uint64_t value) {
+        switch (offset) {
+            case reg_ring:
+                this->_ring = value;
+                break;
+
+            case reg_size:
+                this->_size = value;
+                break;
+
+            case reg_notify:
+                this->notify();
+                break;
+
+            case reg_vector:
+                this->_vector = value & 0xff;
+                break;
+
+            case reg_status:
+                this->_status &= ~value;
+
+                if (!(this->_status & 1)) {
+                    this->_irq.lower();
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @brief Serves every request between used and avail
+     * @details Requests are copied out of the ring first, so the guest cannot
+     * change them while they are being served. A ring that does not fit in
+     * guest memory is ignored.
+     */
+    void block_device::notify(void) {
+        auto memory = this->_bus.memory();
+
+        if (this->_size == 0 || (this->_size & (this->_size - 1)) != 0 ||
+            this->slot(0) < this->_ring || this->slot(0) > this->_bus.size() ||
+            this->_size > (this->_bus.size() - this->slot(0)) / sizeof(block_request)) {
+            return;
+        }
+
+        block_ring ring;
+        memcpy(&ring, memory + this->_ring, sizeof(ring));
+
+        auto pending = ring.avail - ring.used;
+
+        if (pending == 0 || pending > this->_size) {
+            return;
+        }
+
+        std::vector<block_request> batch(pending);
+
+        for (uint32_t i = 0; i < pending; i++) {
+            memcpy(&batch[i], memory + this->slot(ring.used + i), sizeof(block_request));
+        }
+
+        for (size_t first = 0; first < batch.size(); ) {
+            auto &head = batch[first];
+            size_t count = 1;
+
+            if (this->valid(head) && head.type != request_flush) {
+                // gather the following requests that continue this one on disk
+                while (first + count < batch.size() && count < IOV_MAX) {
+                    auto &prev = batch[first + count - 1];
+                    auto &next = batch[first + count];
+
+                    if (next.type != head.type || !this->valid(next) ||
+                        next.sector != prev.sector + prev.count) {
+                        break;
+                    }
+
+                    count++;
+                }
+            }
+
+            auto status = this->transfer(batch, first, count);
+
+            for (size_t i = first; i < first + count; i++) {
+                auto address = this->slot(ring.used + i) + offsetof(block_request, status);
+                memcpy(memory + address, &status, sizeof(status));
+                this->touch(address, sizeof(status));
+            }
+
+            first += count;
+        }
+
+        ring.used = ring.avail;
+        memcpy(memory + this->_ring + offsetof(block_ring, used), &ring.used, sizeof(ring.used));
+        this->touch(this->_ring + offsetof(block_ring, used), sizeof(ring.used));
+
+        this->_status |= 1;
+
+        // interrupt once the notifying instruction has retired
+        if (this->_event == 0) {
+            this->_event = this->_cpu.schedule(1, [this]() {
+                this->_event = 0;
+                this->_irq.raise(this->_vector);
+            });
+        }
+    }
+
+    /**
+     * @brief Serves a run of requests that can be done with one host call
+     * @param batch The requests copied out of the ring
+     * @param first The index of the first request in the run
+     * @param count The number of requests in the run
+     * @return The status for every request in the run
+     */
+    block_device::request_status block_device::transfer(std::vector<block_request> &batch, size_t first, size_t count) {
+        auto &head = batch[first];
+
+        if (!this->valid(head)) {
+            return status_unsupported;
+        }
+
+        if (head.type == request_flush) {
+            return ::fdatasync(this->_fd) == 0 ? status_ok : status_io_error;
+        }
+
+        if (head.type == request_write && this->_read_only) {
+            return status_unsupported;
+        }
+
+        std::vector<struct iovec> iov(count);
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            auto &request = batch[first + i];
+
+            iov[i].iov_base = this->_bus.memory() + request.address;
+            iov[i].iov_len = request.count * block_device::sector_size;
+            total += iov[i].iov_len;
+        }
+
+        auto offset = (off_t)(head.sector * block_device::sector_size);
+        uint64_t done = 0;
+        size_t next = 0;
+
+        while (done < total) {
+            auto n = head.type == request_read
+                     ? ::preadv(this->_fd, &iov[next], (int)(count - next), offset + (off_t)done)
+                     : ::pwritev(this->_fd, &iov[next], (int)(count - next), offset + (off_t)done);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                return status_io_error;
+            }
+
+            done += n;
+
+            // skip past what was transferred, for a short read or write
+            while (next < count && (uint64_t)n >= iov[next].iov_len) {
+                n -= iov[next].iov_len;
+                next++;
+            }
+
+            if (next < count) {
+                iov[next].iov_base = (uint8_t *)iov[next].iov_base + n;
+                iov[next].iov_len -= n;
+            }
+        }
+
+        if (head.type == request_read) {
+            for (size_t i = 0; i < count; i++) {
+                auto &request = batch[first + i];
+                this->touch(request.address, request.count * block_device::sector_size);
+            }
+        }
+
+        return status_ok;
+    }
+
+    /**
+     * @brief Retrieves the guest address of a request slot
+     * @param index The ring index
+     * @return The address of the slot
+     */
+    uint64_t block_device::slot(uint32_t index) const {
+        return this->_ring + sizeof(block_ring) + (index & (this->_size - 1)) * sizeof(block_request);
+    }
+
+    /**
+     * @brief Checks that a request fits the disk and guest memory
+     * @param request The request
+     * @return true if the request can be served
+     */
+    bool block_device::valid(const block_request &request) const {
+        if (request.type == request_flush) {
+            return true;
+        }
+
+        if (request.type != request_read && request.type != request_write) {
+            return false;
+        }
+
+        auto bytes = (uint64_t)request.count * block_device::sector_size;
+
+        return request.count != 0 &&
+               request.sector <= this->_capacity && request.count <= this->_capacity - request.sector &&
+               request.address <= this->_bus.size() && bytes <= this->_bus.size() - request.address;
+    }
+
+    /**
+     * @brief Marks the guest pages under a range as written by the device
+     * @param address The first byte written
+     * @param size The number of bytes written
+     */
+    void block_device::touch(uint64_t address, uint64_t size) {
+        auto pages = this->_bus.pages();
+        bool code = false;
+
+        for (auto page = address >> page_shift; size && page <= (address + size - 1) >> page_shift; page++) {
+            code |= (pages[page] & page_flag::page_code) != 0;
+            pages[page] |= page_flag::page_written;
+        }
+
+        if (code) {
+            this->_cpu.flush_decode_cache();
+        }
+    }
+
+}
@@ -0,0 +1,165 @@
+/**
+ * @file block.h
+ * @brief Block device backed by a host file
+*/
+
+#ifndef __mercury_dev_block_h__
+
+#define __mercury_dev_block_h__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../vm/cpu.h"
+#include "../vm/device.h"
+#include "../vm/flat_bus.h"
+#include "./pic.h"
+
+#include "../exc/device_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief A request slot in a block_device ring
+     */
+    struct block_request {
+        uint32_t type;              /* block_device::request_type */
+        uint32_t status;            /* block_device::request_status, written by the device */
+        uint64_t sector;            /* the first sector */
+        uint64_t address;           /* the guest address of the buffer */
+        uint32_t count;             /* the number of sectors */
+        uint32_t reserved;
+    };
+
+    /**
+     * @brief The header of a block_device ring, followed by its request slots
+     * @details Both indices count up forever; slot `i % size` holds request `i`.
+     */
+    struct block_ring {
+        uint32_t avail;             /* requests made available by the guest */
+        uint32_t used;              /* requests completed by the device */
+    };
+
+    /**
+     * @brief A block device that serves requests from a ring in guest memory
+     * @details The guest fills request slots in the ring, advances `avail` and
+     * writes the notify register. The device then serves every available
+     * request at once: adjacent requests of the same type on contiguous sectors
+     * go to the host file as a single preadv or pwritev, straight into or out
+     * of the guest memory, with no intermediate copies. It then writes each
+     * request's status, advances `used`, and raises one interrupt after the
+     * notifying instruction.
+     *
+     * Registers, all 64-bit:
+     * | Offset | Name     | Description                                      |
+     * |--------|----------|--------------------------------------------------|
+     * | 0x00   | ring     | guest address of the block_ring                  |
+     * | 0x08   | size     | number of request slots, a power of two          |
+     * | 0x10   | notify   | write to serve the available requests            |
+     * | 0x18   | vector   | the interrupt vector to raise                    |
+     * | 0x20   | status   | bit 0 set on completion; write 1 to clear        |
+     * | 0x28   | capacity | size of the disk in sectors, read only           |
+     */
+    class block_device : public device {
+    public:
+        enum block_register : uint64_t {
+            reg_ring = 0x00,
+            reg_size = 0x08,
+            reg_notify = 0x10,
+            reg_vector = 0x18,
+            reg_status = 0x20,
+            reg_capacity = 0x28,
+        };
+
+        enum request_type : uint32_t {
+            request_read = 0,
+            request_write = 1,
+            request_flush = 2,
+        };
+
+        enum request_status : uint32_t {
+            status_ok = 0,
+            status_io_error = 1,
+            status_unsupported = 2,
+        };
+
+        static constexpr uint64_t sector_size = 512;
+
+        /**
+         * @brief Opens the backing file
+         * @param cpu The cpu to interrupt; it must outlive the device
+         * @param bus The bus whose memory holds the ring and buffers; it must outlive the device
+         * @param path The host file
+         * @param read_only Whether to refuse writes
+         */
+        block_device(cpu &cpu, flat_bus &bus, const std::string &path, bool read_only = false);
+        ~block_device(void) override;
+
+        uint64_t size(void) const override { return 0x30; }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t offset, uint8_t width, uint64_t value) override;
+
+        /**
+         * @brief Routes the interrupt through a line of an interrupt controller, instead of the vector register
+         * @param pic The controller; it must outlive the device
+         * @param line The line
+         */
+        void connect(pic &pic, unsigned line) { this->_irq.connect(pic, line); }
+
+    private:
+        /**
+         * @brief Serves every request between used and avail
+         */
+        void notify(void);
+
+        /**
+         * @brief Serves a run of requests that can be done with one host call
+         * @param batch The requests copied out of the ring
+         * @param first The index of the first request in the run
+         * @param count The number of requests in the run
+         * @return The status for every request in the run
+         */
+        request_status transfer(std::vector<block_request> &batch, size_t first, size_t count);
+
+        /**
+         * @brief Retrieves the guest address of a request slot
+         * @param index The ring index
+         * @return The address of the slot
+         */
+        uint64_t slot(uint32_t index) const;
+
+        /**
+         * @brief Checks that a request fits the disk and guest memory
+         * @param request The request
+         * @return true if the request can be served
+         */
+        bool valid(const block_request &request) const;
+
+        /**
+         * @brief Marks the guest pages under a range as written by the device
+         * @details Flushes the cpu's decoded instructions if any of the pages held code.
+         * @param address The first byte written
+         * @param size The number of bytes written
+         */
+        void touch(uint64_t address, uint64_t size);
+
+        cpu &_cpu;
+        irq_line _irq;
+        flat_bus &_bus;
+
+        int _fd = -1;
+        bool _read_only;
+        uint64_t _capacity = 0;             /* in sectors */
+
+        uint64_t _ring = 0;
+        uint64_t _size = 0;
+        uint64_t _vector = 0;
+        uint64_t _status = 0;
+
+        uint64_t _event = 0;                /* the pending completion interrupt, or 0 */
+    };
+
+}
+
+#endif /* __mercury_dev_block_h__ */
@@ -0,0 +1,284 @@
+#include "./channel.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /**
+     * @brief Creates the shared memory and maps it into the guest
+     * @param cpu The cpu to schedule on and interrupt; it must outlive the channel
+     * @param bus The bus to map the shared memory into; it must outlive the channel
+     * @param base The guest address of the shared range, aligned to the host page size
+     * @param capacity The size of each ring: a power of two, at least one page
+     */
+    channel::channel(cpu &cpu, flat_bus &bus, uint64_t base, uint64_t capacity)
+        : _cpu(cpu), _irq(cpu), _shared(nullptr), _base(base), _capacity(capacity) {
+        if (capacity < page_size || (capacity & (capacity - 1)) != 0) {
+            throw device_exception("Channel capacity must be a power of two of at least a page");
+        }
+
+        auto size = channel::rings + 2 * capacity;
+
+        this->_fd = ::memfd_create("mercury-channel", MFD_CLOEXEC);
+
+        if (this->_fd < 0 || ::ftruncate(this->_fd, (off_t)size) != 0) {
+            if (this->_fd >= 0) {
+                ::close(this->_fd);
+            }
+
+            throw device_exception("Failed to create the channel memory");
+        }
+
+        this->_doorbell = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (this->_doorbell < 0) {
+            ::close(this->_fd);
+            throw device_exception("Failed to create the channel doorbell");
+        }
+
+        try {
+            bus.share(base, this->_fd, 0, size);
+        } catch (const std::exception &) {
+            ::close(this->_doorbell);
+            ::close(this->_fd);
+            throw device_exception("Failed to map the channel memory into the guest");
+        }
+
+        this->_shared = bus.memory() + base;
+        this->store(channel::ring_capacity, capacity);
+    }
+
+    channel::~channel(void) {
+        if (this->_event != 0) {
+            this->_cpu.cancel(this->_event);
+        }
+
+        ::close(this->_doorbell);
+        ::close(this->_fd);
+    }
+
+    uint64_t channel::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_control:
+                return this->_control;
+
+            case reg_vector:
+                return this->_vector;
+
+            case reg_status:
+                return this->_status;
+
+            case reg_base:
+                return this->_base;
+
+            case reg_capacity:
+                return this->_capacity;
+
+            default:
+                return 0;
+        }
+    }
+
+    void channel::write(uint64_t offset, uint8_t /*width*/, uint64_t value) {
+        switch (offset) {
+            case reg_doorbell: {
+                uint64_t one = 1;
+                (void)!::write(this->_doorbell, &one, sizeof(one));
+                break;
+            }
+
+            case reg_control:
+                this->_control = value & control_interrupt;
+                this->arm();
+                break;
+
+            case reg_vector:
+                this->_vector = value & 0xff;
+                break;
+
+            case reg_status:
+                this->_status &= ~value;
+
+                if (!(this->_status & 1)) {
+                    this->_irq.lower();
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @brief Sends a record to the guest
+     * @details The record is written in full before the head is published, so
+     * the guest never sees part of one.
+     * @param data The record
+     * @param size The size of the record in bytes
+     * @return false if the ring does not have room for it yet
+     */
+    bool channel::send(const void *data, uint32_t size) {
+        auto ring = this->_shared + channel::rings;
+        auto head = this->load(channel::to_guest_head);
+        auto tail = this->load(channel::to_guest_tail);
+        uint64_t need = channel::record_header + ((size + 7ull) & ~7ull);
+        auto offset = head & (this->_capacity - 1);
+        auto skip = offset + need > this->_capacity ? this->_capacity - offset : 0;
+
+        if (need > this->_capacity || head + skip + need - tail > this->_capacity) {
+            return false;
+        }
+
+        if (skip) {
+            memcpy(ring + offset, &channel::record_skip, sizeof(uint32_t));
+            head += skip;
+            offset = 0;
+        }
+
+        memcpy(ring + offset, &size, sizeof(size));
+        memcpy(ring + offset + channel::record_header, data, size);
+
+        this->store(channel::to_guest_head, head + need);
+        this->_sent = true;
+
+        return true;
+    }
+
+    /**
+     * @brief Looks at the next record from the guest without copying it
+     * @param size Receives the size of the record
+     * @return The record in shared memory, or nullptr if there is none
+     */
+    const uint8_t *channel::peek(uint32_t &size) {
+        auto ring = this->_shared + channel::rings + this->_capacity;
+        auto tail = this->load(channel::to_host_tail);
+        auto head = this->load(channel::to_host_head);
+
+        for (;;) {
+            if (tail == head) {
+                return nullptr;
+            }
+
+            auto offset = tail & (this->_capacity - 1);
+            uint32_t length;
+
+            memcpy(&length, ring + offset, sizeof(length));
+
+            if (length == channel::record_skip) {
+                tail += this->_capacity - offset;
+                this->store(channel::to_host_tail, tail);
+                continue;
+            }
+
+            // a guest that lies about the length only gets a short record
+            if (length > this->_capacity - offset - channel::record_header) {
+                length = (uint32_t)(this->_capacity - offset - channel::record_header);
+            }
+
+            size = length;
+            this->_peeked = tail + channel::record_header + ((length + 7ull) & ~7ull);
+
+            return ring + offset + channel::record_header;
+        }
+    }
+
+    /**
+     * @brief Releases the record returned by peek() back to the guest
+     */
+    void channel::consume(void) {
+        if (this->_peeked != 0) {
+            this->store(channel::to_host_tail, this->_peeked);
+            this->_peeked = 0;
+        }
+    }
+
+    /**
+     * @brief Copies out the next record from the guest
+     * @param record Receives the record
+     * @return false if there is none
+     */
+    bool channel::receive(std::vector<uint8_t> &record) {
+        uint32_t size;
+        auto data = this->peek(size);
+
+        if (!data) {
+            return false;
+        }
+
+        record.assign(data, data + size);
+        this->consume();
+
+        return true;
+    }
+
+    /**
+     * @brief Waits for the guest to ring the doorbell
+     * @param timeout The longest to wait in milliseconds, or -1 to wait forever
+     * @return true if the doorbell was rung
+     */
+    bool channel::wait(int timeout) {
+        struct pollfd pfd = { this->_doorbell, POLLIN, 0 };
+
+        while (::poll(&pfd, 1, timeout) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+
+        uint64_t count;
+        return ::read(this->_doorbell, &count, sizeof(count)) == sizeof(count);
+    }
+
+    /**
+     * @brief Starts or stops polling for sent records to match the control register
+     */
+    void channel::arm(void) {
+        if (!(this->_control & control_interrupt)) {
+            if (this->_event != 0) {
+                this->_cpu.cancel(this->_event);
+                this->_event = 0;
+            }
+
+            return;
+        }
+
+        if (this->_event == 0) {
+            this->_event = this->_cpu.schedule(channel::poll_quantum, [this]() { this->poll(); });
+        }
+    }
+
+    /**
+     * @brief Called by the cpu every poll_quantum instructions while interrupts are on
+     */
+    void channel::poll(void) {
+        this->_event = 0;
+
+        if (this->_sent.exchange(false)) {
+            this->_status |= 1;
+            this->_irq.raise(this->_vector);
+        }
+
+        this->arm();
+    }
+
+    /**
+     * @brief Reads an index from the shared range, ordered before the data it covers
+     */
+    uint64_t channel::load(uint64_t offset) const {
+        return __atomic_load_n((const uint64_t *)(this->_shared + offset), __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief Publishes an index to the shared range, ordered after the data it covers
+     */
+    void channel::store(uint64_t offset, uint64_t value) {
+        __atomic_store_n((uint64_t *)(this->_shared + offset), value, __ATOMIC_RELEASE);
+    }
+
+}
@@ -0,0 +1,192 @@
+/**
+ * @file channel.h
+ * @brief Shared-memory channel between the host and the guest
+*/
+
+#ifndef __mercury_dev_channel_h__
+
+#define __mercury_dev_channel_h__
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "../vm/cpu.h"
+#include "../vm/device.h"
+#include "../vm/flat_bus.h"
+#include "./pic.h"
+
+#include "../exc/device_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief Streams records between the host and the guest through shared memory
+     * @details The channel creates a memfd and maps it over a range of guest
+     * memory, so the host and the guest read and write the same pages with
+     * no copies in between. The range holds two single-producer,
+     * single-consumer rings, one in each direction. Each side only stores
+     * its own index, so neither needs a lock, and neither needs the device
+     * registers to move data.
+     *
+     * The registers are only used to wake the other side. The guest writes
+     * the doorbell, which signals an eventfd the host can wait on. The host
+     * sends records, and while interrupts are enabled the channel checks
+     * every poll_quantum instructions whether to raise one.
+     *
+     * Layout of the shared range, from its base:
+     * | Offset           | Description                                      |
+     * |------------------|--------------------------------------------------|
+     * | 0x000            | to_guest head, bytes sent by the host            |
+     * | 0x040            | to_guest tail, bytes taken by the guest          |
+     * | 0x080            | to_host head, bytes sent by the guest            |
+     * | 0x0c0            | to_host tail, bytes taken by the host            |
+     * | 0x100            | capacity of each ring in bytes                   |
+     * | 0x1000           | the to_guest ring                                |
+     * | 0x1000+capacity  | the to_host ring                                 |
+     *
+     * Indices are 64-bit byte counts that only grow; a record at index i
+     * starts at offset i % capacity of its ring. A record is a 32-bit length,
+     * 32 reserved bits and the data, padded to 8 bytes. Records do not wrap:
+     * a length of 0xffffffff tells the reader to skip to the start of the ring.
+     *
+     * Registers, all 64-bit:
+     * | Offset | Name     | Description                                     |
+     * |--------|----------|-------------------------------------------------|
+     * | 0x00   | doorbell | write to wake the host                          |
+     * | 0x08   | control  | bit 0 interrupt when the host sends             |
+     * | 0x10   | vector   | the interrupt vector to raise                   |
+     * | 0x18   | status   | bit 0 host has sent; write 1 to clear           |
+     * | 0x20   | base     | guest address of the shared range, read only    |
+     * | 0x28   | capacity | capacity of each ring in bytes, read only       |
+     */
+    class channel : public device {
+    public:
+        enum channel_register : uint64_t {
+            reg_doorbell = 0x00,
+            reg_control = 0x08,
+            reg_vector = 0x10,
+            reg_status = 0x18,
+            reg_base = 0x20,
+            reg_capacity = 0x28,
+        };
+
+        enum channel_layout : uint64_t {
+            to_guest_head = 0x000,
+            to_guest_tail = 0x040,
+            to_host_head = 0x080,
+            to_host_tail = 0x0c0,
+            ring_capacity = 0x100,
+            rings = 0x1000,
+        };
+
+        enum channel_control : uint64_t {
+            control_interrupt = 0x01,
+        };
+
+        static constexpr uint32_t record_header = 8;
+        static constexpr uint32_t record_skip = 0xffffffff;
+        static constexpr uint64_t poll_quantum = 1 << 14;
+
+        /**
+         * @brief Creates the shared memory and maps it into the guest
+         * @param cpu The cpu to schedule on and interrupt; it must outlive the channel
+         * @param bus The bus to map the shared memory into; it must outlive the channel
+         * @param base The guest address of the shared range, aligned to the host page size
+         * @param capacity The size of each ring: a power of two, at least one page
+         */
+        channel(cpu &cpu, flat_bus &bus, uint64_t base, uint64_t capacity);
+        ~channel(void) override;
+
+        uint64_t size(void) const override { return 0x30; }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t offset, uint8_t width, uint64_t value) override;
+
+        /**
+         * @brief Routes the interrupt through a line of an interrupt controller, instead of the vector register
+         * @param pic The controller; it must outlive the channel
+         * @param line The line
+         */
+        void connect(pic &pic, unsigned line) { this->_irq.connect(pic, line); }
+
+        /**
+         * @brief Sends a record to the guest
+         * @details Only one host thread may send at a time.
+         * @param data The record
+         * @param size The size of the record in bytes
+         * @return false if the ring does not have room for it yet
+         */
+        bool send(const void *data, uint32_t size);
+
+        /**
+         * @brief Looks at the next record from the guest without copying it
+         * @details Only one host thread may receive at a time.
+         * @param size Receives the size of the record
+         * @return The record in shared memory, or nullptr if there is none
+         */
+        const uint8_t *peek(uint32_t &size);
+
+        /**
+         * @brief Releases the record returned by peek() back to the guest
+         */
+        void consume(void);
+
+        /**
+         * @brief Copies out the next record from the guest
+         * @param record Receives the record
+         * @return false if there is none
+         */
+        bool receive(std::vector<uint8_t> &record);
+
+        /**
+         * @brief Waits for the guest to ring the doorbell
+         * @param timeout The longest to wait in milliseconds, or -1 to wait forever
+         * @return true if the doorbell was rung
+         */
+        bool wait(int timeout);
+
+        /**
+         * @brief Retrieves the eventfd the doorbell signals, for use with poll()
+         */
+        int doorbell(void) const { return this->_doorbell; }
+
+        /**
+         * @brief Retrieves the memfd behind the shared range, for other processes to map
+         */
+        int fd(void) const { return this->_fd; }
+
+    private:
+        /**
+         * @brief Starts or stops polling for sent records to match the control register
+         */
+        void arm(void);
+
+        /**
+         * @brief Called by the cpu every poll_quantum instructions while interrupts are on
+         */
+        void poll(void);
+
+        uint64_t load(uint64_t offset) const;
+        void store(uint64_t offset, uint64_t value);
+
+        cpu &_cpu;
+        irq_line _irq;
+        uint8_t *_shared;                   /* the shared range in host memory */
+        uint64_t _base;
+        uint64_t _capacity;
+
+        int _fd = -1;
+        int _doorbell = -1;
+
+        uint64_t _control = 0;
+        uint64_t _vector = 0;
+        uint64_t _status = 0;
+        std::atomic<bool> _sent{false};     /* the host has sent since the last poll */
+
+        uint64_t _peeked = 0;               /* the to_host tail after the peeked record, or 0 */
+        uint64_t _event = 0;                /* the scheduled poll, or 0 */
+    };
+
+}
+
+#endif /* __mercury_dev_channel_h__ */
@@ -0,0 +1,261 @@
+#include "./console.h"
+
+#include <cerrno>
+
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /**
+     * @brief Creates the console and starts its host threads
+     * @param cpu The cpu to schedule on and interrupt; it must outlive the console
+     * @param output The host file to send guest output to
+     * @param input The host file to read guest input from, or -1 for none
+     */
+    console::console(cpu &cpu, int output, int input)
+        : _cpu(cpu), _irq(cpu), _output(output), _input(input) {
+        this->_transmitter = std::thread([this]() { this->transmitter(); });
+
+        if (this->_input >= 0) {
+            this->_receiver = std::thread([this]() { this->receiver(); });
+        }
+    }
+
+    console::~console(void) {
+        if (this->_event != 0) {
+            this->_cpu.cancel(this->_event);
+        }
+
+        this->_stop = true;
+        this->wake();
+
+        this->_transmitter.join();
+
+        if (this->_receiver.joinable()) {
+            this->_receiver.join();
+        }
+    }
+
+    uint64_t console::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_data: {
+                uint8_t value = 0;
+
+                this->_rx.pop(value);
+
+                // the next byte to arrive deserves its own interrupt
+                if (this->_rx.empty()) {
+                    this->_signalled = false;
+                    this->_irq.lower();
+                }
+
+                return value;
+            }
+
+            case reg_status:
+                return (this->_rx.empty() ? 0 : (uint64_t)status_ready) |
+                       (this->_overrun ? (uint64_t)status_overrun : 0);
+
+            case reg_control:
+                return this->_control;
+
+            case reg_vector:
+                return this->_vector;
+
+            default:
+                return 0;
+        }
+    }
+
+    void console::write(uint64_t offset, uint8_t /*width*/, uint64_t value) {
+        switch (offset) {
+            case reg_data:
+                // only a guest a whole buffer ahead of the host has to wait
+                while (!this->_tx.push((uint8_t)value)) {
+                    this->wake();
+                    std::this_thread::yield();
+                }
+
+                // one wakeup per sleep; the transmitter collects the rest itself
+                if (this->_waiting.load() && this->_waiting.exchange(false)) {
+                    this->wake();
+                }
+                break;
+
+            case reg_status:
+                if (value & status_overrun) {
+                    this->_overrun = false;
+                }
+                break;
+
+            case reg_control:
+                this->_control = value & control_rx_interrupt;
+                this->arm();
+                break;
+
+            case reg_vector:
+                this->_vector = value & 0xff;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @brief Queues input for the guest
+     * @param data The bytes to queue
+     * @param size The number of bytes
+     * @return The number of bytes queued; the rest did not fit and set the overrun bit
+     */
+    uint64_t console::receive(const void *data, uint64_t size) {
+        auto bytes = (const uint8_t *)data;
+
+        for (uint64_t i = 0; i < size; i++) {
+            if (!this->_rx.push(bytes[i])) {
+                this->_overrun = true;
+                return i;
+            }
+        }
+
+        return size;
+    }
+
+    /**
+     * @brief Waits until all guest output so far has been written to the host
+     */
+    void console::flush(void) {
+        while (!this->_tx.empty()) {
+            this->wake();
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * @brief Writes guest output to the host as it accumulates
+     * @details Everything queued while the previous write was in progress goes
+     * out in the next one, so the busier the guest the larger the writes.
+     * Output that the host refuses is dropped rather than stalling the guest.
+     */
+    void console::transmitter(void) {
+        for (;;) {
+            const uint8_t *first;
+            uint32_t first_size, second_size;
+
+            this->_tx.peek(first, first_size, second_size);
+
+            if (first_size == 0) {
+                if (this->_stop) {
+                    return;
+                }
+
+                // the producer checks _waiting after publishing, so no wakeup is lost
+                std::unique_lock<std::mutex> lock(this->_lock);
+                this->_waiting = true;
+
+                this->_wakeup.wait(lock, [this]() { return this->_stop || !this->_tx.empty(); });
+                this->_waiting = false;
+
+                // let a burst of output build up rather than writing its first byte alone
+                this->_wakeup.wait_for(lock, console::linger, [this]() {
+                    return this->_stop || this->_tx.size() >= console::tx_capacity / 2;
+                });
+                continue;
+            }
+
+            struct iovec iov[2] = {
+                { (void *)first, first_size },
+                { (void *)this->_tx.data(), second_size },
+            };
+
+            auto n = ::writev(this->_output, iov, second_size ? 2 : 1);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            this->_tx.consume(n < 0 ? first_size + second_size : (uint32_t)n);
+        }
+    }
+
+    /**
+     * @brief Reads host input into the receive FIFO
+     * @details Stops at the end of the input file. The wait is bounded so
+     * that the thread notices the console being destroyed.
+     */
+    void console::receiver(void) {
+        uint8_t buffer[256];
+
+        while (!this->_stop) {
+            struct pollfd pfd = { this->_input, POLLIN, 0 };
+
+            auto ready = ::poll(&pfd, 1, 100);
+
+            if (ready < 0 && errno != EINTR) {
+                return;
+            }
+
+            if (ready <= 0) {
+                continue;
+            }
+
+            auto n = ::read(this->_input, buffer, sizeof(buffer));
+
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+
+            if (n <= 0) {
+                return;
+            }
+
+            this->receive(buffer, (uint64_t)n);
+        }
+    }
+
+    /**
+     * @brief Wakes the transmitter if it is waiting for output
+     */
+    void console::wake(void) {
+        {
+            std::lock_guard<std::mutex> lock(this->_lock);
+        }
+
+        this->_wakeup.notify_one();
+    }
+
+    /**
+     * @brief Starts or stops polling the receive FIFO to match the control register
+     */
+    void console::arm(void) {
+        if (!(this->_control & control_rx_interrupt)) {
+            if (this->_event != 0) {
+                this->_cpu.cancel(this->_event);
+                this->_event = 0;
+            }
+
+            return;
+        }
+
+        if (this->_event == 0) {
+            this->_event = this->_cpu.schedule(console::poll_quantum, [this]() { this->poll(); });
+        }
+    }
+
+    /**
+     * @brief Called by the cpu every poll_quantum instructions while receive interrupts are on
+     */
+    void console::poll(void) {
+        this->_event = 0;
+
+        if (!this->_signalled && !this->_rx.empty()) {
+            this->_signalled = true;
+            this->_irq.raise(this->_vector);
+        }
+
+        this->arm();
+    }
+
+}
@@ -0,0 +1,234 @@
+/**
+ * @file console.h
+ * @brief UART-style serial console
+*/
+
+#ifndef __mercury_dev_console_h__
+
+#define __mercury_dev_console_h__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "../vm/cpu.h"
+#include "../vm/device.h"
+#include "./pic.h"
+
+namespace mercury {
+
+    /**
+     * @brief A single-producer, single-consumer byte queue that needs no locks
+     * @details Each index is only ever stored by one side, so pushing and
+     * popping are a handful of loads and stores. Capacity must be a power of two.
+     */
+    template <uint32_t Capacity>
+    class byte_fifo {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    public:
+        /**
+         * @brief Appends a byte; producer side only
+         * @return false if the queue is full
+         */
+        bool push(uint8_t value) {
+            auto head = this->_head.load(std::memory_order_relaxed);
+
+            if (head - this->_tail.load(std::memory_order_acquire) == Capacity) {
+                return false;
+            }
+
+            this->_data[head & (Capacity - 1)] = value;
+            this->_head.store(head + 1, std::memory_order_seq_cst);
+            return true;
+        }
+
+        /**
+         * @brief Removes the oldest byte; consumer side only
+         * @return false if the queue is empty
+         */
+        bool pop(uint8_t &value) {
+            auto tail = this->_tail.load(std::memory_order_relaxed);
+
+            if (tail == this->_head.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            value = this->_data[tail & (Capacity - 1)];
+            this->_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @brief Retrieves the queued bytes as at most two contiguous spans; consumer side only
+         * @param first Receives the start of the first span
+         * @param first_size Receives the size of the first span
+         * @param second_size Receives the size of the span that wraps to the start of the buffer
+         */
+        void peek(const uint8_t *&first, uint32_t &first_size, uint32_t &second_size) const {
+            auto tail = this->_tail.load(std::memory_order_relaxed);
+            auto count = this->_head.load(std::memory_order_acquire) - tail;
+            auto start = tail & (Capacity - 1);
+
+            first = &this->_data[start];
+            first_size = count < Capacity - start ? count : Capacity - start;
+            second_size = count - first_size;
+        }
+
+        /**
+         * @brief Discards bytes returned by peek(); consumer side only
+         */
+        void consume(uint32_t count) {
+            this->_tail.store(this->_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+        }
+
+        uint32_t size(void) const {
+            return this->_head.load(std::memory_order_acquire) - this->_tail.load(std::memory_order_acquire);
+        }
+
+        bool empty(void) const {
+            return this->_tail.load(std::memory_order_acquire) == this->_head.load(std::memory_order_acquire);
+        }
+
+        const uint8_t *data(void) const { return this->_data; }
+
+    private:
+        alignas(64) std::atomic<uint32_t> _head{0};
+        alignas(64) std::atomic<uint32_t> _tail{0};
+        uint8_t _data[Capacity];
+    };
+
+    /**
+     * @brief A serial console that buffers guest output and queues host input
+     * @details A byte written to the data register is appended to a lock-free
+     * transmit buffer and the guest carries on; a host thread writes whatever
+     * has accumulated to the output file in one call, waiting up to linger
+     * after the first byte of a burst so that the rest of it goes in the same
+     * write. The guest only waits if it gets a whole buffer ahead of the host.
+     *
+     * Input arrives through receive(), or from a host thread reading the input
+     * file, and is queued in a receive FIFO. While receive interrupts are
+     * enabled the console checks the FIFO every poll_quantum instructions, and
+     * raises an interrupt when it has data the guest has not been told about.
+     *
+     * Registers, all 64-bit:
+     * | Offset | Name    | Description                                             |
+     * |--------|---------|---------------------------------------------------------|
+     * | 0x00   | data    | write to send a byte; read to take a received byte      |
+     * | 0x08   | status  | bit 0 data received, bit 1 overrun; write 2 to clear    |
+     * | 0x10   | control | bit 0 interrupt on receive                              |
+     * | 0x18   | vector  | the interrupt vector to raise                           |
+     */
+    class console : public device {
+    public:
+        enum console_register : uint64_t {
+            reg_data = 0x00,
+            reg_status = 0x08,
+            reg_control = 0x10,
+            reg_vector = 0x18,
+        };
+
+        enum console_status : uint64_t {
+            status_ready = 0x01,
+            status_overrun = 0x02,
+        };
+
+        enum console_control : uint64_t {
+            control_rx_interrupt = 0x01,
+        };
+
+        static constexpr uint32_t tx_capacity = 1 << 16;
+        static constexpr uint32_t rx_capacity = 1 << 12;
+        static constexpr uint64_t poll_quantum = 1 << 14;
+        static constexpr std::chrono::microseconds linger{500};
+
+        /**
+         * @brief Creates the console and starts its host threads
+         * @param cpu The cpu to schedule on and interrupt; it must outlive the console
+         * @param output The host file to send guest output to
+         * @param input The host file to read guest input from, or -1 for none
+         */
+        explicit console(cpu &cpu, int output = 1, int input = -1);
+        ~console(void) override;
+
+        uint64_t size(void) const override { return 0x20; }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t offset, uint8_t width, uint64_t value) override;
+
+        /**
+         * @brief Routes the interrupt through a line of an interrupt controller, instead of the vector register
+         * @param pic The controller; it must outlive the console
+         * @param line The line
+         */
+        void connect(pic &pic, unsigned line) { this->_irq.connect(pic, line); }
+
+        /**
+         * @brief Queues input for the guest
+         * @details May be called from any one host thread at a time, but not
+         * while the console is reading an input file of its own.
+         * @param data The bytes to queue
+         * @param size The number of bytes
+         * @return The number of bytes queued; the rest did not fit and set the overrun bit
+         */
+        uint64_t receive(const void *data, uint64_t size);
+
+        /**
+         * @brief Waits until all guest output so far has been written to the host
+         */
+        void flush(void);
+
+    private:
+        /**
+         * @brief Writes guest output to the host as it accumulates
+         */
+        void transmitter(void);
+
+        /**
+         * @brief Reads host input into the receive FIFO
+         */
+        void receiver(void);
+
+        /**
+         * @brief Wakes the transmitter if it is waiting for output
+         */
+        void wake(void);
+
+        /**
+         * @brief Starts or stops polling the receive FIFO to match the control register
+         */
+        void arm(void);
+
+        /**
+         * @brief Called by the cpu every poll_quantum instructions while receive interrupts are on
+         */
+        void poll(void);
+
+        cpu &_cpu;
+        irq_line _irq;
+        int _output;
+        int _input;
+
+        byte_fifo<tx_capacity> _tx;
+        byte_fifo<rx_capacity> _rx;
+
+        uint64_t _control = 0;
+        uint64_t _vector = 0;
+        std::atomic<bool> _overrun{false};
+        bool _signalled = false;            /* an interrupt was raised for the data in the FIFO */
+
+        uint64_t _event = 0;                /* the scheduled receive poll, or 0 */
+
+        std::atomic<bool> _stop{false};
+        std::atomic<bool> _waiting{false};  /* the transmitter is asleep */
+        std::mutex _lock;
+        std::condition_variable _wakeup;
+        std::thread _transmitter;
+        std::thread _receiver;
+    };
+
+}
+
+#endif /* __mercury_dev_console_h__ */
@@ -0,0 +1,326 @@
+#include "./framebuffer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+
+namespace mercury {
+
+    /**
+     * @brief Continues a CRC-32 over more data, as used by PNG chunks
+     */
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+        static const auto table = []() {
+            std::array<uint32_t, 256> t{};
+
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+
+                t[n] = c;
+            }
+
+            return t;
+        }();
+
+        crc = ~crc;
+
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+
+        return ~crc;
+    }
+
+    static void put32(std::vector<uint8_t> &out, uint32_t value) {
+        out.push_back(value >> 24);
+        out.push_back(value >> 16);
+        out.push_back(value >> 8);
+        out.push_back(value);
+    }
+
+    /**
+     * @brief Writes one PNG chunk: length, type, data and CRC
+     */
+    static void png_chunk(std::ostream &out, const char *type, const std::vector<uint8_t> &data) {
+        std::vector<uint8_t> chunk;
+
+        put32(chunk, (uint32_t)data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        put32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+
+        out.write((const char *)chunk.data(), chunk.size());
+    }
+
+    /**
+     * @brief Creates the framebuffer over a region of memory
+     * @param bus The bus whose memory holds the pixels; it must outlive the framebuffer
+     * @param base The guest address of the first pixel
+     * @param width The width in pixels
+     * @param height The height in pixels
+     */
+    framebuffer::framebuffer(flat_bus &bus, uint64_t base, uint32_t width, uint32_t height)
+        : _bus(bus), _base(base), _width(width), _height(height),
+          _stride((uint64_t)width * framebuffer::bytes_per_pixel) {
+        if (width == 0 || height == 0) {
+            throw device_exception("Framebuffer must not be empty");
+        }
+
+        if (base > bus.size() || this->_stride * height > bus.size() - base) {
+            throw device_exception("Framebuffer must lie inside memory");
+        }
+
+        this->_frame.resize(this->_stride * height);
+    }
+
+    uint64_t framebuffer::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_base:
+                return this->_base;
+
+            case reg_width:
+                return this->_width;
+
+            case reg_height:
+                return this->_height;
+
+            case reg_stride:
+                return this->_stride;
+
+            case reg_format:
+                return format_xrgb8888;
+
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * @brief Takes in the guest's drawing since the last update
+     * @details Only runs of pages with page_frame set are compared, and their
+     * flags are cleared, so the cost follows what the guest drew rather than
+     * the size of the framebuffer.
+     * @return The rectangles that changed, top to bottom
+     */
+    std::vector<fb_rect> framebuffer::update(void) {
+        auto pages = this->_bus.pages();
+        auto size = this->_stride * this->_height;
+        auto first_page = this->_base >> page_shift;
+        auto last_page = (this->_base + size - 1) >> page_shift;
+
+        std::vector<fb_rect> rects;
+
+        if (this->_updates++ == 0) {
+            for (auto page = first_page; page <= last_page; page++) {
+                pages[page] &= ~page_flag::page_frame;
+            }
+
+            memcpy(this->_frame.data(), this->_bus.memory() + this->_base, size);
+            rects.push_back({ 0, 0, this->_width, this->_height });
+            return rects;
+        }
+
+        for (auto page = first_page; page <= last_page; ) {
+            if (!(pages[page] & page_flag::page_frame)) {
+                page++;
+                continue;
+            }
+
+            auto run = page;
+
+            while (page <= last_page && (pages[page] & page_flag::page_frame)) {
+                pages[page] &= ~page_flag::page_frame;
+                page++;
+            }
+
+            auto start = std::max(run << page_shift, this->_base) - this->_base;
+            auto end = std::min(page << page_shift, this->_base + size) - this->_base;
+
+            this->compare((uint32_t)(start / this->_stride), (uint32_t)((end - 1) / this->_stride), rects);
+        }
+
+        return rects;
+    }
+
+    /**
+     * @brief Compares a band of rows against the last frame and takes in the differences
+     * @details Consecutive changed rows are merged into one rectangle as wide
+     * as the widest change among them.
+     * @param first The first row
+     * @param last The last row
+     * @param rects Receives the rectangles that changed
+     */
+    void framebuffer::compare(uint32_t first, uint32_t last, std::vector<fb_rect> &rects) {
+        auto memory = this->_bus.memory() + this->_base;
+        const auto bpp = framebuffer::bytes_per_pixel;
+
+        fb_rect rect = {};
+        bool open = false;
+
+        for (auto y = first; y <= last; y++) {
+            auto row = memory + y * this->_stride;
+            auto seen = this->_frame.data() + y * this->_stride;
+
+            if (memcmp(row, seen, this->_stride) == 0) {
+                if (open) {
+                    rects.push_back(rect);
+                    open = false;
+                }
+
+                continue;
+            }
+
+            uint32_t left = 0, right = this->_width - 1;
+
+            while (memcmp(row + left * bpp, seen + left * bpp, bpp) == 0) {
+                left++;
+            }
+
+            while (memcmp(row + right * bpp, seen + right * bpp, bpp) == 0) {
+                right--;
+            }
+
+            memcpy(seen, row, this->_stride);
+
+            if (!open) {
+                rect = { left, y, right - left + 1, 1 };
+                open = true;
+                continue;
+            }
+
+            auto x0 = std::min(rect.x, left);
+            auto x1 = std::max(rect.x + rect.width - 1, right);
+
+            rect.x = x0;
+            rect.width = x1 - x0 + 1;
+            rect.height++;
+        }
+
+        if (open) {
+            rects.push_back(rect);
+        }
+    }
+
+    /**
+     * @brief Encodes part of the frame as of the last update as a PNG image
+     * @details The image is 8-bit RGB, and the zlib stream uses stored blocks
+     * so that no compression library is needed; regression snapshots are
+     * compared, not archived.
+     * @param out The stream to write to
+     * @param rect The part of the frame to encode
+     */
+    void framebuffer::write_png(std::ostream &out, const fb_rect &rect) const {
+        this->check(rect);
+
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        out.write((const char *)signature, sizeof(signature));
+
+        std::vector<uint8_t> header;
+        put32(header, rect.width);
+        put32(header, rect.height);
+        header.insert(header.end(), { 8, 2, 0, 0, 0 });   /* 8-bit RGB, no interlace */
+        png_chunk(out, "IHDR", header);
+
+        // each row is a filter type byte followed by the pixels
+        std::vector<uint8_t> image;
+        image.reserve((size_t)rect.height * (1 + rect.width * 3));
+
+        for (uint32_t y = rect.y; y < rect.y + rect.height; y++) {
+            auto row = this->_frame.data() + y * this->_stride + rect.x * framebuffer::bytes_per_pixel;
+
+            image.push_back(0);
+
+            for (uint32_t x = 0; x < rect.width; x++, row += framebuffer::bytes_per_pixel) {
+                image.insert(image.end(), { row[2], row[1], row[0] });
+            }
+        }
+
+        std::vector<uint8_t> zlib = { 0x78, 0x01 };
+        uint32_t a = 1, b = 0;
+
+        for (size_t offset = 0; offset < image.size(); ) {
+            auto length = (uint16_t)std::min<size_t>(image.size() - offset, 0xffff);
+            auto final = offset + length == image.size();
+
+            zlib.insert(zlib.end(), {
+                (uint8_t)final,
+                (uint8_t)length, (uint8_t)(length >> 8),
+                (uint8_t)~length, (uint8_t)(~length >> 8),
+            });
+            zlib.insert(zlib.end(), image.begin() + offset, image.begin() + offset + length);
+
+            for (size_t i = offset; i < offset + length; i++) {
+                a = (a + image[i]) % 65521;
+                b = (b + a) % 65521;
+            }
+
+            offset += length;
+        }
+
+        put32(zlib, (b << 16) | a);
+        png_chunk(out, "IDAT", zlib);
+        png_chunk(out, "IEND", {});
+    }
+
+    /**
+     * @brief Writes part of the frame as of the last update as raw pixels
+     * @param out The stream to write to
+     * @param rect The part of the frame to write
+     */
+    void framebuffer::write_raw(std::ostream &out, const fb_rect &rect) const {
+        this->check(rect);
+
+        for (uint32_t y = rect.y; y < rect.y + rect.height; y++) {
+            auto row = this->_frame.data() + y * this->_stride + rect.x * framebuffer::bytes_per_pixel;
+            out.write((const char *)row, (std::streamsize)rect.width * framebuffer::bytes_per_pixel);
+        }
+    }
+
+    /**
+     * @brief Updates, then writes each changed rectangle to its own file
+     * @param prefix The start of the path of each file
+     * @param format The image format to write
+     * @return The rectangles that changed
+     */
+    std::vector<fb_rect> framebuffer::snapshot(const std::string &prefix, image_format format) {
+        auto rects = this->update();
+
+        for (auto &rect : rects) {
+            auto path = prefix + "-" + std::to_string(this->_updates) +
+                        "-" + std::to_string(rect.x) + "-" + std::to_string(rect.y) +
+                        "-" + std::to_string(rect.width) + "x" + std::to_string(rect.height) +
+                        (format == image_png ? ".png" : ".raw");
+
+            std::ofstream out(path, std::ios::binary);
+
+            if (!out) {
+                throw device_exception("Failed to create the framebuffer snapshot file");
+            }
+
+            if (format == image_png) {
+                this->write_png(out, rect);
+            } else {
+                this->write_raw(out, rect);
+            }
+        }
+
+        return rects;
+    }
+
+    /**
+     * @brief Checks that a rectangle lies inside the framebuffer
+     */
+    void framebuffer::check(const fb_rect &rect) const {
+        if (rect.width == 0 || rect.height == 0 ||
+            rect.x >= this->_width || rect.width > this->_width - rect.x ||
+            rect.y >= this->_height || rect.height > this->_height - rect.y) {
+            throw device_exception("Framebuffer rectangle is out of range");
+        }
+    }
+
+}
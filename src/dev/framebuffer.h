@@ -0,0 +1,149 @@
+/**
+ * @file framebuffer.h
+ * @brief Linear framebuffer with dirty rectangle tracking
+*/
+
+#ifndef __mercury_dev_framebuffer_h__
+
+#define __mercury_dev_framebuffer_h__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../vm/device.h"
+#include "../vm/flat_bus.h"
+
+#include "../exc/device_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief A rectangle of pixels
+     */
+    struct fb_rect {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    /**
+     * @brief A framebuffer held in guest memory, with changes found from page flags
+     * @details The pixels live in ordinary memory, so the guest draws at full
+     * speed through the cpu's direct path. Every write to a page sets its
+     * page_frame flag; update() only looks at the pages with the flag set,
+     * compares their rows against the frame it saw last, and reports the
+     * rectangles that actually changed. Untouched parts of the framebuffer
+     * are never read.
+     *
+     * Pixels are 32-bit 0x00RRGGBB values, stored little endian.
+     *
+     * Registers, all 64-bit and read only:
+     * | Offset | Name   | Description                                    |
+     * |--------|--------|------------------------------------------------|
+     * | 0x00   | base   | guest address of the first pixel               |
+     * | 0x08   | width  | width in pixels                                |
+     * | 0x10   | height | height in pixels                               |
+     * | 0x18   | stride | bytes from one row to the next                 |
+     * | 0x20   | format | the pixel format, always 0 for xrgb8888        |
+     */
+    class framebuffer : public device {
+    public:
+        enum framebuffer_register : uint64_t {
+            reg_base = 0x00,
+            reg_width = 0x08,
+            reg_height = 0x10,
+            reg_stride = 0x18,
+            reg_format = 0x20,
+        };
+
+        enum pixel_format : uint64_t {
+            format_xrgb8888 = 0,
+        };
+
+        enum image_format {
+            image_png,
+            image_raw,
+        };
+
+        static constexpr uint32_t bytes_per_pixel = 4;
+
+        /**
+         * @brief Creates the framebuffer over a region of memory
+         * @param bus The bus whose memory holds the pixels; it must outlive the framebuffer
+         * @param base The guest address of the first pixel
+         * @param width The width in pixels
+         * @param height The height in pixels
+         */
+        framebuffer(flat_bus &bus, uint64_t base, uint32_t width, uint32_t height);
+
+        uint64_t size(void) const override { return 0x28; }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t /*offset*/, uint8_t /*width*/, uint64_t /*value*/) override {}
+
+        /**
+         * @brief Takes in the guest's drawing since the last update
+         * @details The first update reports the whole framebuffer.
+         * @return The rectangles that changed, top to bottom
+         */
+        std::vector<fb_rect> update(void);
+
+        /**
+         * @brief Encodes part of the frame as of the last update as a PNG image
+         * @param out The stream to write to
+         * @param rect The part of the frame to encode
+         */
+        void write_png(std::ostream &out, const fb_rect &rect) const;
+
+        /**
+         * @brief Writes part of the frame as of the last update as raw pixels
+         * @details Rows are written top to bottom with no padding or header, in
+         * the framebuffer's own pixel format.
+         * @param out The stream to write to
+         * @param rect The part of the frame to write
+         */
+        void write_raw(std::ostream &out, const fb_rect &rect) const;
+
+        /**
+         * @brief Updates, then writes each changed rectangle to its own file
+         * @details Files are named `<prefix>-<frame>-<x>-<y>-<width>x<height>`
+         * with a .png or .raw extension, where frame counts the updates.
+         * @param prefix The start of the path of each file
+         * @param format The image format to write
+         * @return The rectangles that changed
+         */
+        std::vector<fb_rect> snapshot(const std::string &prefix, image_format format = image_png);
+
+        uint32_t width(void) const { return this->_width; }
+        uint32_t height(void) const { return this->_height; }
+
+    private:
+        /**
+         * @brief Compares a band of rows against the last frame and takes in the differences
+         * @param first The first row
+         * @param last The last row
+         * @param rects Receives the rectangles that changed
+         */
+        void compare(uint32_t first, uint32_t last, std::vector<fb_rect> &rects);
+
+        /**
+         * @brief Checks that a rectangle lies inside the framebuffer
+         */
+        void check(const fb_rect &rect) const;
+
+        flat_bus &_bus;
+
+        uint64_t _base;
+        uint32_t _width;
+        uint32_t _height;
+        uint64_t _stride;
+
+        std::vector<uint8_t> _frame;        /* the pixels as of the last update */
+        uint64_t _updates = 0;
+    };
+
+}
+
+#endif /* __mercury_dev_framebuffer_h__ */
@@ -0,0 +1,278 @@
+#include "./pic.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace mercury {
+
+    /**
+     * @brief Creates the controller with every line masked
+     * @details Each cpu calls the controller back when it clears its
+     * interrupt flag, so a cpu can only be served by one controller.
+     * @param cpus The cpus to deliver to, at most cpu_limit; they must outlive the controller
+     */
+    pic::pic(const std::vector<cpu *> &cpus) {
+        if (cpus.empty() || cpus.size() > pic::cpu_limit) {
+            throw device_exception("Interrupt controller needs between 1 and 32 cpus");
+        }
+
+        this->_lines.fill(1ull << 32);
+
+        for (size_t i = 0; i < cpus.size(); i++) {
+            this->_targets.push_back({ cpus[i], 0, 0 });
+            cpus[i]->on_unmask([this, i]() { this->deliver(i); });
+        }
+    }
+
+    pic::~pic(void) {
+        for (auto &t : this->_targets) {
+            if (t.event != 0) {
+                t.core->cancel(t.event);
+            }
+
+            t.core->on_unmask(nullptr);
+        }
+    }
+
+    uint64_t pic::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_pending:
+                return this->_pending;
+
+            case reg_in_service: {
+                uint32_t lines = 0;
+
+                for (auto &t : this->_targets) {
+                    lines |= t.in_service;
+                }
+
+                return lines;
+            }
+
+            case reg_mask:
+                return this->_mask;
+
+            case reg_level:
+                return this->_level;
+
+            default:
+                if (offset >= reg_lines && offset < this->size() && offset % sizeof(uint64_t) == 0) {
+                    return this->_lines[(offset - reg_lines) / sizeof(uint64_t)];
+                }
+
+                return 0;
+        }
+    }
+
+    void pic::write(uint64_t offset, uint8_t /*width*/, uint64_t value) {
+        switch (offset) {
+            case reg_mask:
+                this->_mask = (uint32_t)value;
+                this->update();
+                break;
+
+            case reg_level:
+                this->_level = (uint32_t)value;
+                this->update();
+                break;
+
+            case reg_eoi:
+                if (value < pic::line_count) {
+                    this->end((unsigned)value);
+                }
+                break;
+
+            case reg_request:
+                if (value < pic::line_count) {
+                    this->_pending |= 1u << value;
+                    this->update();
+                }
+                break;
+
+            default:
+                if (offset >= reg_lines && offset < this->size() && offset % sizeof(uint64_t) == 0) {
+                    this->_lines[(offset - reg_lines) / sizeof(uint64_t)] = value & (line_vector | line_priority | line_targets);
+                    this->update();
+                }
+                break;
+        }
+    }
+
+    /**
+     * @brief Raises a line's input, as a device does to interrupt
+     * @param line The line, below line_count
+     */
+    void pic::raise(unsigned line) {
+        if (line >= pic::line_count) {
+            throw std::out_of_range("Interrupt line is out of range");
+        }
+
+        uint32_t bit = 1u << line;
+
+        this->_raised |= bit;
+
+        // a level line in service is requested again at its end of interrupt
+        if (this->_level & bit) {
+            for (auto &t : this->_targets) {
+                if (t.in_service & bit) {
+                    return;
+                }
+            }
+        }
+
+        this->_pending |= bit;
+        this->update();
+    }
+
+    /**
+     * @brief Lowers a line's input, as a device does once the guest has seen to it
+     * @param line The line, below line_count
+     */
+    void pic::lower(unsigned line) {
+        if (line >= pic::line_count) {
+            throw std::out_of_range("Interrupt line is out of range");
+        }
+
+        uint32_t bit = 1u << line;
+
+        this->_raised &= ~bit;
+
+        if (this->_level & bit) {
+            this->_pending &= ~bit;
+        }
+    }
+
+    /**
+     * @brief Offers the pending lines to every cpu that could take one now
+     * @details A cpu in the middle of an instruction, such as the one writing
+     * a register here, is offered its line once the instruction retires.
+     */
+    void pic::update(void) {
+        for (size_t i = 0; i < this->_targets.size(); i++) {
+            auto &t = this->_targets[i];
+
+            if (t.event != 0 || this->best(i) == pic::line_count) {
+                continue;
+            }
+
+            if (t.core->state() == cpu_state::running) {
+                t.event = t.core->schedule(1, [this, i]() {
+                    this->_targets[i].event = 0;
+                    this->deliver(i);
+                });
+            } else {
+                this->deliver(i);
+            }
+        }
+    }
+
+    /**
+     * @brief Picks the line a cpu should be offered next
+     * @details Only pending, unmasked lines that target the cpu and have a
+     * higher priority than everything in service on it qualify.
+     * @param index The cpu
+     * @return The line, or line_count if there is none
+     */
+    unsigned pic::best(size_t index) const {
+        auto &t = this->_targets[index];
+        uint32_t lines = this->_pending & ~this->_mask;
+        int floor = -1;
+
+        for (unsigned line = 0; line < pic::line_count; line++) {
+            if (t.in_service & (1u << line)) {
+                floor = std::max(floor, (int)((this->_lines[line] & line_priority) >> 8));
+            }
+        }
+
+        unsigned best = pic::line_count;
+
+        for (unsigned line = 0; lines != 0; line++, lines >>= 1) {
+            auto config = this->_lines[line];
+            int priority = (int)((config & line_priority) >> 8);
+
+            if ((lines & 1) && (config >> 32) & (1ull << index) && priority > floor) {
+                floor = priority;
+                best = line;
+            }
+        }
+
+        return best;
+    }
+
+    /**
+     * @brief Delivers the best line to a cpu, between its instructions
+     * @details A line the cpu refuses stays pending; the cpu calls back once
+     * it clears its interrupt flag.
+     * @param index The cpu
+     */
+    void pic::deliver(size_t index) {
+        auto line = this->best(index);
+
+        if (line == pic::line_count) {
+            return;
+        }
+
+        auto &t = this->_targets[index];
+
+        if (t.core->irq((uint8_t)(this->_lines[line] & line_vector))) {
+            this->_pending &= ~(1u << line);
+            t.in_service |= 1u << line;
+        }
+    }
+
+    /**
+     * @brief Ends the interrupt a line has in service
+     * @param line The line
+     */
+    void pic::end(unsigned line) {
+        uint32_t bit = 1u << line;
+        bool served = false;
+
+        for (auto &t : this->_targets) {
+            served |= (t.in_service & bit) != 0;
+            t.in_service &= ~bit;
+        }
+
+        if (served && (this->_level & this->_raised & bit)) {
+            this->_pending |= bit;
+        }
+
+        this->update();
+    }
+
+    /**
+     * @brief Connects the output to a line of an interrupt controller
+     * @param pic The controller; it must outlive the device
+     * @param line The line, below pic::line_count
+     */
+    void irq_line::connect(pic &pic, unsigned line) {
+        if (line >= pic::line_count) {
+            throw std::out_of_range("Interrupt line is out of range");
+        }
+
+        this->_pic = &pic;
+        this->_line = line;
+    }
+
+    /**
+     * @brief Signals an interrupt
+     * @param vector The vector to use while not connected
+     */
+    void irq_line::raise(uint8_t vector) {
+        if (this->_pic != nullptr) {
+            this->_pic->raise(this->_line);
+        } else {
+            this->_cpu.irq(vector);
+        }
+    }
+
+    /**
+     * @brief Withdraws the signal, once the guest has seen to the device
+     */
+    void irq_line::lower(void) {
+        if (this->_pic != nullptr) {
+            this->_pic->lower(this->_line);
+        }
+    }
+
+}
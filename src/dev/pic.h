@@ -0,0 +1,183 @@
+/**
+ * @file pic.h
+ * @brief Programmable interrupt controller
+*/
+
+#ifndef __mercury_dev_pic_h__
+
+#define __mercury_dev_pic_h__
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "../vm/cpu.h"
+#include "../vm/device.h"
+
+#include "../exc/device_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief An interrupt controller that prioritizes device lines and delivers them to one or more cpus
+     * @details Each of the 32 lines has its own vector, priority and target
+     * cpus. A request sets the line's pending bit; while a line is pending
+     * further edges on it coalesce into the one request, so a device that
+     * interrupts faster than the guest can serve it costs one delivery, not
+     * one per event. A pending, unmasked line is delivered to the first target
+     * cpu that is serving nothing of the same or higher priority and whose
+     * interrupt flag lets it in. It then stays in service on that cpu until the
+     * guest writes its number to eoi. Ties in priority go to the lower line.
+     *
+     * An edge-triggered line is requested once per raise(). A level-triggered
+     * line is requested for as long as its input is raised: lowering the input
+     * withdraws a request that was not delivered yet, and an input still
+     * raised at end of interrupt requests the line again. Requests a cpu
+     * refuses stay pending, and are offered again as soon as that cpu clears
+     * its interrupt flag, so none are lost. The controller only does work when
+     * a line, register or interrupt flag changes; it never polls.
+     *
+     * The controller hands interrupts to a cpu between its instructions,
+     * through the cpu's events, so every cpu it serves must run on the host
+     * thread that drives the devices, and be served by no other controller.
+     *
+     * Registers, all 64-bit:
+     * | Offset      | Name       | Description                                          |
+     * |-------------|------------|------------------------------------------------------|
+     * | 0x00        | pending    | bit n set while line n is requested, read only       |
+     * | 0x08        | in_service | bit n set while line n is in service, read only      |
+     * | 0x10        | mask       | bit n set holds line n off; all set after reset      |
+     * | 0x18        | level      | bit n set makes line n level-triggered               |
+     * | 0x20        | eoi        | write a line number to end its interrupt             |
+     * | 0x28        | request    | write a line number to request it from software      |
+     * | 0x100 + 8n  | line n     | bits 0-7 vector, 8-11 priority, 32-63 target cpus    |
+     *
+     * Target bit i of a line is the i-th cpu the controller was created with;
+     * lines target the first cpu after reset. Writing request is how one cpu
+     * interrupts another.
+     */
+    class pic : public device {
+    public:
+        enum pic_register : uint64_t {
+            reg_pending = 0x00,
+            reg_in_service = 0x08,
+            reg_mask = 0x10,
+            reg_level = 0x18,
+            reg_eoi = 0x20,
+            reg_request = 0x28,
+            reg_lines = 0x100,
+        };
+
+        enum pic_line : uint64_t {
+            line_vector = 0xff,
+            line_priority = 0xf00,
+            line_targets = 0xffffffff00000000ull,
+        };
+
+        static constexpr unsigned line_count = 32;
+        static constexpr unsigned cpu_limit = 32;
+
+        /**
+         * @brief Creates the controller with every line masked
+         * @param cpus The cpus to deliver to, at most cpu_limit; they must outlive the controller
+         */
+        explicit pic(const std::vector<cpu *> &cpus);
+        ~pic(void) override;
+
+        uint64_t size(void) const override { return reg_lines + line_count * sizeof(uint64_t); }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t offset, uint8_t width, uint64_t value) override;
+
+        /**
+         * @brief Raises a line's input, as a device does to interrupt
+         * @param line The line, below line_count
+         */
+        void raise(unsigned line);
+
+        /**
+         * @brief Lowers a line's input, as a device does once the guest has seen to it
+         * @param line The line, below line_count
+         */
+        void lower(unsigned line);
+
+    private:
+        /**
+         * @brief A cpu the controller delivers to
+         */
+        struct target {
+            cpu *core;
+            uint32_t in_service;            /* lines in service on this cpu */
+            uint64_t event;                 /* the scheduled delivery, or 0 */
+        };
+
+        /**
+         * @brief Offers the pending lines to every cpu that could take one now
+         */
+        void update(void);
+
+        /**
+         * @brief Picks the line a cpu should be offered next
+         * @param index The cpu
+         * @return The line, or line_count if there is none
+         */
+        unsigned best(size_t index) const;
+
+        /**
+         * @brief Delivers the best line to a cpu, between its instructions
+         * @param index The cpu
+         */
+        void deliver(size_t index);
+
+        /**
+         * @brief Ends the interrupt a line has in service
+         * @param line The line
+         */
+        void end(unsigned line);
+
+        std::vector<target> _targets;
+        std::array<uint64_t, line_count> _lines;
+
+        uint32_t _pending = 0;
+        uint32_t _mask = UINT32_MAX;
+        uint32_t _level = 0;
+        uint32_t _raised = 0;               /* line inputs raised by devices */
+    };
+
+    /**
+     * @brief The interrupt output of a device
+     * @details Until it is connected to a line of a pic, it interrupts the
+     * device's cpu directly at the vector the guest gave the device, and an
+     * interrupt the cpu refuses is dropped. Once connected, it drives the line
+     * instead and the line's own vector applies.
+     */
+    class irq_line {
+    public:
+        explicit irq_line(cpu &cpu) : _cpu(cpu) {}
+
+        /**
+         * @brief Connects the output to a line of an interrupt controller
+         * @param pic The controller; it must outlive the device
+         * @param line The line, below pic::line_count
+         */
+        void connect(pic &pic, unsigned line);
+
+        /**
+         * @brief Signals an interrupt
+         * @param vector The vector to use while not connected
+         */
+        void raise(uint8_t vector);
+
+        /**
+         * @brief Withdraws the signal, once the guest has seen to the device
+         */
+        void lower(void);
+
+    private:
+        cpu &_cpu;
+        pic *_pic = nullptr;
+        unsigned _line = 0;
+    };
+
+}
+
+#endif /* __mercury_dev_pic_h__ */
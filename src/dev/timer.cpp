@@ -0,0 +1,125 @@
+#include "./timer.h"
+
+namespace mercury {
+
+    timer::~timer(void) {
+        this->disarm();
+    }
+
+    uint64_t timer::read(uint64_t offset, uint8_t /*width*/) {
+        switch (offset) {
+            case reg_control:
+                return this->_control;
+
+            case reg_interval:
+                return this->_interval;
+
+            case reg_vector:
+                return this->_vector;
+
+            case reg_status:
+                return this->_status;
+
+            case reg_time:
+                return timer::host_time();
+
+            default:
+                return 0;
+        }
+    }
+
+    void timer::write(uint64_t offset, uint8_t /*width*/, uint64_t value) {
+        switch (offset) {
+            case reg_control:
+                this->_control = value & (control_enable | control_host | control_periodic);
+                this->arm();
+                break;
+
+            case reg_interval:
+                this->_interval = value;
+                this->arm();
+                break;
+
+            case reg_vector:
+                this->_vector = value & 0xff;
+                break;
+
+            case reg_status:
+                this->_status &= ~value;
+
+                if (!(this->_status & 1)) {
+                    this->_irq.lower();
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @brief Starts the countdown from now, if the timer is enabled
+     */
+    void timer::arm(void) {
+        this->disarm();
+
+        if (!(this->_control & control_enable)) {
+            return;
+        }
+
+        auto delay = this->_interval;
+
+        if (this->_control & control_host) {
+            this->_host_deadline = this->_cpu.external(timer::host_time()) + this->_interval;
+            delay = timer::host_quantum;
+        }
+
+        this->_event = this->_cpu.schedule(delay, [this]() { this->tick(); });
+    }
+
+    /**
+     * @brief Stops the countdown
+     */
+    void timer::disarm(void) {
+        if (this->_event != 0) {
+            this->_cpu.cancel(this->_event);
+            this->_event = 0;
+        }
+    }
+
+    /**
+     * @brief Called by the cpu when an instruction deadline or host poll is reached
+     */
+    void timer::tick(void) {
+        this->_event = 0;
+
+        if ((this->_control & control_host) && this->_cpu.external(timer::host_time()) < this->_host_deadline) {
+            this->_event = this->_cpu.schedule(timer::host_quantum, [this]() { this->tick(); });
+            return;
+        }
+
+        this->expire();
+    }
+
+    /**
+     * @brief Marks the timer expired, interrupts the cpu and re-arms a periodic timer
+     */
+    void timer::expire(void) {
+        this->_status |= 1;
+
+        if (this->_control & control_periodic) {
+            this->arm();
+        } else {
+            this->_control &= ~(uint64_t)control_enable;
+        }
+
+        this->_irq.raise(this->_vector);
+    }
+
+    uint64_t timer::host_time(void) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count();
+    }
+
+}
@@ -0,0 +1,114 @@
+/**
+ * @file timer.h
+ * @brief Programmable interval timer
+*/
+
+#ifndef __mercury_dev_timer_h__
+
+#define __mercury_dev_timer_h__
+
+#include <chrono>
+#include <cstdint>
+
+#include "../vm/cpu.h"
+#include "../vm/device.h"
+#include "./pic.h"
+
+namespace mercury {
+
+    /**
+     * @brief A timer that raises an interrupt after a number of retired
+     * instructions or host nanoseconds
+     * @details The timer is tickless: an instruction count becomes a cpu event
+     * at the exact deadline, so nothing runs until it expires. A host-time
+     * timer cannot be turned into an exact instruction count, so while one is
+     * armed the timer checks the host clock every host_quantum instructions.
+     * Those checks go through cpu::external(), so a replayed journal expires
+     * the timer at the same instruction as the recording.
+     *
+     * Registers, all 64-bit:
+     * | Offset | Name     | Description                                           |
+     * |--------|----------|-------------------------------------------------------|
+     * | 0x00   | control  | bit 0 enable, bit 1 count host ns, bit 2 periodic     |
+     * | 0x08   | interval | instructions or nanoseconds until the timer expires   |
+     * | 0x10   | vector   | the interrupt vector to raise                         |
+     * | 0x18   | status   | bit 0 set on expiry; write 1 to clear                 |
+     * | 0x20   | time     | host monotonic time in nanoseconds, read only         |
+     *
+     * Writing control or interval restarts the countdown. A one-shot timer
+     * clears its enable bit when it expires.
+     */
+    class timer : public device {
+    public:
+        enum timer_register : uint64_t {
+            reg_control = 0x00,
+            reg_interval = 0x08,
+            reg_vector = 0x10,
+            reg_status = 0x18,
+            reg_time = 0x20,
+        };
+
+        enum timer_control : uint64_t {
+            control_enable = 0x01,
+            control_host = 0x02,
+            control_periodic = 0x04,
+        };
+
+        static constexpr uint64_t host_quantum = 1 << 14;
+
+        /**
+         * @brief Creates the timer
+         * @param cpu The cpu to schedule on and interrupt; it must outlive the timer
+         */
+        explicit timer(cpu &cpu) : _cpu(cpu), _irq(cpu) {}
+        ~timer(void) override;
+
+        uint64_t size(void) const override { return 0x28; }
+        uint64_t read(uint64_t offset, uint8_t width) override;
+        void write(uint64_t offset, uint8_t width, uint64_t value) override;
+
+        /**
+         * @brief Routes the interrupt through a line of an interrupt controller, instead of the vector register
+         * @param pic The controller; it must outlive the timer
+         * @param line The line
+         */
+        void connect(pic &pic, unsigned line) { this->_irq.connect(pic, line); }
+
+    private:
+        /**
+         * @brief Starts the countdown from now, if the timer is enabled
+         */
+        void arm(void);
+
+        /**
+         * @brief Stops the countdown
+         */
+        void disarm(void);
+
+        /**
+         * @brief Called by the cpu when an instruction deadline or host poll is reached
+         */
+        void tick(void);
+
+        /**
+         * @brief Marks the timer expired, interrupts the cpu and re-arms a periodic timer
+         */
+        void expire(void);
+
+        static uint64_t host_time(void);
+
+        cpu &_cpu;
+        irq_line _irq;
+
+        uint64_t _control = 0;
+        uint64_t _interval = 0;
+        uint64_t _vector = 0;
+        uint64_t _status = 0;
+
+        uint64_t _event = 0;                /* the scheduled cpu event, or 0 */
+        uint64_t _host_deadline = 0;        /* host time to expire at, in host mode */
+    };
+
+}
+
+#endif /* __mercury_dev_timer_h__ */
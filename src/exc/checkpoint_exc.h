@@ -0,0 +1,25 @@
+#ifndef __mercury_exc_checkpoint_exc_h__
+
+#define __mercury_exc_checkpoint_exc_h__
+
+#include <cstdint>
+#include <string>
+#include <exception>
+
+namespace mercury {
+
+    class checkpoint_exception : public std::exception {
+    public:
+        checkpoint_exception(const char *reason) : _reason(reason) {}
+
+        const char* what() const throw() override {
+            return _reason;
+        }
+
+    private:
+        const char *_reason;
+    };
+
+}
+
+#endif /* __mercury_exc_checkpoint_exc_h__ */
@@ -0,0 +1,34 @@
+#ifndef __mercury_exc_fault_exc_h__
+
+#define __mercury_exc_fault_exc_h__
+
+#include <cstdint>
+#include <string>
+#include <exception>
+
+namespace mercury {
+
+    class fault_exception : public std::exception {
+    public:
+        fault_exception(uint8_t vector, uint64_t code) : _vector(vector), _code(code) {}
+
+        uint8_t vector() const {
+            return _vector;
+        }
+
+        uint64_t code() const {
+            return _code;
+        }
+
+        const char* what() const throw() override {
+            return "Guest exception has no handler";
+        }
+
+    private:
+        uint8_t _vector;
+        uint64_t _code;
+    };
+
+}
+
+#endif /* __mercury_exc_fault_exc_h__ */
@@ -1,84 +1,73 @@
+#include <cstring>
 #include <iostream>
 
+#include "./dev/console.h"
 #include "./vm/cpu.h"
+#include "./vm/flat_bus.h"
 
 using namespace std;
 
 uint64_t memory[1024];
+uint64_t origin = 0;
 
-class debug_bus : public mercury::bus {
-public:
-    void write8(uint64_t address, uint8_t value) override {
-        cout << "write8: " << address << " " << value << endl;
-        ((uint8_t *)memory)[address] = value;
-    }
-
-    void write16(uint64_t address, uint16_t value) override {
-        cout << "write16: " << address << " " << value << endl;
-        ((uint16_t *)memory)[address] = value;
-    }
-
-    void write32(uint64_t address, uint32_t value) override {
-        cout << "write32: " << address << " " << value << endl;
-        ((uint32_t *)memory)[address] = value;
-    }
-
-    void write64(uint64_t address, uint64_t value) override {
-        cout << "write64: " << address << " " << value << endl;
-        ((uint64_t *)memory)[address] = value;
-    }
-
-    uint8_t read8(uint64_t address) override {
-        cout << "read8: " << address << endl;
-        return ((uint8_t *)memory)[address];
-    }
-
-    uint16_t read16(uint64_t address) override {
-        cout << "read16: " << address << endl;
-        return ((uint16_t *)memory)[address];
-    }
-
-    uint32_t read32(uint64_t address) override {
-        cout << "read32: " << address << endl;
-        return ((uint32_t *)memory)[address];
-    }
-
-    uint64_t read64(uint64_t address) override {
-        cout << "read64: " << address << endl;
-        return ((uint64_t *)memory)[address];
-    }
-};
+const uint64_t console_base = 0xf0002000;
+
+void emit32(uint32_t value) {
+    memcpy((uint8_t *)memory + origin, &value, sizeof(value));
+    origin += sizeof(value);
+}
+
+void emit64(uint64_t value) {
+    memcpy((uint8_t *)memory + origin, &value, sizeof(value));
+    origin += sizeof(value);
+}
 
 int main() {
     auto cpu = std::make_shared<mercury::cpu>();
+    auto serial = std::make_shared<mercury::console>(*cpu);
 
     try {
 
-
         cout << "state: " << cpu->state() << endl;
 
         cpu->reset();
         cout << "state: " << cpu->state() << endl;
 
-        cpu->_bus = std::make_shared<debug_bus>();
+        auto bus = std::make_shared<mercury::flat_bus>(sizeof(memory));
+
+        cpu->attach(bus);
+        bus->map(console_base, serial);
 
         // nop
-        memory[0] = opc0(mercury::opcode::_nop);
+        emit32(opc0(mercury::opcode::_nop));
+
+        // push c; pop [console_base], for each character of the greeting
+        for (auto c : "Hello from mercury\n"s) {
+            emit32(opc1(mercury::opcode::_push, mercury::addressing::immediate));
+            emit64((uint8_t)c);
+            emit32(opc1(mercury::opcode::_pop, mercury::addressing::direct));
+            emit64(console_base);
+        }
 
-        // add r0, 50
-        memory[1] = opc2(mercury::opcode::_shl, mercury::addressing::register_direct, mercury::addressing::immediate);
-        memory[3] = 0x0000000000000001;
-        memory[4] = 1;
+        // shl r1, 1
+        emit32(opc2(mercury::opcode::_shl, mercury::addressing::register_direct, mercury::addressing::immediate));
+        emit64(mercury::cpu_reg::r1);
+        emit64(1);
 
         // hlt
-        memory[5] = opc0(mercury::opcode::_hlt);
+        emit32(opc0(mercury::opcode::_hlt));
 
+        bus->load(0, memory, origin);
+        cpu->sp().q = sizeof(memory);
         cpu->r1().q = 4;
 
         cpu->run();
     } catch (const mercury::addressing_exception &e) {
         cout << "Addressing exception: " << e.mode() << endl;
+    } catch (const mercury::fault_exception &e) {
+        cout << "Unhandled exception: vector " << (int)e.vector() << " at " << cpu->pc().q << endl;
     } catch (const mercury::halted_exception &e) {
+        serial->flush();
         cout << "System halted!" << endl;
 
         cout << "state: " << cpu->state() << endl;
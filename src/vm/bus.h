@@ -13,11 +13,28 @@
 
 namespace mercury {
 
+    static constexpr uint64_t page_shift = 12;
+    static constexpr uint64_t page_size = 1 << page_shift;
+
+    /**
+     * @brief Per-page flags for memory exposed by a bus
+     */
+    enum page_flag : uint8_t {
+        page_dirty = 0x01,          /* the page has been written since the flag was last cleared */
+        page_code  = 0x02,          /* the cpu has decoded instructions from the page */
+        page_frame = 0x04,          /* the page has been written since a display last scanned it */
+        page_watch = 0x08,          /* accesses to the page take the slow path, where watchpoints are checked */
+
+        page_written = page_dirty | page_frame,  /* the flags every write to a page sets */
+    };
+
     /**
      * @brief Interface for the system bus
      */
     class bus {
     public:
+        virtual ~bus(void) = default;
+
         /**
          * @brief Write a value to the bus
          * @param address The address to write to
@@ -73,6 +90,27 @@ namespace mercury {
          * @return The value read from the bus
          */
         virtual uint64_t read64(uint64_t address) = 0;
+
+        /**
+         * @brief Retrieves host memory that backs the bus from address 0
+         * @details Accesses that fall inside this memory may bypass the read and
+         * write functions, so it must only cover plain memory with no side effects.
+         * Anything that writes to it directly must also set page_written in pages().
+         * @return The first byte of memory, or nullptr if there is none
+         */
+        virtual uint8_t *memory(void) { return nullptr; }
+
+        /**
+         * @brief Retrieves the size of the memory returned by memory()
+         * @return The size of the memory in bytes, a multiple of page_size
+         */
+        virtual uint64_t size(void) const { return 0; }
+
+        /**
+         * @brief Retrieves the page flags for the memory returned by memory()
+         * @return One page_flag byte for each page of memory, or nullptr
+         */
+        virtual uint8_t *pages(void) { return nullptr; }
     };
 
     typedef std::shared_ptr<bus> bus_ptr;
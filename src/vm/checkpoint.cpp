@@ -0,0 +1,120 @@
+#include "./checkpoint.h"
+
+namespace mercury {
+
+    /**
+     * @brief Writes an incremental checkpoint
+     * @param out The stream to write to
+     * @param cpu The cpu to save; it must not be running
+     * @param bus The memory to save
+     * @param sequence The position of this checkpoint in the chain
+     */
+    void save_checkpoint(std::ostream &out, cpu &cpu, flat_bus &bus, uint64_t sequence) {
+        assert(cpu.state() != cpu_state::running);
+
+        checkpoint_header header = {};
+        header.magic = checkpoint_magic;
+        header.version = checkpoint_version;
+        header.sequence = sequence;
+        header.memory_size = bus.size();
+        header.state = cpu.state();
+
+        for (uint64_t i = 0; i < msr_count; i++) {
+            header.msrs[i] = cpu.msr(static_cast<cpu_msr>(i));
+        }
+
+        for (uint64_t page = 0; page < bus.page_count(); page++) {
+            header.pages += bus.is_dirty(page);
+        }
+
+        out.write((const char *)&header, sizeof(header));
+        out.write((const char *)cpu._r.data(), sizeof(cpu._r));
+        out.write((const char *)cpu._f.data(), sizeof(cpu._f));
+        out.write((const char *)cpu._v.data(), sizeof(cpu._v));
+
+        for (uint64_t page = 0; page < bus.page_count(); page++) {
+            if (bus.is_dirty(page)) {
+                out.write((const char *)&page, sizeof(page));
+                out.write((const char *)bus.memory() + (page << page_shift), page_size);
+            }
+        }
+
+        if (!out) {
+            throw checkpoint_exception("Failed to write checkpoint");
+        }
+
+        bus.clean();
+    }
+
+    /**
+     * @brief Applies a single checkpoint
+     * @param in The stream to read from
+     * @param cpu The cpu to restore into
+     * @param bus The memory to restore into; it must be the same size as when saved
+     * @return The sequence number of the checkpoint
+     */
+    uint64_t restore_checkpoint(std::istream &in, cpu &cpu, flat_bus &bus) {
+        checkpoint_header header = {};
+
+        if (!in.read((char *)&header, sizeof(header)) || header.magic != checkpoint_magic) {
+            throw checkpoint_exception("Not a checkpoint");
+        }
+
+        if (header.version != checkpoint_version) {
+            throw checkpoint_exception("Unsupported checkpoint version");
+        }
+
+        if (header.memory_size != bus.size()) {
+            throw checkpoint_exception("Checkpoint memory size does not match the bus");
+        }
+
+        if (!in.read((char *)cpu._r.data(), sizeof(cpu._r)) ||
+            !in.read((char *)cpu._f.data(), sizeof(cpu._f)) ||
+            !in.read((char *)cpu._v.data(), sizeof(cpu._v))) {
+            throw checkpoint_exception("Checkpoint is truncated");
+        }
+
+        cpu._state = static_cast<cpu_state>(header.state);
+
+        for (uint64_t i = 0; i < header.pages; i++) {
+            uint64_t page;
+
+            if (!in.read((char *)&page, sizeof(page)) || page >= bus.page_count()) {
+                throw checkpoint_exception("Checkpoint page is invalid");
+            }
+
+            if (!in.read((char *)bus.memory() + (page << page_shift), page_size)) {
+                throw checkpoint_exception("Checkpoint is truncated");
+            }
+
+            bus.pages()[page] |= page_flag::page_frame;
+        }
+
+        // memory now matches the chain up to this checkpoint
+        bus.clean();
+
+        // after the registers, so that the TLB is chosen for the saved mode
+        for (uint64_t i = 0; i < msr_count; i++) {
+            cpu.set_msr(static_cast<cpu_msr>(i), header.msrs[i]);
+        }
+
+        return header.sequence;
+    }
+
+    /**
+     * @brief Replays a chain of checkpoints in order
+     * @param chain The checkpoint streams, oldest first
+     * @param cpu The cpu to restore into
+     * @param bus The memory to restore into
+     */
+    void restore_checkpoints(const std::vector<std::istream *> &chain, cpu &cpu, flat_bus &bus) {
+        uint64_t expected = 0;
+
+        for (auto in : chain) {
+            if (restore_checkpoint(*in, cpu, bus) != expected++) {
+                throw checkpoint_exception("Checkpoint chain is out of order");
+            }
+        }
+    }
+
+}
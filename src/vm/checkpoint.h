@@ -0,0 +1,76 @@
+/**
+ * @file checkpoint.h
+ * @brief Incremental checkpoints of a cpu and its memory
+*/
+
+#ifndef __mercury_vm_checkpoint_h__
+
+#define __mercury_vm_checkpoint_h__
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "cpu.h"
+#include "flat_bus.h"
+
+#include "../exc/checkpoint_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief Checkpoint file header
+     * @details A checkpoint is this header, the general, floating point and
+     * vector registers, then `pages` records of a 64-bit page index followed by
+     * page_size bytes of memory. All values are stored in host byte order.
+     */
+    struct checkpoint_header {
+        uint32_t magic;             /* checkpoint_magic */
+        uint32_t version;           /* checkpoint_version */
+        uint64_t sequence;          /* position in the chain, starting at 0 */
+        uint64_t memory_size;       /* size of the memory the pages belong to */
+        uint64_t pages;             /* number of page records that follow */
+        uint32_t state;             /* the cpu_state */
+        uint32_t reserved;
+        uint64_t msrs[msr_count];   /* the model-specific registers, by cpu_msr */
+    };
+
+    static constexpr uint32_t checkpoint_magic = 0x504b434d;       /* "MCKP" */
+    static constexpr uint32_t checkpoint_version = 5;
+
+    /**
+     * @brief Writes an incremental checkpoint
+     * @details Only the pages written since the previous checkpoint are stored,
+     * and they are marked clean afterwards. The first checkpoint of a chain is
+     * taken against a freshly created (zeroed) flat_bus, so it covers every page
+     * that has ever been written.
+     * @param out The stream to write to
+     * @param cpu The cpu to save; it must not be running
+     * @param bus The memory to save
+     * @param sequence The position of this checkpoint in the chain
+     */
+    void save_checkpoint(std::ostream &out, cpu &cpu, flat_bus &bus, uint64_t sequence);
+
+    /**
+     * @brief Applies a single checkpoint
+     * @param in The stream to read from
+     * @param cpu The cpu to restore into
+     * @param bus The memory to restore into; it must be the same size as when saved
+     * @return The sequence number of the checkpoint
+     */
+    uint64_t restore_checkpoint(std::istream &in, cpu &cpu, flat_bus &bus);
+
+    /**
+     * @brief Replays a chain of checkpoints in order
+     * @details The chain must start at sequence 0 and have no gaps. The bus should
+     * be freshly created, so that pages never written are still zero.
+     * @param chain The checkpoint streams, oldest first
+     * @param cpu The cpu to restore into
+     * @param bus The memory to restore into
+     */
+    void restore_checkpoints(const std::vector<std::istream *> &chain, cpu &cpu, flat_bus &bus);
+
+}
+
+#endif /* __mercury_vm_checkpoint_h__ */
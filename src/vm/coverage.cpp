@@ -0,0 +1,136 @@
+#include "./coverage.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /**
+     * @brief Creates coverage with a bitmap in shared memory
+     * @param size The size of the bitmap in bytes, a power of two
+     */
+    coverage::coverage(uint64_t size) : _map(nullptr), _mask(size - 1) {
+        if (size == 0 || (size & (size - 1)) != 0) {
+            throw coverage_exception("Coverage map size must be a power of two");
+        }
+
+        this->_fd = ::memfd_create("mercury-coverage", MFD_CLOEXEC);
+
+        if (this->_fd < 0 || ::ftruncate(this->_fd, (off_t)size) != 0) {
+            if (this->_fd >= 0) {
+                ::close(this->_fd);
+            }
+
+            throw coverage_exception("Failed to create the coverage map");
+        }
+
+        auto map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->_fd, 0);
+
+        if (map == MAP_FAILED) {
+            ::close(this->_fd);
+            throw coverage_exception("Failed to map the coverage map");
+        }
+
+        this->_map = (uint8_t *)map;
+    }
+
+    /**
+     * @brief Creates coverage that counts into memory owned by the caller
+     * @param map The bitmap; it must outlive the coverage
+     * @param size The size of the bitmap in bytes, a power of two
+     */
+    coverage::coverage(uint8_t *map, uint64_t size) : _map(map), _mask(size - 1) {
+        if (map == nullptr || size == 0 || (size & (size - 1)) != 0) {
+            throw coverage_exception("Coverage map size must be a power of two");
+        }
+    }
+
+    coverage::~coverage(void) {
+        if (this->_fd >= 0) {
+            ::munmap(this->_map, this->_mask + 1);
+            ::close(this->_fd);
+        }
+    }
+
+    /**
+     * @brief Zeroes the bitmap, as before each fuzzing input
+     */
+    void coverage::clear(void) {
+        memset(this->_map, 0, this->_mask + 1);
+    }
+
+    /**
+     * @brief Counts the bytes of the bitmap that are set
+     * @return The number of edge buckets hit since the last clear()
+     */
+    uint64_t coverage::count(void) const {
+        return (uint64_t)(this->_mask + 1) - std::count(this->_map, this->_map + this->_mask + 1, 0);
+    }
+
+    /**
+     * @brief Retrieves the site for a branch, adding it on first sight
+     * @param address The address of the branch
+     * @param next The address of the instruction after it
+     * @return The index of the site
+     */
+    uint32_t coverage::site(uint64_t address, uint64_t next) {
+        auto it = this->_site_index.find(address);
+
+        if (it != this->_site_index.end()) {
+            // the code may have been rewritten since
+            this->_sites[it->second].next = next;
+            return it->second;
+        }
+
+        auto index = (uint32_t)this->_sites.size();
+
+        this->_sites.push_back({ address, next, coverage::hash(address), 0, 0 });
+        this->_site_index.emplace(address, index);
+
+        return index;
+    }
+
+    /**
+     * @brief Writes the branch counts as lcov tracefile data
+     * @param out The stream to write to
+     * @param source The name to give the guest program in the SF record
+     */
+    void coverage::write_lcov(std::ostream &out, const std::string &source) const {
+        std::vector<const coverage_site *> sorted;
+
+        for (auto &s : this->_sites) {
+            sorted.push_back(&s);
+        }
+
+        std::sort(sorted.begin(), sorted.end(), [](const coverage_site *a, const coverage_site *b) {
+            return a->address < b->address;
+        });
+
+        uint64_t lines_hit = 0, branches_hit = 0;
+
+        out << "TN:\n" << "SF:" << source << "\n";
+
+        for (auto s : sorted) {
+            out << "BRDA:" << s->address << ",0,0," << s->fallthrough << "\n";
+            out << "BRDA:" << s->address << ",0,1," << s->taken << "\n";
+
+            branches_hit += (s->fallthrough != 0) + (s->taken != 0);
+        }
+
+        out << "BRF:" << sorted.size() * 2 << "\n" << "BRH:" << branches_hit << "\n";
+
+        for (auto s : sorted) {
+            auto runs = s->fallthrough + s->taken;
+
+            out << "DA:" << s->address << "," << runs << "\n";
+            lines_hit += runs != 0;
+        }
+
+        out << "LF:" << sorted.size() << "\n" << "LH:" << lines_hit << "\n";
+        out << "end_of_record\n";
+    }
+
+}
@@ -0,0 +1,152 @@
+/**
+ * @file coverage.h
+ * @brief Edge coverage of guest code
+*/
+
+#ifndef __mercury_vm_coverage_h__
+
+#define __mercury_vm_coverage_h__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu.h"
+
+#include "../exc/coverage_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief A branch instruction the cpu has translated with coverage on
+     */
+    struct coverage_site {
+        uint64_t address;           /* the address of the branch */
+        uint64_t next;              /* the address of the instruction after it */
+        uint32_t id;                /* the hash of the address, as the source of an edge */
+        uint64_t fallthrough;       /* the number of times execution went on to next */
+        uint64_t taken;             /* the number of times execution went anywhere else */
+    };
+
+    /**
+     * @brief Records which edges guest code takes, for fuzzing and reports
+     * @details Edges are counted in an AFL-style bitmap: each transfer from a
+     * branch at `from` to `to` increments the byte at
+     * `(hash(from) >> 1 ^ hash(to)) % size`, saturating at 255. The bitmap is
+     * a memfd that other processes can map through fd(), or memory supplied
+     * by the fuzzer, such as an AFL shared memory segment.
+     *
+     * The cpu inserts the counting when it translates a branch into its
+     * decoded cache, so instructions that are not branches run as before and
+     * nothing is checked per instruction. Each branch also keeps counts of
+     * its two outcomes, which write_lcov() reports keyed by guest pc.
+     */
+    class coverage {
+    public:
+        static constexpr uint64_t map_size = 1 << 16;
+
+        /**
+         * @brief Creates coverage with a bitmap in shared memory
+         * @param size The size of the bitmap in bytes, a power of two
+         */
+        explicit coverage(uint64_t size = map_size);
+
+        /**
+         * @brief Creates coverage that counts into memory owned by the caller
+         * @param map The bitmap; it must outlive the coverage
+         * @param size The size of the bitmap in bytes, a power of two
+         */
+        coverage(uint8_t *map, uint64_t size);
+
+        ~coverage(void);
+
+        coverage(const coverage &) = delete;
+        coverage &operator=(const coverage &) = delete;
+
+        /**
+         * @brief Retrieves the bitmap
+         */
+        const uint8_t *map(void) const { return this->_map; }
+
+        /**
+         * @brief Retrieves the size of the bitmap in bytes
+         */
+        uint64_t size(void) const { return this->_mask + 1; }
+
+        /**
+         * @brief Retrieves the memfd behind the bitmap, or -1 if the caller supplied it
+         */
+        int fd(void) const { return this->_fd; }
+
+        /**
+         * @brief Zeroes the bitmap, as before each fuzzing input
+         * @details The per-branch counts are kept for write_lcov().
+         */
+        void clear(void);
+
+        /**
+         * @brief Counts the bytes of the bitmap that are set
+         * @return The number of edge buckets hit since the last clear()
+         */
+        uint64_t count(void) const;
+
+        /**
+         * @brief Retrieves the site for a branch, adding it on first sight
+         * @details Called when the cpu translates the branch.
+         * @param address The address of the branch
+         * @param next The address of the instruction after it
+         * @return The index of the site
+         */
+        uint32_t site(uint64_t address, uint64_t next);
+
+        /**
+         * @brief Retrieves every branch seen, in the order they were first translated
+         */
+        const std::vector<coverage_site> &sites(void) const { return this->_sites; }
+
+        /**
+         * @brief Records an edge from a branch
+         * @param site The index of the branch's site
+         * @param to The address execution went to
+         */
+        inline void hit(uint32_t site, uint64_t to) {
+            auto &s = this->_sites[site];
+
+            if (to == s.next) {
+                s.fallthrough++;
+            } else {
+                s.taken++;
+            }
+
+            auto &bucket = this->_map[(s.id >> 1 ^ coverage::hash(to)) & this->_mask];
+            bucket += bucket != 0xff;
+        }
+
+        /**
+         * @brief Writes the branch counts as lcov tracefile data
+         * @details Line numbers are guest addresses. Each branch gets a DA
+         * record with the number of times it ran and two BRDA records, one
+         * for falling through and one for being taken.
+         * @param out The stream to write to
+         * @param source The name to give the guest program in the SF record
+         */
+        void write_lcov(std::ostream &out, const std::string &source = "guest") const;
+
+    private:
+        static inline uint32_t hash(uint64_t address) {
+            return (uint32_t)((address * 0x9e3779b97f4a7c15ull) >> 32);
+        }
+
+        uint8_t *_map;
+        uint64_t _mask;
+        int _fd = -1;                       /* the memfd behind _map, if this owns it */
+
+        std::vector<coverage_site> _sites;
+        std::unordered_map<uint64_t, uint32_t> _site_index;     /* branch address to site */
+    };
+
+}
+
+#endif /* __mercury_vm_coverage_h__ */
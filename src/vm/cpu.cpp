@@ -1,7 +1,15 @@
 
 #include "./cpu.h"
+#include "./coverage.h"
+#include "./journal.h"
 
+#include <chrono>
 #include <iostream>
+#include <stdexcept>
+
+#if defined(MERCURY_THREADED_DISPATCH) && !defined(__GNUC__)
+#error "MERCURY_THREADED_DISPATCH needs a compiler with computed goto support"
+#endif
 
 namespace mercury {
 
@@ -12,36 +20,560 @@ namespace mercury {
         this->set_state(cpu_state::init);
 
         this->_r.fill({.q = 0});
+        this->_r[cpu_reg::sp].q = cpu::stack_base;
+        this->_f = {};
+        this->_v = {};
+
+        // keep scheduled events the same distance away
+        for (auto &e : this->_events) {
+            e.deadline -= e.relative ? 0 : std::min(e.deadline, this->_instret);
+        }
+
+        this->_instret = 0;
+        this->_watch_hit = {};
+        this->_watch_pending = false;
+
+        // attach() below discards the translations
+        this->_page_table = 0;
+        this->_tlb = nullptr;
+
+        this->_syscall_entry = 0;
+        this->_syscall_mask = 0;
+        this->_syscall_pc = 0;
+        this->_syscall_flags = 0;
+        this->_banked_sp = 0;
+        this->_irq_refused = false;
 
-        // todo: reset the stack pointer
         // todo: reset the program counter
         // todo: reset the flags
 
-        this->_bus = nullptr;
+        this->attach(nullptr);
+    }
+
+    /**
+     * @brief Attaches a bus to the cpu
+     * @param bus The bus to attach, or nullptr to detach
+     */
+    void cpu::attach(const bus_ptr &bus) {
+        this->_attached = bus;
+        this->_bus = bus.get();
+
+        this->_memory = bus ? bus->memory() : nullptr;
+        this->_pages = bus ? bus->pages() : nullptr;
+
+        if (this->_memory == nullptr || this->_pages == nullptr) {
+            this->_memory = nullptr;
+            this->_pages = nullptr;
+        }
+
+        this->_page_count = this->_memory ? bus->size() >> page_shift : 0;
+
+        for (auto &w : this->_watchpoints) {
+            this->mark_watched(w.address, w.size, true);
+        }
+
+        this->flush_tlb();
+        this->flush_decode_cache();
+    }
+
+    /**
+     * @brief Attaches coverage to count the edges the guest takes
+     * @param coverage The coverage, or nullptr to detach
+     */
+    void cpu::set_coverage(const coverage_ptr &coverage) {
+        this->_coverage = coverage;
+        this->flush_decode_cache();
     }
 
     opcode_func cpu::get_opcode_func(const uint32_t opcode) {
-        return cpu::_opcode_table[opcode];
+        auto it = cpu::_opcode_table.find(opcode);
+
+        return it == cpu::_opcode_table.end() ? nullptr : it->second;
+    }
+
+    /**
+     * @brief Discards all decoded instructions
+     */
+    void cpu::flush_decode_cache(void) {
+        this->_decoded.clear();
+        this->_code_pages.clear();
+        this->_insn = nullptr;
+
+        for (uint32_t page = 0; page < this->_page_count; page++) {
+            this->_pages[page] &= ~page_flag::page_code;
+        }
+
+        // nothing may keep pointing into the cache
+        this->_stale = false;
+        this->_relink = true;
+        this->_return_top = 0;
+        this->_return_hint = nullptr;
+    }
+
+    /**
+     * @brief Decodes a single instruction from the bus
+     * @param address The address of the instruction
+     * @param insn The instruction to decode into
+     */
+    void cpu::decode_one(uint64_t address, instruction &insn) {
+        insn.word = this->fetch<uint32_t>(address);
+        insn.length = sizeof(uint32_t);
+
+        for (auto i = 0; i < 3; i++) {
+            if ((insn.word >> (i * 3)) & 0x7) {
+                insn.operand[i] = this->fetch<uint64_t>(address + insn.length);
+                insn.length += sizeof(uint64_t);
+            } else {
+                insn.operand[i] = 0;
+            }
+        }
+    }
+
+    /**
+     * @brief Finds the first operand that names a register past a limit
+     * @details Only the modes that index the register file count.
+     * @param insn The instruction
+     * @param last The highest register an operand may name
+     * @return The index of the operand, or -1 if there is none
+     */
+    int cpu::register_past(const instruction &insn, uint64_t last) {
+        for (auto i = 0; i < 3; i++) {
+            auto mode = static_cast<addressing>((insn.word >> (i * 3)) & 0x7);
+
+            if ((mode == addressing::register_direct || mode == addressing::register_indirect ||
+                 mode == addressing::based_indexed) && insn.operand[i] > last) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    /**
+     * @brief Checks whether an instruction can transfer control
+     * @param word The instruction word
+     * @return true for jumps, calls, returns, loops, software interrupts and system calls
+     */
+    static bool is_branch(uint32_t word) {
+        auto op = word >> 16;
+
+        // jmp and the system calls were appended to the opcodes, outside the ranges
+        return (op >= opcode::_ja && op <= opcode::_jz) ||
+               (op >= opcode::_loop && op <= opcode::_loopnz) ||
+               (op >= opcode::_ret && op <= opcode::_retn) ||
+               op == opcode::_jmp || op == opcode::_call || op == opcode::_int || op == opcode::_into ||
+               op == opcode::_iret || op == opcode::_iretd || op == opcode::_syscall || op == opcode::_sysret;
+    }
+
+    /**
+     * @brief Retrieves the decoded entry for an address, decoding it on a miss
+     * @details Adjacent instructions that appear in the fusion table are decoded
+     * into a single entry so that they are dispatched once.
+     * @param address The address of the instruction
+     * @return The decoded entry
+     */
+    decoded &cpu::decode(uint64_t address) {
+        if (this->_stale) {
+            this->flush_decode_cache();
+        }
+
+        auto it = this->_decoded.find(address);
+
+        if (it != this->_decoded.end()) {
+            cpu_counters::bump(this->_counters.decode_hits);
+
+            // decoded in supervisor mode from a page user mode may not run
+            if (it->second.supervisor && this->user_mode()) {
+                this->_fetching = true;
+                this->page_fault(address);
+            }
+
+            return it->second;
+        }
+
+        cpu_counters::bump(this->_counters.decode_misses);
+
+        decoded d = {};
+        this->decode_entry(address, d);
+
+        return this->_decoded.emplace(address, d).first->second;
+    }
+
+    /**
+     * @brief Decodes the entry for an address, without looking in the cache
+     * @param address The address of the instruction
+     * @param d The entry to decode into
+     */
+    void cpu::decode_entry(uint64_t address, decoded &d) {
+        // a page fault from here on is on the fetch, before the instruction starts
+        this->_fetching = true;
+
+        d.address = address;
+        this->decode_one(address, d.insn[0]);
+        d.func = this->get_opcode_func(d.insn[0].word);
+        d.first = d.func;
+        d.length = d.insn[0].length;
+        d.count = 1;
+
+        // checked once here, so that handlers can index the registers directly
+        auto bad = cpu::register_past(d.insn[0], cpu_reg::flags) >= 0;
+
+        // the fused handlers write registers directly, so neither half may name flags
+        auto plain = cpu::register_past(d.insn[0], cpu_reg::pc) < 0;
+
+        // only look at the next instruction when this one can start a pair, and
+        // while paging, only on the same page, where fetching it cannot fault
+        auto head = cpu::_fusion_table.lower_bound((uint64_t)d.insn[0].word << 32);
+        auto mapped = this->_tlb == nullptr ||
+                      (address & (page_size - 1)) + d.length + sizeof(uint32_t) + 3 * sizeof(uint64_t) <= page_size;
+
+        if (d.func != nullptr && plain && head != cpu::_fusion_table.end() && (head->first >> 32) == d.insn[0].word && mapped &&
+            (this->_breakpoints.empty() || !this->_breakpoints.count(address + d.length))) {
+            this->decode_one(address + d.length, d.insn[1]);
+
+            auto fused = cpu::_fusion_table.find(
+                (uint64_t)d.insn[0].word << 32 | d.insn[1].word
+            );
+
+            // a branch that ends a pair would hide its edge from coverage, and the
+            // fused handlers index the registers of both halves directly
+            if (fused != cpu::_fusion_table.end() && !(this->_coverage && is_branch(d.insn[1].word)) &&
+                cpu::register_past(d.insn[1], cpu_reg::pc) < 0) {
+                d.func = fused->second;
+                d.length += d.insn[1].length;
+                d.count = 2;
+            }
+        }
+
+        // so that devices writing to memory know to flush the cache
+        for (auto page = address >> page_shift; page <= (address + d.length - 1) >> page_shift; page++) {
+            auto frame = page;
+
+            if (this->_tlb != nullptr) {
+                frame = this->translate(page << page_shift, page_access::access_fetch) >> page_shift;
+                d.supervisor |= !this->_tlb[page & (tlb_size - 1)].user;
+                this->_code_pages.insert(page);
+            }
+
+            if (frame < this->_page_count && !(this->_pages[frame] & page_flag::page_code)) {
+                this->mark_code(frame);
+            }
+        }
+
+        this->_fetching = false;
+
+        // count the edge the branch takes; its own handler is still first
+        if (this->_coverage && d.func != nullptr && d.count == 1 && is_branch(d.insn[0].word)) {
+            d.cover = this->_coverage->site(address, address + d.length);
+            d.func = &cpu::_cover;
+        }
+
+        // an undefined instruction raises when it runs
+        if (d.func == nullptr) {
+            d.func = d.first = &cpu::_illegal;
+        } else if (bad) {
+            d.func = d.first = &cpu::_bad_register;
+        }
+
+        // a trap covers no instructions, so it neither moves pc nor retires
+        if (!this->_breakpoints.empty() && this->_breakpoints.count(address)) {
+            d.func = d.first = &cpu::_trap;
+            d.length = 0;
+            d.count = 0;
+        }
+
+        d.thread = cpu::get_threaded_op(d);
+    }
+
+    /**
+     * @param frame The physical page number
+     */
+    void cpu::mark_code(uint64_t frame) {
+        this->_pages[frame] |= page_flag::page_code;
+
+        for (auto &e : this->_tlb_entries) {
+            if (e.frame == frame) {
+                e.write = tlb_invalid;
+            }
+        }
+
+        if (this->_stack_window != nullptr && this->_stack_frame == frame) {
+            this->close_stack_window();
+        }
+    }
+
+    /**
+     * @brief Decodes the cached entry for an address again, in place
+     * @param address The address of the instruction
+     */
+    void cpu::redecode(uint64_t address) {
+        auto it = this->_decoded.find(address);
+
+        if (it != this->_decoded.end()) {
+            decoded d = {};
+            this->decode_entry(address, d);
+            it->second = d;
+        }
+    }
+
+    /**
+     * @brief Sets a breakpoint
+     * @details Besides the entry at the address, an entry that fused the
+     * instruction at the address into a pair is split. Instructions are 4
+     * bytes plus 8 per operand, so only four addresses can hold one.
+     * @param address The address of the instruction
+     */
+    void cpu::add_breakpoint(uint64_t address) {
+        if (!this->_breakpoints.insert(address).second) {
+            return;
+        }
+
+        this->redecode(address);
+
+        for (uint64_t length = sizeof(uint32_t); length <= sizeof(uint32_t) + 3 * sizeof(uint64_t); length += sizeof(uint64_t)) {
+            auto it = this->_decoded.find(address - length);
+
+            if (it != this->_decoded.end() && it->second.count == 2 && it->second.insn[0].length == length) {
+                this->redecode(address - length);
+            }
+        }
+    }
+
+    /**
+     * @brief Clears a breakpoint
+     * @param address The address of the instruction
+     */
+    void cpu::remove_breakpoint(uint64_t address) {
+        if (this->_breakpoints.erase(address) == 0) {
+            return;
+        }
+
+        this->redecode(address);
+
+        // let the instruction before fuse with this one again
+        for (uint64_t length = sizeof(uint32_t); length <= sizeof(uint32_t) + 3 * sizeof(uint64_t); length += sizeof(uint64_t)) {
+            auto it = this->_decoded.find(address - length);
+
+            if (it != this->_decoded.end() && it->second.count == 1 && it->second.insn[0].length == length) {
+                this->redecode(address - length);
+            }
+        }
+    }
+
+    /**
+     * @brief Sets a watchpoint
+     * @param address The first address to watch
+     * @param size The number of bytes to watch
+     * @param kind The accesses to stop on
+     */
+    void cpu::add_watchpoint(uint64_t address, uint64_t size, watch_kind kind) {
+        if (size == 0 || address + size < address || !(kind & watch_kind::watch_access)) {
+            throw std::invalid_argument("Watchpoint is empty or wraps around memory");
+        }
+
+        this->_watchpoints.push_back({ address, size, kind });
+        this->mark_watched(address, size, true);
+
+        // the window or a TLB entry may be on a page that is watched now
+        this->flush_tlb();
+    }
+
+    /**
+     * @brief Clears a watchpoint set with the same arguments
+     * @param address The first address watched
+     * @param size The number of bytes watched
+     * @param kind The accesses stopped on
+     */
+    void cpu::remove_watchpoint(uint64_t address, uint64_t size, watch_kind kind) {
+        auto it = std::find_if(this->_watchpoints.begin(), this->_watchpoints.end(), [&](const watchpoint &w) {
+            return w.address == address && w.size == size && w.kind == kind;
+        });
+
+        if (it == this->_watchpoints.end()) {
+            return;
+        }
+
+        this->_watchpoints.erase(it);
+        this->mark_watched(address, size, false);
+
+        // the pages may be shared with another watchpoint
+        for (auto &w : this->_watchpoints) {
+            this->mark_watched(w.address, w.size, true);
+        }
+
+        this->flush_tlb();
+    }
+
+    /**
+     * @brief Checks a slow path access against the watchpoints
+     * @details A hit during an instruction traps the cpu once it retires; a
+     * hit between instructions, such as when an interrupt is delivered,
+     * traps it before the next one.
+     * @param address The address of the access
+     * @param size The size of the access in bytes
+     * @param write Whether the access is a write
+     */
+    void cpu::check_watchpoints(uint64_t address, uint64_t size, bool write) {
+        auto kind = write ? watch_kind::watch_write : watch_kind::watch_read;
+
+        for (auto &w : this->_watchpoints) {
+            if (!(w.kind & kind) || address >= w.address + w.size || w.address >= address + size) {
+                continue;
+            }
+
+            auto running = this->_state == cpu_state::running;
+
+            // instructions that touch memory are never fused, so the entry holds just this one
+            this->_watch_hit = {
+                std::max(address, w.address),
+                running ? this->current()->address : this->_r[cpu_reg::pc].q,
+                w.kind,
+                write,
+            };
+
+            if (running) {
+                this->set_state(cpu_state::trapped);
+            } else {
+                this->_watch_pending = true;
+            }
+
+            return;
+        }
+    }
+
+    /**
+     * @brief Sets or clears page_watch on the pages a range touches
+     * @details Only pages in _memory have flags; other addresses always take
+     * the slow path.
+     */
+    void cpu::mark_watched(uint64_t address, uint64_t size, bool watched) {
+        if (this->_pages == nullptr) {
+            return;
+        }
+
+        auto last = (address + size - 1) >> page_shift;
+
+        for (auto page = address >> page_shift; page <= last && page < this->_page_count; page++) {
+            if (watched) {
+                this->_pages[page] |= page_flag::page_watch;
+            } else {
+                this->_pages[page] &= ~page_flag::page_watch;
+            }
+        }
+    }
+
+    /**
+     * @brief Finds the entry at a taken branch target
+     * @param d The entry that branched
+     * @param pc The branch target
+     * @return The entry at the target
+     */
+    decoded *cpu::branch(decoded *d, uint64_t pc) {
+        auto call = this->_return_hint;
+        this->_return_hint = nullptr;
+
+        // a return lands after its call; link it there lazily, as follow() does
+        if (call != nullptr && call->address + call->length == pc) {
+            if (call->next == nullptr) {
+                auto next = &this->decode(pc);
+
+                if (next->supervisor != call->supervisor) {
+                    return next;
+                }
+
+                call->next = next;
+            }
+
+            return call->next;
+        }
+
+        if (d->taken == nullptr || d->taken_pc != pc) {
+            auto target = &this->decode(pc);
+
+            // as in follow(), a link never leads user mode to supervisor code
+            if (target->supervisor != d->supervisor) {
+                return target;
+            }
+
+            d->taken = target;
+            d->taken_pc = pc;
+        }
+
+        return d->taken;
+    }
+
+    /**
+     * @brief Selects the threaded run loop label for a decoded entry
+     * @param d The decoded entry
+     * @return The label to dispatch to
+     */
+    threaded_op cpu::get_threaded_op(const decoded &d) {
+        // the inline bodies write the registers directly, so they only run
+        // instructions that passed the decoder's register check and leave
+        // flags to load_flags()
+        if (d.count != 1 || cpu::register_past(d.insn[0], cpu_reg::pc) >= 0) {
+            return threaded_op::t_call;
+        }
+
+        switch (d.insn[0].word) {
+            case opc0(opcode::_nop):
+                return threaded_op::t_nop;
+            case opc2(opcode::_add, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_add_rr;
+            case opc2(opcode::_add, addressing::register_direct, addressing::immediate):
+                return threaded_op::t_add_ri;
+            case opc2(opcode::_sub, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_sub_rr;
+            case opc2(opcode::_sub, addressing::register_direct, addressing::immediate):
+                return threaded_op::t_sub_ri;
+            case opc1(opcode::_inc, addressing::register_direct):
+                return threaded_op::t_inc_r;
+            case opc1(opcode::_dec, addressing::register_direct):
+                return threaded_op::t_dec_r;
+            case opc2(opcode::_fadd, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_fadd_ff;
+            case opc2(opcode::_fsub, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_fsub_ff;
+            case opc2(opcode::_fmul, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_fmul_ff;
+            case opc2(opcode::_fdiv, addressing::register_direct, addressing::register_direct):
+                return threaded_op::t_fdiv_ff;
+            default:
+                return threaded_op::t_call;
+        }
     }
 
     /**
      * @brief Steps the cpu through one instruction
+     * @details The program counter is moved past the instruction before it is
+     * executed, so handlers see the address of the next instruction.
      */
     void cpu::step(void) {
         assert(this->_state == cpu_state::running);
 
-        auto opcode = this->_bus->read32(this->pc().q);
-        auto func = this->get_opcode_func(opcode);
-
-        if (func == nullptr) {
-            this->set_flag(cpu_flag::illegal, 1);
-            this->halt();
+        uint64_t retired = 0;
 
-            return;
+        try {
+            this->execute(this->decode(this->pc().q), retired, 1);
+        } catch (const unwind &) {
+            // the exception was delivered; the step ends at its handler
+            retired += this->charge_fetch_fault();
+        } catch (...) {
+            this->retire(retired);
+            throw;
         }
 
-        func(this);
-        this->pc().q += 2;
+        this->retire(retired);
+    }
+
+    /**
+     * @brief Raises a protection fault for an invalid addressing mode, abandoning the instruction
+     * @param value The operand that used the mode
+     */
+    void cpu::fault(uint64_t value) {
+        this->raise(cpu_vector::vector_general_protection, value);
+
+        throw unwind();
     }
 
     /**
@@ -56,22 +588,93 @@ namespace mercury {
                 return value;
 
             case addressing::direct:
-                return this->_bus->read64(value);
+                return this->read64(value);
 
             case addressing::register_direct:
                 return this->_r[value].q;
 
             case addressing::register_indirect:
-                return this->_bus->read64(this->_r[value].q);
+                return this->read64(this->_r[value].q);
 
             case addressing::indexed:
-                return this->_bus->read64(this->_r[cpu_reg::r6].q + value);
+                return this->read64(this->_r[cpu_reg::r6].q + value);
 
             case addressing::based_indexed:
-                return this->_bus->read64(this->_r[cpu_reg::r6].q + this->_r[value].q);
+                return this->read64(this->_r[cpu_reg::r6].q + this->_r[value].q);
 
             default:
-                throw addressing_exception(value);
+                this->fault(value);
+        }
+    }
+
+    /**
+     * @brief Computes the address a memory operand refers to
+     * @param addr {addressing} The addressing mode to use
+     * @param value {uint64_t} The operand
+     * @return {uint64_t} The address
+     */
+    uint64_t cpu::effective_address(addressing addr, uint64_t value) {
+        switch (addr) {
+            case addressing::direct:
+                return value;
+
+            case addressing::register_indirect:
+                return this->_r[value].q;
+
+            case addressing::indexed:
+                return this->_r[cpu_reg::r6].q + value;
+
+            case addressing::based_indexed:
+                return this->_r[cpu_reg::r6].q + this->_r[value].q;
+
+            default:
+                this->fault(value);
+        }
+    }
+
+    /**
+     * @brief Gets a floating point operand
+     * @param addr {addressing} The addressing mode to use
+     * @param value {uint64_t} The operand
+     * @return {double} The value
+     */
+    double cpu::get_float_value(addressing addr, uint64_t value) {
+        reg data;
+
+        switch (addr) {
+            case addressing::register_direct:
+                return this->float_reg(value).f;
+
+            case addressing::immediate:
+                data.q = value;
+                break;
+
+            default:
+                data.q = this->read64(this->effective_address(addr, value));
+                break;
+        }
+
+        return data.f;
+    }
+
+    /**
+     * @brief Sets a floating point operand
+     * @param addr {addressing} The addressing mode to use
+     * @param value {uint64_t} The operand
+     * @param data {double} The value to store
+     */
+    void cpu::set_float_value(addressing addr, uint64_t value, double data) {
+        switch (addr) {
+            case addressing::register_direct:
+                this->float_reg(value).f = data;
+                break;
+
+            case addressing::immediate:
+                this->fault(value);
+
+            default:
+                this->write64(this->effective_address(addr, value), reg{.f = data}.q);
+                break;
         }
     }
 
@@ -84,50 +687,218 @@ namespace mercury {
     void cpu::set_addressed_value(addressing addr, uint64_t value, uint64_t data) {
         switch (addr) {
             case addressing::immediate:
-                throw addressing_exception(value);
+                this->fault(value);
 
             case addressing::direct:
-                this->_bus->write64(value, data);
+                this->write64(value, data);
                 break;
 
             case addressing::register_direct:
-                this->_r[value].q = data;
+                // flags goes through load_flags(), so that no write can leave user mode
+                if (value == cpu_reg::flags) {
+                    this->load_flags(data);
+                } else {
+                    this->_r[value].q = data;
+                }
                 break;
 
             case addressing::register_indirect:
-                this->_bus->write64(this->_r[value].q, data);
+                this->write64(this->_r[value].q, data);
                 break;
 
             case addressing::indexed:
-                this->_bus->write64(this->_r[cpu_reg::r6].q + value, data);
+                this->write64(this->_r[cpu_reg::r6].q + value, data);
                 break;
 
             case addressing::based_indexed:
-                this->_bus->write64(this->_r[cpu_reg::r6].q + this->_r[value].q, data);
+                this->write64(this->_r[cpu_reg::r6].q + this->_r[value].q, data);
                 break;
 
             default:
-                throw addressing_exception(value);
+                this->fault(value);
+        }
+    }
+
+    /**
+     * @brief Runs the cpu until it halts or has retired `limit` instructions
+     * @param limit The maximum number of instructions to retire
+     * @return The number of instructions retired
+     */
+    uint64_t cpu::run(uint64_t limit) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t retired = 0;
+
+        try {
+            do {
+                this->fire_events();
+
+                // an interrupt an event raised may have pushed onto a watched stack
+                if (this->_watch_pending) {
+                    this->_watch_pending = false;
+                    this->set_state(cpu_state::trapped);
+                    break;
+                }
+
+                auto slice = std::min(limit - retired, this->next_event());
+
+#if defined(MERCURY_THREADED_DISPATCH)
+                retired += this->run_threaded(slice);
+#else
+                retired += this->run_stepped(slice);
+#endif
+            } while (this->_state == cpu_state::stopped && retired < limit);
+        } catch (...) {
+            this->account_run(start);
+            throw;
+        }
+
+        this->account_run(start);
+
+        return retired;
+    }
+
+    /**
+     * @brief Adds the host time since a run started to the counts
+     * @param start When the run started
+     */
+    void cpu::account_run(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        cpu_counters::bump(this->_counters.run_ns,
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    /**
+     * @brief Schedules a callback after a number of instructions have retired
+     * @param delay The number of instructions to wait, at least 1
+     * @param func The callback
+     * @return An id for cancel()
+     */
+    uint64_t cpu::schedule(uint64_t delay, event_func func) {
+        auto id = ++this->_event_id;
+        delay = std::max<uint64_t>(delay, 1);
+
+        if (this->_state == cpu_state::running) {
+            // the run loop's count is not in _instret yet, so end the slice here
+            // and let fire_events() turn the delay into a deadline
+            this->_events.push_back({ id, delay, true, std::move(func) });
+            this->set_state(cpu_state::stopped);
+        } else {
+            this->_events.push_back({ id, this->_instret + delay, false, std::move(func) });
+        }
+
+        return id;
+    }
+
+    /**
+     * @brief Cancels a scheduled event that has not fired yet
+     * @param id The id returned by schedule()
+     */
+    void cpu::cancel(uint64_t id) {
+        this->_events.erase(
+            std::remove_if(this->_events.begin(), this->_events.end(),
+                           [id](const scheduled_event &e) { return e.id == id; }),
+            this->_events.end()
+        );
+    }
+
+    /**
+     * @brief Fires every event whose deadline has been reached
+     * @details Callbacks may schedule or cancel events, so the list is searched
+     * again after each one.
+     */
+    void cpu::fire_events(void) {
+        for (auto &e : this->_events) {
+            if (e.relative) {
+                e.deadline += this->_instret;
+                e.relative = false;
+            }
+        }
+
+        for (;;) {
+            auto due = std::find_if(this->_events.begin(), this->_events.end(),
+                                    [this](const scheduled_event &e) { return e.deadline <= this->_instret; });
+
+            if (due == this->_events.end()) {
+                break;
+            }
+
+            auto func = std::move(due->func);
+            this->_events.erase(due);
+            func();
+        }
+    }
+
+    /**
+     * @brief Retrieves the number of instructions until the next event
+     * @return The number of instructions, or UINT64_MAX if nothing is scheduled
+     */
+    uint64_t cpu::next_event(void) const {
+        uint64_t next = UINT64_MAX;
+
+        for (auto &e : this->_events) {
+            next = std::min(next, e.deadline > this->_instret ? e.deadline - this->_instret : 0);
         }
+
+        return next;
     }
 
     /**
-     * @brief Runs the cpu until it halts
+     * @brief Runs the cpu, dispatching each decoded entry through its handler pointer
+     * @details A halted or stopped cpu resumes from the current program counter.
+     * @param limit The maximum number of instructions to retire
+     * @return The number of instructions retired
      */
-    void cpu::run(void) {
-        assert(this->_state == cpu_state::init);
+    uint64_t cpu::run_stepped(uint64_t limit) {
+        assert(this->_state != cpu_state::running);
 
         this->set_state(cpu_state::running);
 
-        while (this->_state == cpu_state::running) {
-           this->step();
+        uint64_t retired = 0;
+
+        // a delivered exception leaves the loop, to carry on at its handler
+        for (auto delivered = true; delivered;) {
+            delivered = false;
+
+            try {
+                if (retired < limit && this->_state == cpu_state::running) {
+                    this->_relink = false;
+
+                    auto d = &this->decode(this->pc().q);
+
+                    for (;;) {
+                        this->execute(*d, retired, limit);
+
+                        if (this->_state != cpu_state::running || retired >= limit) {
+                            break;
+                        }
+
+                        d = this->follow(d);
+                    }
+                }
+            } catch (const unwind &) {
+                retired += this->charge_fetch_fault();
+                delivered = true;
+            } catch (...) {
+                this->retire(retired);
+                throw;
+            }
+        }
+
+        retired = this->retire(retired);
+
+        if (this->_state == cpu_state::running) {
+            this->set_state(cpu_state::stopped);
         }
+
+        return retired;
     }
 
     /**
      * @brief Halts the cpu
      */
     void cpu::halt(void) {
+        cpu_counters::bump(this->_counters.halts);
         this->set_state(cpu_state::halted);
 
         throw halted_exception();
@@ -164,58 +935,294 @@ namespace mercury {
     }
 
     /**
-     * @brief Pushes a value onto the stack
-     * @param value The value to push onto the stack
+     * @brief Pushes a value outside of the stack window, then moves the window to it
+     * @param address The new stack pointer
+     * @param value The value to push
      */
-    void cpu::push(uint64_t value) {
+    void cpu::push_slow(uint64_t address, uint64_t value) {
         assert(this->_bus != nullptr);
 
-        this->_bus->write64(--this->_r[cpu_reg::sp].q, value);
+        this->write64(address, value);
+        this->_r[cpu_reg::sp].q = address;
+        this->open_stack_window(address);
     }
 
     /**
-     * @brief Pops a value off of the stack
-     * @return The value popped off of the stack
+     * @brief Pops a value outside of the stack window, then moves the window to it
+     * @param address The stack pointer before the pop
+     * @return The value popped
      */
-    uint64_t cpu::pop(void) {
+    uint64_t cpu::pop_slow(uint64_t address) {
         assert(this->_bus != nullptr);
 
-        return this->_bus->read64(this->_r[cpu_reg::sp].q++);
+        auto value = this->read64(address);
+        this->_r[cpu_reg::sp].q = address + sizeof(uint64_t);
+        this->open_stack_window(address);
+
+        return value;
     }
 
     /**
-     * @brief Interrupts the cpu to execute a request
-     * @param vector The vector to interrupt with
+     * @brief Points the stack window at the page holding an address
+     * @details Only pages in _memory can be windowed; on any other bus every
+     * push and pop keeps going through read/write.
+     * @param address The stack pointer
      */
-    void cpu::irq(const uint8_t vector) {
-        if (this->get_flag(cpu_flag::interrupt)) {
-            this->push(this->_r[cpu_reg::pc].q);
-            this->push(this->_r[cpu_reg::flags].q);
+    void cpu::open_stack_window(uint64_t address) {
+        if (this->_tlb != nullptr) {
+            auto &e = this->_tlb[(address >> page_shift) & (tlb_size - 1)];
 
-            this->set_flag(cpu_flag::interrupt, 1);
-            this->set_flag(cpu_flag::_break, 0);
+            if (e.write != (address & ~(page_size - 1)) || e.host == nullptr) {
+                this->close_stack_window();
+                return;
+            }
 
-            // jump to the address of the requested vector
-            this->_r[cpu_reg::pc].q = this->_bus->read64(
-            cpu::irq_vector + vector
-            );
+            this->_stack_page = address >> page_shift;
+            this->_stack_frame = e.frame;
+            this->_stack_window = e.host;
+            return;
+        }
+
+        if (!this->is_direct<uint64_t>(address, page_flag::page_watch | page_flag::page_code)) {
+            this->close_stack_window();
+            return;
+        }
+
+        this->_stack_page = address >> page_shift;
+        this->_stack_frame = this->_stack_page;
+        this->_stack_window = this->_memory + (this->_stack_page << page_shift);
+    }
+
+    /**
+     * @brief Interrupts the cpu to execute a request, unless the interrupt flag holds it off
+     * @details The handler comes from the same table as the exceptions, at
+     * the interrupt's vector. The cpu pushes `pc` and the flags, with no code,
+     * and sets the interrupt flag until the handler returns with iret.
+     * @param vector The vector to interrupt with
+     * @return true if the interrupt was delivered
+     */
+    bool cpu::irq(const uint8_t vector) {
+        if (this->_journal && !this->_journal->admit(*this, journal::ev_irq, vector)) {
+            return false;
+        }
+
+        if (this->get_flag(cpu_flag::interrupt)) {
+            this->_irq_refused = true;
+            return false;
         }
+
+        return this->interrupt(vector);
     }
 
     /**
      * @brief Non-maskable interrupt
+     * @details Delivered like irq(), whatever the interrupt flag.
      * @param vector The vector to interrupt with
      */
     void cpu::nmi(const uint8_t vector) {
+        if (this->_journal && !this->_journal->admit(*this, journal::ev_nmi, vector)) {
+            return;
+        }
+
+        this->interrupt(vector);
+    }
+
+    /**
+     * @brief Delivers an interrupt through the vector table
+     * @param vector The vector to interrupt with
+     * @return false if the vector has no handler
+     */
+    bool cpu::interrupt(uint8_t vector) {
+        auto flags = this->_r[cpu_reg::flags].q;
+        uint64_t handler = 0;
+
+        this->switch_mode(false);
+
+        if (this->_vector_table != cpu::no_vector_table) {
+            handler = this->read64(this->_vector_table + vector * sizeof(uint64_t));
+        }
+
+        if (handler == 0) {
+            this->switch_mode((flags & cpu_flag::user) != 0);
+            return false;
+        }
+
+        cpu_counters::bump(this->_counters.interrupts);
+
         this->push(this->_r[cpu_reg::pc].q);
-        this->push(this->_r[cpu_reg::flags].q);
+        this->push(flags);
 
         this->set_flag(cpu_flag::interrupt, 1);
+        this->set_flag(cpu_flag::_break, 0);
+        this->jump(handler);
 
-        // jump to the address of the requested vector
-        this->_r[cpu_reg::pc].q = this->_bus->read64(
-        cpu::nmi_vector + vector
-        );
+        return true;
+    }
+
+    /**
+     * @brief Raises an exception at the instruction being executed
+     * @param vector The exception vector
+     * @param code A code for the handler, such as the faulting address
+     */
+    void cpu::raise(cpu_vector vector, uint64_t code) {
+        // a fault on a fetch comes between instructions; the previous one retired
+        auto fetching = this->_fetching;
+        auto pc = fetching ? this->_r[cpu_reg::pc].q : this->fault_pc();
+        auto flags = this->_r[cpu_reg::flags].q;
+
+        this->_fetching = false;
+        this->_fetch_faulted = fetching;
+
+        cpu_counters::bump(vector == cpu_vector::vector_invalid_opcode ? this->_counters.illegal : this->_counters.faults);
+        this->_unretired += !fetching;
+
+        uint64_t handler = 0;
+
+        this->_delivering = true;
+        this->switch_mode(false);
+
+        if (this->_vector_table != cpu::no_vector_table) {
+            handler = this->read64(this->_vector_table + vector * sizeof(uint64_t));
+        }
+
+        this->_r[cpu_reg::pc].q = pc;
+
+        if (handler == 0) {
+            this->_delivering = false;
+            this->switch_mode((flags & cpu_flag::user) != 0);
+
+            switch (vector) {
+                case cpu_vector::vector_invalid_opcode:
+                    this->set_flag(cpu_flag::illegal, 1);
+                    this->halt();
+
+                case cpu_vector::vector_general_protection:
+                    throw addressing_exception(code);
+
+                default:
+                    this->set_state(cpu_state::error);
+                    throw fault_exception(vector, code);
+            }
+        }
+
+        this->push(pc);
+        this->push(flags);
+        this->push(code);
+
+        this->_delivering = false;
+        this->jump(handler);
+    }
+
+    /**
+     * @brief Retrieves the address of the instruction being executed
+     * @details pc has already moved past the whole decoded entry, so the
+     * address comes from the entry, which is either instruction of a pair.
+     */
+    uint64_t cpu::fault_pc(void) {
+        auto d = this->current();
+
+        return this->_insn == &d->insn[1] ? d->address + d->insn[0].length : d->address;
+    }
+
+    /**
+     * @brief Passes a nondeterministic value into the guest
+     * @param value The live value
+     * @return The value the guest should see
+     */
+    uint64_t cpu::external(uint64_t value) {
+        return this->_journal ? this->_journal->value(journal::ev_value, value) : value;
+    }
+
+    /**
+     * @brief Registers a host function the guest can call with vmcall
+     * @param number The hypercall number, below hypercall_count
+     * @param func The function, or nullptr to unregister it
+     */
+    void cpu::hypercall(uint64_t number, hypercall_func func) {
+        if (number >= cpu::hypercall_count) {
+            throw std::out_of_range("Hypercall number is out of range");
+        }
+
+        if (number >= this->_hypercalls.size()) {
+            this->_hypercalls.resize(number + 1);
+        }
+
+        this->_hypercalls[number] = std::move(func);
+    }
+
+    /**
+     * @brief Retrieves a range of guest memory for the host to work on in place
+     * @details With paging on, each page of the range is translated as the
+     * guest would access it in its current mode, without faulting. The host
+     * sees one pointer, so the pages must also be contiguous in memory.
+     * @param address The guest address of the range
+     * @param size The size of the range in bytes
+     * @param writable Whether the host will write to the range
+     * @return The host address of the range, or nullptr if it is not all memory
+     */
+    uint8_t *cpu::guest_memory(uint64_t address, uint64_t size, bool writable) {
+        auto limit = (uint64_t)this->_page_count << page_shift;
+
+        if (this->_tlb != nullptr) {
+            auto access = writable ? page_access::access_write : page_access::access_read;
+            auto physical = this->walk(address, access);
+
+            if (physical == UINT64_MAX) {
+                return nullptr;
+            }
+
+            for (auto next = page_size - (address & (page_size - 1)); next < size; next += page_size) {
+                if (this->walk(address + next, access) != physical + next) {
+                    return nullptr;
+                }
+            }
+
+            address = physical;
+        }
+
+        if (!this->_memory || address > limit || size > limit - address) {
+            return nullptr;
+        }
+
+        if (writable && size != 0) {
+            bool code = false;
+
+            for (auto page = address >> page_shift; page <= (address + size - 1) >> page_shift; page++) {
+                code |= (this->_pages[page] & page_flag::page_code) != 0;
+                this->_pages[page] |= page_flag::page_written;
+            }
+
+            if (code) {
+                this->flush_decode_cache();
+            }
+        }
+
+        return this->_memory + address;
+    }
+
+    /**
+     * @brief Reads a value from a device through the journal
+     * @details Only reads that miss the direct memory path get here, so RAM is
+     * never journalled. While replaying the device is not read at all.
+     * @param address The address to read from
+     * @param width The width of the read in bytes
+     * @return The value the guest should see
+     */
+    uint64_t cpu::journal_read(uint64_t address, uint8_t width) {
+        if (this->_journal->replaying()) {
+            return this->_journal->value(journal::ev_read, 0);
+        }
+
+        uint64_t value;
+
+        switch (width) {
+            case 1: value = this->_bus->read8(address); break;
+            case 2: value = this->_bus->read16(address); break;
+            case 4: value = this->_bus->read32(address); break;
+            default: value = this->_bus->read64(address); break;
+        }
+
+        return this->_journal->value(journal::ev_read, value);
     }
 
-}
\ No newline at end of file
+}
@@ -7,14 +7,26 @@
 
 #define __mercury_vm_cpu_h__
 
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
 #include <map>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "bus.h"
+#include "simd.h"
+#include "stats.h"
 
 #include "../exc/addr_exc.h"
+#include "../exc/fault_exc.h"
 #include "../exc/halted_exc.h"
 #include "./opcode.h"
 
@@ -37,13 +49,14 @@ namespace mercury {
     enum cpu_flag {
         carry     = 0x01,
         zero      = 0x02,
-        interrupt = 0x04,
+        interrupt = 0x04,               /* set while maskable interrupts are held off */
         decimal   = 0x08,
         _break    = 0x10,
         unused    = 0x20,
         overflow  = 0x40,
         negative  = 0x80,
         illegal   = 0x100,
+        user      = 0x200,
     };
 
     /**
@@ -77,6 +90,20 @@ namespace mercury {
         f7 = 7,
     };
 
+    /**
+     * @brief Vector register indices
+     */
+    enum vector_reg {
+        v0 = 0,
+        v1 = 1,
+        v2 = 2,
+        v3 = 3,
+        v4 = 4,
+        v5 = 5,
+        v6 = 6,
+        v7 = 7,
+    };
+
     /**
      * @brief CPU state
      */
@@ -85,25 +112,271 @@ namespace mercury {
         running,
         halted,
         error,
+        stopped,        /* returned to the host before halting */
+        trapped,        /* returned to the host at a breakpoint or watchpoint */
+    };
+
+    /**
+     * @brief Exception vectors, numbered as on x86
+     */
+    enum cpu_vector : uint8_t {
+        vector_divide = 0,              /* division by zero, or a quotient that does not fit */
+        vector_invalid_opcode = 6,      /* an opcode and addressing modes with no handler */
+        vector_double_fault = 8,        /* a page fault while delivering an exception; always goes to the host */
+        vector_general_protection = 13, /* an operand in a mode the instruction cannot use */
+        vector_page_fault = 14,         /* an access the MMU does not allow */
+    };
+
+    /**
+     * @brief Model-specific registers, read and written with rdmsr and wrmsr
+     */
+    enum cpu_msr : uint64_t {
+        msr_vector_table = 0,           /* the address of the exception handlers */
+        msr_page_table = 1,             /* the physical address of the top-level page table, or 0 */
+        msr_syscall_entry = 2,          /* the address syscall jumps to, or 0 to leave syscall illegal */
+        msr_syscall_mask = 3,           /* the flags syscall clears */
+        msr_syscall_pc = 4,             /* the address sysret returns to, saved by syscall */
+        msr_syscall_flags = 5,          /* the flags sysret restores, saved by syscall */
+        msr_banked_stack = 6,           /* sp of the mode that is not running: user mode's, to the kernel */
+        msr_count,
+    };
+
+    /**
+     * @brief Feature bits reported by cpuid leaf 1
+     */
+    enum cpu_feature : uint64_t {
+        feature_fpu        = 0x01,      /* f0 to f7 and the floating point instructions */
+        feature_vector     = 0x02,      /* v0 to v7 and the packed instructions */
+        feature_exceptions = 0x04,      /* exceptions delivered through msr_vector_table */
+        feature_msr        = 0x08,      /* rdmsr and wrmsr */
+        feature_paging     = 0x10,      /* page tables through msr_page_table, and invlpg */
+        feature_user       = 0x20,      /* user mode, with privileged instructions and pages */
+        feature_syscall    = 0x40,      /* syscall and sysret */
+        feature_hypercall  = 0x80,      /* vmcall */
+    };
+
+    /**
+     * @brief Bits of a page table entry
+     * @details Entries are 64 bits wide, with the physical address of the next
+     * table or of the page in bits 12 to 47. An access is only allowed when
+     * every level allows it.
+     */
+    enum pte_flag : uint64_t {
+        pte_present    = 0x01,          /* the entry maps something */
+        pte_writable   = 0x02,          /* writes are allowed */
+        pte_user       = 0x04,          /* user code may access the page */
+        pte_accessed   = 0x20,          /* set by the cpu when the entry is used */
+        pte_dirty      = 0x40,          /* set by the cpu when the page is written; leaf entries only */
+        pte_no_execute = 1ull << 63,    /* instructions may not be fetched from the page */
+        pte_address    = 0x0000fffffffff000,    /* the physical address bits */
+    };
+
+    /**
+     * @brief The kinds of access the MMU checks
+     */
+    enum page_access : uint8_t {
+        access_read,
+        access_write,
+        access_fetch,
+    };
+
+    /**
+     * @brief A translation cached by the software TLB
+     * @details Each kind of access has its own tag, holding the virtual page
+     * while the entry allows that access, so a lookup is a single compare.
+     * The write tag is only set once the page is dirty, so that the first
+     * write to a clean page walks the tables and sets the dirty bit.
+     */
+    struct tlb_entry {
+        uint64_t read;              /* the virtual page address, or tlb_invalid */
+        uint64_t write;             /* as above, for writes */
+        uint64_t fetch;             /* as above, for instruction fetches */
+        uint64_t frame;             /* the physical page number */
+        uint8_t *host;              /* the host address of the page, or nullptr for devices and watched pages */
+        bool user;                  /* every level allows user mode; the decoder marks code with it */
+    };
+
+    static constexpr uint64_t tlb_invalid = 1;      /* never a page address, so never matches */
+
+    /**
+     * @brief The accesses a watchpoint stops on
+     */
+    enum watch_kind : uint8_t {
+        watch_none   = 0x00,
+        watch_write  = 0x01,
+        watch_read   = 0x02,
+        watch_access = watch_read | watch_write,
+    };
+
+    /**
+     * @brief A range of memory the cpu stops on accesses to
+     */
+    struct watchpoint {
+        uint64_t address;
+        uint64_t size;
+        watch_kind kind;
+    };
+
+    /**
+     * @brief The access that last stopped the cpu at a watchpoint
+     */
+    struct watch_hit {
+        uint64_t address;           /* the first watched byte accessed */
+        uint64_t pc;                /* the address of the instruction that made the access */
+        watch_kind kind;            /* the kind of the watchpoint, or watch_none */
+        bool write;                 /* whether the access was a write */
     };
 
     class cpu;
     typedef std::shared_ptr<cpu> cpu_ptr;
 
-    typedef std::function<void(cpu*)> opcode_func;
+    class journal;
+    typedef std::shared_ptr<journal> journal_ptr;
+
+    class coverage;
+    typedef std::shared_ptr<coverage> coverage_ptr;
+
+    typedef void (*opcode_func)(cpu*);
+
+    typedef std::function<void(void)> event_func;
+
+    typedef std::function<uint64_t(cpu &cpu)> hypercall_func;
+
+    /**
+     * @brief A single decoded instruction
+     * @details The layout in memory is a 32-bit word (opcode in the upper 16 bits,
+     * addressing modes in the lower 16 bits) followed by one 64-bit operand for
+     * each addressing mode that is not `none`.
+     */
+    struct instruction {
+        uint32_t word;              /* opcode << 16 | addressing */
+        uint32_t length;            /* length of the encoded instruction in bytes */
+        uint64_t operand[3];        /* raw operand values */
+    };
+
+    /**
+     * @brief Handlers that have their body inlined in the threaded run loop
+     */
+    enum threaded_op : uint8_t {
+        t_call = 0,                 /* dispatch through the handler pointer */
+        t_nop,
+        t_add_rr,
+        t_add_ri,
+        t_sub_rr,
+        t_sub_ri,
+        t_inc_r,
+        t_dec_r,
+        t_fadd_ff,
+        t_fsub_ff,
+        t_fmul_ff,
+        t_fdiv_ff,
+    };
+
+    /**
+     * @brief An entry in the decoded instruction cache
+     * @details When two adjacent instructions are found in the fusion table, the
+     * entry covers both of them and `func` is the fused handler. The handler then
+     * finds the second instruction at `insn[1]`.
+     *
+     * Entries are linked to the entry that follows them and to the last taken
+     * branch target the first time those are reached, so the run loops only go
+     * back to the cache lookup for new or changing targets.
+     */
+    struct decoded {
+        opcode_func func;           /* the handler to dispatch to */
+        opcode_func first;          /* the handler for insn[0] on its own */
+        uint64_t    address;        /* the address the entry was decoded from */
+        uint64_t    length;         /* number of bytes covered by this entry */
+        uint8_t     count;          /* number of instructions covered by this entry */
+        bool        supervisor;     /* fetched from a page user mode may not execute */
+        threaded_op thread;         /* the label used by the threaded run loop */
+        uint32_t    cover;          /* the coverage site, for a branch translated with coverage on */
+        decoded    *next;           /* the entry at address + length, once linked */
+        decoded    *taken;          /* the entry at taken_pc, once linked */
+        uint64_t    taken_pc;       /* the last taken branch target */
+        instruction insn[2];        /* the decoded instruction(s) */
+    };
+
+    /**
+     * @brief An entry in the shadow return-address stack
+     */
+    struct return_entry {
+        uint64_t address;           /* the return address pushed by call */
+        decoded *call;              /* the call's entry, whose next link is the entry at that address */
+    };
+
+    /**
+     * @brief A callback waiting for the cpu to retire a number of instructions
+     */
+    struct scheduled_event {
+        uint64_t id;
+        uint64_t deadline;          /* instret to fire at, or the delay while relative */
+        bool relative;              /* scheduled mid-instruction; deadline is still a delay */
+        event_func func;
+    };
+
+    /**
+     * @brief The hot state of a cpu
+     * @details Everything the run loops and handlers touch on every instruction
+     * lives here, packed into two cache lines. It holds no owning pointers, so
+     * generated code can address the fields directly through a raw pointer.
+     *
+     * The bus is not here: with paging the fast paths go through _tlb and
+     * _memory, and only device accesses and cache misses reach the bus, so
+     * _bus is a cold member of cpu and _tlb took its place.
+     */
+    struct alignas(64) cpu_context {
+        std::array<reg, 11> _r;             /* general purpose registers, sp, pc and flags */
+
+        cpu_state _state;                   /* the state of the cpu */
+        uint32_t _page_count;               /* the number of pages in _memory */
+
+        const instruction *_insn;           /* the instruction being executed */
+
+        tlb_entry *_tlb;                    /* the software TLB while paging is on, else nullptr */
+
+        uint8_t *_memory;                   /* host memory behind the bus, for direct access */
+        uint8_t *_pages;                    /* page_flag bytes for _memory */
+    };
+
+    static_assert(std::is_standard_layout<cpu_context>::value && std::is_trivial<cpu_context>::value,
+                  "cpu_context must stay a plain struct");
+    // 88 bytes of registers, two 4-byte fields and four pointers: 128 bytes, with no room to spare
+    static_assert(sizeof(cpu_context) <= 128, "cpu_context must fit in two cache lines");
 
     /**
      * @brief The CPU
+     * @details The hot state is in the cpu_context base; the members declared
+     * here are only touched on slow paths.
      */
-    class cpu {
+    class cpu : public cpu_context {
     private:
         static constexpr uint64_t stack_base = 0x100;
-        static constexpr uint64_t irq_vector = 0xfffe;
-        static constexpr uint64_t nmi_vector = 0xfffa;
+        static constexpr uint64_t shift_mask = 63;     /* shift and rotate counts use the low six bits */
+        static constexpr uint64_t tlb_size = 256;      /* TLB entries, a power of two */
+        static constexpr int page_levels = 4;          /* levels of page tables, 9 address bits each */
 
     public:
-        cpu(void) = default;
-        virtual ~cpu(void) = default;
+        cpu(void) : cpu_context() {}
+        ~cpu(void) = default;
+
+        /**
+         * @brief Attaches a bus to the cpu
+         * @param bus The bus to attach, or nullptr to detach
+         */
+        void attach(const bus_ptr &bus);
+
+        /**
+         * @brief Retrieves the attached bus
+         * @return The attached bus
+         */
+        const bus_ptr &attached(void) const { return this->_attached; }
+
+        /**
+         * @brief Retrieves the hot state of the cpu
+         * @return The cpu context
+         */
+        cpu_context *context(void) { return this; }
 
         /**
          * @brief Resets the state of the cpu
@@ -112,8 +385,9 @@ namespace mercury {
 
         /**
          * @brief Halts the cpu
+         * @details Throws halted_exception to leave the run loop, so it never returns.
          */
-        void halt(void);
+        [[noreturn]] void halt(void);
 
         /**
          * @brief Steps the cpu through one instruction
@@ -121,9 +395,158 @@ namespace mercury {
         void step(void);
 
         /**
-         * @brief Runs the cpu until it halts
+         * @brief Runs the cpu until it halts or has retired `limit` instructions
+         * @details Uses run_threaded() when built with MERCURY_THREADED_DISPATCH,
+         * otherwise run_stepped(). The run is split at each scheduled event's
+         * deadline and the event fires between the two parts, so events cost
+         * nothing per instruction. When the limit is reached the cpu is left in
+         * the stopped state and can be run again.
+         * @param limit The maximum number of instructions to retire
+         * @return The number of instructions retired
+         */
+        uint64_t run(uint64_t limit = UINT64_MAX);
+
+        /**
+         * @brief Schedules a callback after a number of instructions have retired
+         * @details Events only fire from run(), between instructions. An event
+         * scheduled by a device during an instruction counts from the end of
+         * that instruction.
+         * @param delay The number of instructions to wait, at least 1
+         * @param func The callback
+         * @return An id for cancel()
+         */
+        uint64_t schedule(uint64_t delay, event_func func);
+
+        /**
+         * @brief Cancels a scheduled event that has not fired yet
+         * @param id The id returned by schedule()
+         */
+        void cancel(uint64_t id);
+
+        /**
+         * @brief Runs the cpu, dispatching each decoded entry through its handler pointer
+         * @param limit The maximum number of instructions to retire
+         * @return The number of instructions retired
          */
-        void run(void);
+        uint64_t run_stepped(uint64_t limit = UINT64_MAX);
+
+#if defined(__GNUC__)
+        /**
+         * @brief Runs the cpu, using computed-goto dispatch
+         * @details Each handler label ends with its own indirect jump to the next
+         * handler, and the hottest handlers are inlined into the loop.
+         * @param limit The maximum number of instructions to retire
+         * @return The number of instructions retired
+         */
+        uint64_t run_threaded(uint64_t limit = UINT64_MAX);
+#endif
+
+        /**
+         * @brief Retrieves the number of instructions retired since reset
+         * @details Only updated when a run loop returns.
+         * @return The number of instructions retired
+         */
+        uint64_t instret(void) const { return this->_instret; }
+
+        /**
+         * @brief Takes a snapshot of the cpu's counters
+         * @details Safe to call from any thread while the cpu runs. The counters
+         * run from construction or the last clear_stats(), not from reset().
+         * @return The counters
+         */
+        cpu_stats stats(void) const { return this->_counters.snapshot(); }
+
+        /**
+         * @brief Zeroes the cpu's counters
+         * @details Must be called from the thread that runs the cpu.
+         */
+        void clear_stats(void) { this->_counters.clear(); }
+
+        /**
+         * @brief Interrupts the cpu to execute a request, unless the interrupt flag holds it off
+         * @details The handler comes from the exception vector table. A
+         * refused interrupt is not remembered; whoever raised it keeps it.
+         * @return true if the interrupt was delivered
+         */
+        bool irq(const uint8_t vector);
+
+        /**
+         * @brief Non-maskable interrupt
+         */
+        void nmi(const uint8_t vector);
+
+        /**
+         * @brief Sets what to call once the guest clears the interrupt flag after irq() was refused
+         * @details The callback runs as an event, one instruction after the
+         * flags were loaded, so an interrupt controller can offer what it held.
+         * @param func The callback, or nullptr for none
+         */
+        void on_unmask(event_func func) { this->_unmask = std::move(func); }
+
+        /**
+         * @brief Attaches a journal to record or replay nondeterministic input
+         * @param journal The journal, or nullptr to detach
+         */
+        void set_journal(const journal_ptr &journal) { this->_journal = journal; }
+
+        /**
+         * @brief Attaches coverage to count the edges the guest takes
+         * @details Branches are instrumented as they are translated, so the
+         * decoded cache is flushed; without coverage nothing is counted and
+         * nothing is checked.
+         * @param coverage The coverage, or nullptr to detach
+         */
+        void set_coverage(const coverage_ptr &coverage);
+
+        /**
+         * @brief Passes a nondeterministic value (a time, a host id) into the guest
+         * @details Recorded when a recording journal is attached; replaced by the
+         * recorded value when a replaying journal is attached.
+         * @param value The live value
+         * @return The value the guest should see
+         */
+        uint64_t external(uint64_t value);
+
+        static constexpr uint64_t hypercall_count = 256;
+
+        /**
+         * @brief Registers a host function the guest can call with vmcall
+         * @details The guest puts the hypercall number in r0 and up to seven
+         * arguments in r1 to r7, and gets the function's result back in r0. An
+         * unregistered number returns UINT64_MAX. A replayed journal calls the
+         * functions again, so they should only depend on the guest's registers
+         * and memory.
+         * @param number The hypercall number, below hypercall_count
+         * @param func The function, or nullptr to unregister it
+         */
+        void hypercall(uint64_t number, hypercall_func func);
+
+        /**
+         * @brief Retrieves a range of guest memory for the host to work on in place
+         * @details Only plain memory qualifies, never device registers. With
+         * paging on, the range is a virtual one, which the current mode must
+         * be allowed to access and which must map to contiguous memory. A
+         * writable range has its pages marked written up front, and any
+         * instructions decoded from it are discarded.
+         * @param address The guest address of the range
+         * @param size The size of the range in bytes
+         * @param writable Whether the host will write to the range
+         * @return The host address of the range, or nullptr if it is not all memory
+         */
+        uint8_t *guest_memory(uint64_t address, uint64_t size, bool writable);
+
+        /**
+         * @brief Selects the host kernels used by the vector instructions
+         * @details Defaults to simd_kernels::detect().
+         * @param kernels The kernels to use
+         */
+        void use_simd(const simd_kernels &kernels) { this->_simd = &kernels; }
+
+        /**
+         * @brief Retrieves the host kernels used by the vector instructions
+         * @return The kernels
+         */
+        const simd_kernels &simd(void) const { return *this->_simd; }
 
         /**
          * @brief Retrieves the current state
@@ -131,6 +554,123 @@ namespace mercury {
          */
         const cpu_state state(void) const { return this->_state; }
 
+        /**
+         * @brief Discards all decoded instructions
+         * @details Must be called after guest code has been modified.
+         */
+        void flush_decode_cache(void);
+
+        /**
+         * @brief Sets a breakpoint
+         * @details The decoded entry at the address is patched in place into a
+         * trap, so run loops pay nothing for breakpoints: the set is only
+         * consulted when an instruction is decoded. Reaching a breakpoint
+         * leaves the cpu trapped with the program counter at the breakpoint,
+         * before the instruction has run.
+         * @param address The address of the instruction
+         */
+        void add_breakpoint(uint64_t address);
+
+        /**
+         * @brief Clears a breakpoint
+         * @param address The address of the instruction
+         */
+        void remove_breakpoint(uint64_t address);
+
+        /**
+         * @brief Checks whether a breakpoint is set
+         * @param address The address of the instruction
+         * @return true if there is a breakpoint at the address
+         */
+        bool has_breakpoint(uint64_t address) const { return this->_breakpoints.count(address) != 0; }
+
+        /**
+         * @brief Sets a watchpoint
+         * @details The pages the range touches are marked page_watch, which
+         * keeps them off the direct memory path and out of the stack window,
+         * so only accesses to those pages pay for the check. An access that
+         * hits the watchpoint completes, then the cpu is left trapped after
+         * the instruction that made it, and watched() says where.
+         * @param address The first address to watch
+         * @param size The number of bytes to watch
+         * @param kind The accesses to stop on
+         */
+        void add_watchpoint(uint64_t address, uint64_t size, watch_kind kind);
+
+        /**
+         * @brief Clears a watchpoint set with the same arguments
+         * @param address The first address watched
+         * @param size The number of bytes watched
+         * @param kind The accesses stopped on
+         */
+        void remove_watchpoint(uint64_t address, uint64_t size, watch_kind kind);
+
+        /**
+         * @brief Retrieves the access that left the cpu trapped
+         * @return The access, with kind set to watch_none if the cpu last trapped at a breakpoint
+         */
+        const watch_hit &watched(void) const { return this->_watch_hit; }
+
+        static constexpr uint64_t no_vector_table = UINT64_MAX;
+
+        /**
+         * @brief Sets the address of the table of exception handlers
+         * @details Entry n is the 64-bit address of the handler for vector n.
+         * A zero entry, or no table, leaves the vector to the host.
+         * @param address The address of the table, or no_vector_table
+         */
+        void set_vector_table(uint64_t address) { this->_vector_table = address; }
+
+        /**
+         * @brief Retrieves the address of the table of exception handlers
+         */
+        uint64_t vector_table(void) const { return this->_vector_table; }
+
+        /**
+         * @brief Points the MMU at a top-level page table, turning paging on or off
+         * @details Discards the TLB and the decoded instructions, whose virtual
+         * addresses may now mean something else.
+         * @param address The physical address of the table, or 0 to turn paging off
+         */
+        void set_page_table(uint64_t address);
+
+        /**
+         * @brief Retrieves the physical address of the top-level page table
+         * @return The address, or 0 while paging is off
+         */
+        uint64_t page_table(void) const { return this->_page_table; }
+
+        /**
+         * @brief Discards every cached translation
+         * @details Must be called after the host changes the page tables in
+         * guest memory, or the user bit in the flags; the guest itself uses
+         * invlpg or rewrites msr_page_table.
+         */
+        void flush_tlb(void);
+
+        /**
+         * @brief Reads a model-specific register from the host
+         * @param number The register
+         * @return The value of the register
+         */
+        uint64_t msr(cpu_msr number) const;
+
+        /**
+         * @brief Writes a model-specific register from the host, as wrmsr does
+         * @param number The register
+         * @param value The value to write
+         */
+        void set_msr(cpu_msr number, uint64_t value);
+
+        /**
+         * @brief Checks whether the cpu is in user mode
+         */
+        bool user_mode(void) const { return (this->_r[cpu_reg::flags].q & cpu_flag::user) != 0; }
+
+        /** The feature bits cpuid reports */
+        static constexpr uint64_t features =
+            feature_fpu | feature_vector | feature_exceptions | feature_msr |
+            feature_paging | feature_user | feature_syscall | feature_hypercall;
 
     private:
         /** Arithmetic instructions */
@@ -177,10 +717,224 @@ namespace mercury {
 
 
         /** Control flow instructions */
+        static void _call(cpu *cpu);
         static void _hlt(cpu *cpu);
+        static void _trap(cpu *cpu);
+        static void _cover(cpu *cpu);
+        static void _ja(cpu *cpu);
+        static void _jae(cpu *cpu);
+        static void _jb(cpu *cpu);
+        static void _jbe(cpu *cpu);
+        static void _jc(cpu *cpu);
+        static void _jcxz(cpu *cpu);
+        static void _je(cpu *cpu);
+        static void _jg(cpu *cpu);
+        static void _jge(cpu *cpu);
+        static void _jl(cpu *cpu);
+        static void _jle(cpu *cpu);
+        static void _jmp(cpu *cpu);
+        static void _jna(cpu *cpu);
+        static void _jnae(cpu *cpu);
+        static void _jnb(cpu *cpu);
+        static void _jnbe(cpu *cpu);
+        static void _jnc(cpu *cpu);
+        static void _jne(cpu *cpu);
+        static void _jng(cpu *cpu);
+        static void _jnge(cpu *cpu);
+        static void _jnl(cpu *cpu);
+        static void _jnle(cpu *cpu);
+        static void _jno(cpu *cpu);
+        static void _jns(cpu *cpu);
+        static void _jnz(cpu *cpu);
+        static void _jo(cpu *cpu);
+        static void _js(cpu *cpu);
+        static void _jz(cpu *cpu);
+        static void _loop(cpu *cpu);
+        static void _loope(cpu *cpu);
+        static void _loopne(cpu *cpu);
+        static void _ret(cpu *cpu);
+
+        /** Fused instruction pairs */
+        static void _shl_add(cpu *cpu);
+        static void _shl_add_imm(cpu *cpu);
+        static void _cmp_jcc(cpu *cpu);
+        static void _cmp_jcc_imm(cpu *cpu);
+        static void _dec_jnz(cpu *cpu);
+        static void _inc_jnz(cpu *cpu);
+
+        /**
+         * @brief Evaluates a conditional jump against the flags
+         * @param op The jcc opcode
+         * @return true if the jump is taken
+         */
+        bool condition(uint16_t op);
+
+        /**
+         * @brief Evaluates a conditional jump straight from the operands of a cmp
+         * @param op The jcc opcode
+         * @param p1 The first operand of the cmp
+         * @param p2 The second operand of the cmp
+         * @return true if the jump is taken
+         */
+        static bool compare_condition(uint16_t op, uint64_t p1, uint64_t p2);
+
+        /**
+         * @brief Sets the flags for the comparison of two values
+         * @param p1 The first value
+         * @param p2 The second value
+         */
+        inline void set_compare_flags(uint64_t p1, uint64_t p2) {
+            auto result = p1 - p2;
+            auto &f = this->_r[cpu_reg::flags].q;
+
+            f &= ~(uint64_t)(cpu_flag::carry | cpu_flag::zero | cpu_flag::negative | cpu_flag::overflow);
+            f |= (p1 < p2 ? cpu_flag::carry : 0) |
+                 (result == 0 ? cpu_flag::zero : 0) |
+                 (result >> 63 ? cpu_flag::negative : 0) |
+                 (((p1 ^ p2) & (p1 ^ result)) >> 63 ? cpu_flag::overflow : 0);
+        }
+
+        /**
+         * @brief Sets the zero, negative and overflow flags for an increment or decrement
+         * @param result The result of the operation
+         * @param overflow Whether the operation overflowed as a signed value
+         */
+        inline void set_step_flags(uint64_t result, bool overflow) {
+            auto &f = this->_r[cpu_reg::flags].q;
+
+            f &= ~(uint64_t)(cpu_flag::zero | cpu_flag::negative | cpu_flag::overflow);
+            f |= (result == 0 ? cpu_flag::zero : 0) |
+                 (result >> 63 ? cpu_flag::negative : 0) |
+                 (overflow ? cpu_flag::overflow : 0);
+        }
+
+        /**
+         * @brief Shifts a value left, setting carry to the last bit shifted out
+         * @details The count uses its low six bits, and a count of 0 leaves
+         * the carry flag alone. shl, sal and their fused pairs all shift here.
+         * @param value The value to shift
+         * @param count The number of bits to shift by
+         * @return The shifted value
+         */
+        inline uint64_t shift_left(uint64_t value, uint64_t count) {
+            count &= shift_mask;
+
+            if (count == 0) {
+                return value;
+            }
+
+            this->set_flag(cpu_flag::carry, (value >> (64 - count)) & 1);
+
+            return value << count;
+        }
+
+        /**
+         * @brief Shifts a value right, setting carry to the last bit shifted out
+         * @details As shift_left(), the count uses its low six bits and a
+         * count of 0 leaves the carry flag alone.
+         * @param value The value to shift
+         * @param count The number of bits to shift by
+         * @return The shifted value
+         */
+        inline uint64_t shift_right(uint64_t value, uint64_t count) {
+            count &= shift_mask;
+
+            if (count == 0) {
+                return value;
+            }
+
+            this->set_flag(cpu_flag::carry, (value >> (count - 1)) & 1);
+
+            return value >> count;
+        }
+
+        /** Stack instructions */
+        static void _pop(cpu *cpu);
+        static void _popa(cpu *cpu);
+        static void _popf(cpu *cpu);
+        static void _push(cpu *cpu);
+        static void _pusha(cpu *cpu);
+        static void _pushf(cpu *cpu);
+
+        /** Floating point instructions */
+        static void _fabs(cpu *cpu);
+        static void _fadd(cpu *cpu);
+        static void _fchs(cpu *cpu);
+        static void _fcom(cpu *cpu);
+        static void _fdiv(cpu *cpu);
+        static void _fild(cpu *cpu);
+        static void _finit(cpu *cpu);
+        static void _fist(cpu *cpu);
+        static void _fld(cpu *cpu);
+        static void _fld1(cpu *cpu);
+        static void _fldpi(cpu *cpu);
+        static void _fldz(cpu *cpu);
+        static void _fmul(cpu *cpu);
+        static void _fsqrt(cpu *cpu);
+        static void _fst(cpu *cpu);
+        static void _fsub(cpu *cpu);
+        static void _fxch(cpu *cpu);
+
+        /** Vector instructions */
+        static void _vaddpd(cpu *cpu);
+        static void _vaddps(cpu *cpu);
+        static void _vcmpeqpd(cpu *cpu);
+        static void _vcmpeqps(cpu *cpu);
+        static void _vcmpltpd(cpu *cpu);
+        static void _vcmpltps(cpu *cpu);
+        static void _vmovdqu(cpu *cpu);
+        static void _vmulpd(cpu *cpu);
+        static void _vmulps(cpu *cpu);
+        static void _vpaddb(cpu *cpu);
+        static void _vpaddd(cpu *cpu);
+        static void _vpaddq(cpu *cpu);
+        static void _vpaddw(cpu *cpu);
+        static void _vpand(cpu *cpu);
+        static void _vpbroadcastq(cpu *cpu);
+        static void _vpcmpeqb(cpu *cpu);
+        static void _vpcmpeqd(cpu *cpu);
+        static void _vpcmpgtd(cpu *cpu);
+        static void _vpermq(cpu *cpu);
+        static void _vpextrq(cpu *cpu);
+        static void _vpmulld(cpu *cpu);
+        static void _vpmullw(cpu *cpu);
+        static void _vpor(cpu *cpu);
+        static void _vpshufb(cpu *cpu);
+        static void _vpshufd(cpu *cpu);
+        static void _vpsubd(cpu *cpu);
+        static void _vpsubq(cpu *cpu);
+        static void _vpxor(cpu *cpu);
+        static void _vsubpd(cpu *cpu);
+        static void _vsubps(cpu *cpu);
+
+        /** System instructions */
+        static void _cpuid(cpu *cpu);
+        static void _invlpg(cpu *cpu);
+        static void _rdmsr(cpu *cpu);
+        static void _syscall(cpu *cpu);
+        static void _sysret(cpu *cpu);
+        static void _wrmsr(cpu *cpu);
+
+        /**
+         * @brief Reads a model-specific register
+         * @param number The register, a cpu_msr
+         * @return The value of the register
+         */
+        uint64_t read_msr(uint64_t number);
+
+        /**
+         * @brief Writes a model-specific register
+         * @param number The register, a cpu_msr
+         * @param value The value to write
+         */
+        void write_msr(uint64_t number, uint64_t value);
 
         /** Other instructions */
+        static void _bad_register(cpu *cpu);
+        static void _illegal(cpu *cpu);
+        static void _iret(cpu *cpu);
         static void _nop(cpu *cpu);
+        static void _vmcall(cpu *cpu);
 
         /**
          * @brief Sets the value of an addressed value
@@ -198,32 +952,100 @@ namespace mercury {
          */
         uint64_t get_addressed_value(addressing addr, uint64_t value);
 
+        /**
+         * @brief Computes the address a memory operand refers to
+         * @param addr {addressing} The addressing mode to use
+         * @param value {uint64_t} The operand
+         * @return {uint64_t} The address
+         */
+        uint64_t effective_address(addressing addr, uint64_t value);
+
+        /**
+         * @brief Retrieves a floating point register
+         * @details Register numbers are taken modulo the number of registers.
+         * @param index The register number from the operand
+         * @return The register
+         */
+        inline reg &float_reg(uint64_t index) {
+            return this->_f[index & (fpu_count - 1)];
+        }
+
+        /**
+         * @brief Gets a floating point operand
+         * @details Register-direct operands name floating point registers;
+         * immediate and memory operands hold the bits of a double.
+         * @param addr {addressing} The addressing mode to use
+         * @param value {uint64_t} The operand
+         * @return {double} The value
+         */
+        double get_float_value(addressing addr, uint64_t value);
+
+        /**
+         * @brief Sets a floating point operand
+         * @param addr {addressing} The addressing mode to use
+         * @param value {uint64_t} The operand
+         * @param data {double} The value to store
+         */
+        void set_float_value(addressing addr, uint64_t value, double data);
+
+        inline double get_float_op_1(void) {
+            return this->get_float_value(
+                static_cast<addressing>(this->_insn->word & 0x7),
+                this->_insn->operand[0]
+            );
+        }
+
+        inline void set_float_op_1(double value) {
+            this->set_float_value(
+                    static_cast<addressing>(this->_insn->word & 0x7),
+                    this->_insn->operand[0],
+                    value
+            );
+        }
+
+        inline double get_float_op_2(void) {
+            return this->get_float_value(
+                static_cast<addressing>((this->_insn->word >> 3) & 0x7),
+                this->_insn->operand[1]
+            );
+        }
+
+        /**
+         * @brief Retrieves a vector register
+         * @details Register numbers are taken modulo the number of registers.
+         * @param index The register number from the operand
+         * @return The register
+         */
+        inline vreg &vector(uint64_t index) {
+            return this->_v[index & (vector_count - 1)];
+        }
+
         inline uint64_t get_op_1(void) {
             return this->get_addressed_value(
-                static_cast<addressing>((this->_bus->read16(this->_r[cpu_reg::pc].q + 2)) & 0x7),
-                this->_bus->read64(this->_r[cpu_reg::pc].q + 1)
+                static_cast<addressing>(this->_insn->word & 0x7),
+                this->_insn->operand[0]
             );
         }
 
         inline void set_op_1(uint64_t value) {
             this->set_addressed_value(
-                    static_cast<addressing>((this->_bus->read16(this->_r[cpu_reg::pc].q + 2)) & 0x7),
-                    this->_bus->read64(this->_r[cpu_reg::pc].q + 1),
+                    static_cast<addressing>(this->_insn->word & 0x7),
+                    this->_insn->operand[0],
                     value
             );
         }
 
         inline uint64_t get_op_2(void) {
             return this->get_addressed_value(
-                static_cast<addressing>((this->_bus->read16(this->_r[cpu_reg::pc].q + 2) >> 3) & 0x7),
-                this->_bus->read64(this->_r[cpu_reg::pc].q + 2)
+                static_cast<addressing>((this->_insn->word >> 3) & 0x7),
+                this->_insn->operand[1]
             );
         }
 
         inline void set_op_2(uint64_t value) {
             this->set_addressed_value(
-                    static_cast<addressing>((this->_bus->read16(this->_r[cpu_reg::pc].q + 2) >> 3) & 0x7),
-                    this->_bus->read64(this->_r[cpu_reg::pc].q + 2),
+                    static_cast<addressing>((this->_insn->word >> 3) & 0x7),
+                    this->_insn->operand[1],
                     value
             );
         }
@@ -231,8 +1053,8 @@ namespace mercury {
 
         inline uint64_t get_op_3(void) {
             return this->get_addressed_value(
-                static_cast<addressing>((this->_bus->read16(this->_r[cpu_reg::pc].q + 2) >> 6) & 0x7),
-                this->_bus->read64(this->_r[cpu_reg::pc].q + 3)
+                static_cast<addressing>((this->_insn->word >> 6) & 0x7),
+                this->_insn->operand[2]
             );
         }
 
@@ -259,25 +1081,71 @@ namespace mercury {
 
         /**
          * @brief Pushes a value onto the stack
+         * @details Stays inside the cached stack window when it can; the window
+         * is moved by push_slow() when sp leaves it. sp only moves once the
+         * value is stored, so a push that page faults can be retried.
          * @param value The value to push onto the stack
          */
-        void push(uint64_t value);
+        inline void push(uint64_t value) {
+            auto sp = this->_r[cpu_reg::sp].q - sizeof(uint64_t);
+            auto offset = sp & (page_size - 1);
+
+            if ((sp >> page_shift) == this->_stack_page && offset <= page_size - sizeof(uint64_t)) {
+                this->_pages[this->_stack_frame] |= page_flag::page_written;
+                memcpy(this->_stack_window + offset, &value, sizeof(value));
+                this->_r[cpu_reg::sp].q = sp;
+                return;
+            }
+
+            this->push_slow(sp, value);
+        }
 
         /**
          * @brief Pops a value off of the stack
          * @return The value popped off of the stack
          */
-        uint64_t pop(void);
+        inline uint64_t pop(void) {
+            auto sp = this->_r[cpu_reg::sp].q;
+            auto offset = sp & (page_size - 1);
+
+            if ((sp >> page_shift) == this->_stack_page && offset <= page_size - sizeof(uint64_t)) {
+                uint64_t value;
+                memcpy(&value, this->_stack_window + offset, sizeof(value));
+                this->_r[cpu_reg::sp].q = sp + sizeof(uint64_t);
+                return value;
+            }
+
+            return this->pop_slow(sp);
+        }
 
         /**
-         * @brief Interrupts the cpu to execute a request
+         * @brief Pushes a value outside of the stack window, then moves the window to it
+         * @param address The new stack pointer
+         * @param value The value to push
          */
-        void irq(const uint8_t vector);
+        void push_slow(uint64_t address, uint64_t value);
 
         /**
-         * @brief Non-maskable interrupt
+         * @brief Pops a value outside of the stack window, then moves the window to it
+         * @param address The stack pointer before the pop
+         * @return The value popped
          */
-        void nmi(const uint8_t vector);
+        uint64_t pop_slow(uint64_t address);
+
+        /**
+         * @brief Points the stack window at the page holding an address, if it is in _memory
+         * @details While paging is on, only a page the TLB already allows writes to is windowed.
+         * @param address The stack pointer
+         */
+        void open_stack_window(uint64_t address);
+
+        /**
+         * @brief Drops the stack window, so that the next push or pop goes through read/write
+         */
+        inline void close_stack_window(void) {
+            this->_stack_page = UINT64_MAX;
+            this->_stack_window = nullptr;
+        }
 
     public:
         inline reg &r0(void) { return this->_r[cpu_reg::r0]; }
@@ -295,17 +1163,671 @@ namespace mercury {
 
         inline reg &flags(void) { return this->_r[cpu_reg::flags]; }
 
+        inline reg &f0(void) { return this->_f[fpu_reg::f0]; }
+        inline reg &f1(void) { return this->_f[fpu_reg::f1]; }
+        inline reg &f2(void) { return this->_f[fpu_reg::f2]; }
+        inline reg &f3(void) { return this->_f[fpu_reg::f3]; }
+        inline reg &f4(void) { return this->_f[fpu_reg::f4]; }
+        inline reg &f5(void) { return this->_f[fpu_reg::f5]; }
+        inline reg &f6(void) { return this->_f[fpu_reg::f6]; }
+        inline reg &f7(void) { return this->_f[fpu_reg::f7]; }
+
     private:
         opcode_func get_opcode_func(const uint32_t opcode);
 
+        /**
+         * @brief Thrown by fault() to abandon an instruction once its exception is delivered
+         * @details Only the run loops catch it; it never reaches the host.
+         */
+        struct unwind {};
+
+        /**
+         * @brief Raises an exception at the instruction being executed
+         * @details The guest's handler is entered in supervisor mode, with the
+         * address of the instruction, the flags and the code pushed, in that
+         * order, on the supervisor stack. The
+         * instruction does not retire. Without a handler, the exception goes
+         * to the host as before: an invalid opcode halts with the illegal flag,
+         * a protection fault throws addressing_exception and anything else
+         * throws fault_exception, each with pc at the instruction.
+         * @param vector The exception vector
+         * @param code A code for the handler, such as the faulting address
+         */
+        void raise(cpu_vector vector, uint64_t code);
+
+        /**
+         * @brief Delivers an interrupt through the vector table
+         * @details Pushes `pc` and the flags on the supervisor stack and
+         * enters the handler with the interrupt flag set.
+         * @param vector The vector to interrupt with
+         * @return false if the vector has no handler, leaving the cpu as it was
+         */
+        bool interrupt(uint8_t vector);
+
+        /**
+         * @brief Raises a protection fault for an invalid addressing mode, abandoning the instruction
+         * @param value The operand that used the mode
+         */
+        [[noreturn]] void fault(uint64_t value);
+
+        /**
+         * @brief Raises a protection fault if a privileged instruction runs in user mode
+         * @details The code is the instruction word.
+         */
+        inline void privileged(void) {
+            if (this->user_mode()) {
+                this->fault(this->_insn->word);
+            }
+        }
+
+        /**
+         * @brief Enters supervisor or user mode
+         * @details Each mode has its own sp, so the other one is swapped in,
+         * and its own TLB, so that user mode only hits translations that were
+         * checked for it. Decoded entries are not linked across modes, so the
+         * next one is looked up, which checks that user mode may run it.
+         * @param user Whether to enter user mode
+         */
+        void switch_mode(bool user);
+
+        /**
+         * @brief Points _tlb at the current mode's entries, or at nothing while paging is off
+         */
+        void select_tlb(void);
+
+        /**
+         * @brief Loads the flags register from the guest
+         * @details Only switch_mode changes the user bit, and user mode cannot
+         * change the interrupt flag either.
+         * @param value The flags to load
+         */
+        inline void load_flags(uint64_t value) {
+            uint64_t kept = cpu_flag::user | (this->user_mode() ? cpu_flag::interrupt : 0);
+
+            this->_r[cpu_reg::flags].q = (value & ~kept) | (this->_r[cpu_reg::flags].q & kept);
+            this->check_unmask();
+        }
+
+        /**
+         * @brief Schedules the on_unmask callback if irq() was refused and the interrupt flag is now clear
+         */
+        inline void check_unmask(void) {
+            if (this->_irq_refused && !(this->_r[cpu_reg::flags].q & cpu_flag::interrupt)) {
+                this->_irq_refused = false;
+
+                if (this->_unmask) {
+                    this->schedule(1, this->_unmask);
+                }
+            }
+        }
+
+        /**
+         * @brief Retrieves the address of the instruction being executed
+         */
+        uint64_t fault_pc(void);
+
+        /**
+         * @brief Raises a page fault for an access the page tables do not allow, abandoning the instruction
+         * @details A page fault while an exception is being delivered is a
+         * double fault, and one outside the run loops, such as while an
+         * interrupt is delivered, cannot be retried; both go to the host.
+         * @param address The virtual address of the access
+         */
+        [[noreturn]] void page_fault(uint64_t address);
+
+        /**
+         * @brief Translates a virtual address, walking the page tables on a TLB miss
+         * @details Page faults if the access is not allowed.
+         * @param address The virtual address
+         * @param access The kind of access
+         * @return The physical address
+         */
+        uint64_t translate(uint64_t address, page_access access);
+
+        /**
+         * @brief Walks the page tables for an address and fills its TLB entry
+         * @param address The virtual address
+         * @param access The kind of access
+         * @return The physical address, or UINT64_MAX if the access is not allowed
+         */
+        uint64_t walk(uint64_t address, page_access access);
+
+        /**
+         * @brief Drops the cached translation of one virtual page, as invlpg does
+         * @param address An address in the page
+         */
+        void invalidate_page(uint64_t address);
+
+        /**
+         * @brief Page faults now if a range cannot be accessed
+         * @details Lets an instruction that makes several accesses fault before
+         * the first one, rather than halfway through.
+         * @param address The virtual address of the range
+         * @param size The size of the range in bytes, at most a page
+         * @param access The kind of access
+         */
+        inline void probe(uint64_t address, uint64_t size, page_access access) {
+            if (this->_tlb != nullptr) {
+                this->translate(address, access);
+                this->translate(address + size - 1, access);
+            }
+        }
+
+        /**
+         * @brief Charges a fault on an instruction fetch to the run loop that caught it
+         * @details Nothing retires, as for an instruction that raised, but the
+         * fault still takes a step of the limit. Otherwise a handler on an
+         * unmapped page would fault forever without the loop returning.
+         * @return The steps to add to the instructions the loop ran
+         */
+        inline uint64_t charge_fetch_fault(void) {
+            if (!this->_fetch_faulted) {
+                return 0;
+            }
+
+            this->_fetch_faulted = false;
+            this->_unretired++;
+
+            return 1;
+        }
+
+        /**
+         * @brief Adds the instructions a run loop retired to the counts
+         * @details Instructions that raised an exception are taken off again.
+         * @param retired The number of instructions the loop ran
+         * @return The number of instructions retired
+         */
+        inline uint64_t retire(uint64_t retired) {
+            retired -= this->_unretired;
+            this->_unretired = 0;
+
+            this->_instret += retired;
+            cpu_counters::bump(this->_counters.retired, retired);
+
+            return retired;
+        }
+
+        /**
+         * @brief Adds the host time since a run started to the counts
+         * @param start When the run started
+         */
+        void account_run(std::chrono::steady_clock::time_point start);
+
+        /**
+         * @brief Decodes a single instruction from the bus
+         * @param address The address of the instruction
+         * @param insn The instruction to decode into
+         */
+        void decode_one(uint64_t address, instruction &insn);
+
+        /**
+         * @brief Finds the first operand that names a register past a limit
+         * @details Only the modes that index the register file count.
+         * @param insn The instruction
+         * @param last The highest register an operand may name
+         * @return The index of the operand, or -1 if there is none
+         */
+        static int register_past(const instruction &insn, uint64_t last);
+
+        /**
+         * @brief Retrieves the decoded entry for an address, decoding it on a miss
+         * @details A store that made the cache stale is caught up with here, as
+         * no entry is in use between instructions.
+         * @param address The address of the instruction
+         * @return The decoded entry
+         */
+        decoded &decode(uint64_t address);
+
+        /**
+         * @brief Marks a frame as holding decoded instructions
+         * @details Later stores to the frame must reach write_physical(), so it
+         * loses its TLB write tags and the stack window.
+         * @param frame The physical page number
+         */
+        void mark_code(uint64_t frame);
+
+        /**
+         * @brief Decodes the entry for an address, without looking in the cache
+         * @details A breakpoint address becomes a trap entry, and an instruction
+         * is never fused with one that has a breakpoint. An instruction naming
+         * a register past flags raises #GP when it runs, so that no handler
+         * has to check its register operands.
+         * @param address The address of the instruction
+         * @param d The entry to decode into
+         */
+        void decode_entry(uint64_t address, decoded &d);
+
+        /**
+         * @brief Decodes the cached entry for an address again, in place
+         * @details Links to the entry stay valid; its own links are dropped.
+         * @param address The address of the instruction
+         */
+        void redecode(uint64_t address);
+
+        /**
+         * @brief Finds the entry to run after another one, linking it if needed
+         * @param d The entry that has just run
+         * @return The entry at the program counter
+         */
+        inline decoded *follow(decoded *d) {
+            auto pc = this->_r[cpu_reg::pc].q;
+
+            if (this->_relink) {
+                this->_relink = false;
+                return &this->decode(pc);
+            }
+
+            if (pc == d->address + d->length) {
+                if (d->next != nullptr) {
+                    return d->next;
+                }
+
+                auto next = &this->decode(pc);
+
+                return next->supervisor == d->supervisor ? (d->next = next) : next;
+            }
+
+            return this->branch(d, pc);
+        }
+
+        /**
+         * @brief Finds the entry at a taken branch target
+         * @details Tries the shadow return-address stack hint, then the entry's
+         * branch-target link, then the cache.
+         * @param d The entry that branched
+         * @param pc The branch target
+         * @return The entry at the target
+         */
+        decoded *branch(decoded *d, uint64_t pc);
+
+        /**
+         * @brief Retrieves the entry holding the instruction being executed
+         * @return The current entry
+         */
+        inline decoded *current(void) {
+            return (decoded *)((const uint8_t *)this->_insn - offsetof(decoded, insn));
+        }
+
+        /**
+         * @brief Fires every event whose deadline has been reached
+         */
+        void fire_events(void);
+
+        /**
+         * @brief Retrieves the number of instructions until the next event
+         * @return The number of instructions, or UINT64_MAX if nothing is scheduled
+         */
+        uint64_t next_event(void) const;
+
+        /**
+         * @brief Selects the threaded run loop label for a decoded entry
+         * @param d The decoded entry
+         * @return The label to dispatch to
+         */
+        static threaded_op get_threaded_op(const decoded &d);
+
+        /**
+         * @brief Jumps to an address
+         * @param address The address to jump to
+         */
+        inline void jump(uint64_t address) {
+            this->_r[cpu_reg::pc].q = address;
+        }
+
+        /**
+         * @brief Executes a decoded entry
+         * @details A fused entry is split when only one instruction is left in
+         * the budget, so that limits are always exact.
+         * @param d The decoded entry
+         * @param retired The running count of retired instructions
+         * @param limit The maximum value of retired
+         */
+        inline void execute(const decoded &d, uint64_t &retired, uint64_t limit) {
+            this->_insn = d.insn;
+
+            if (d.count > limit - retired) {
+                this->pc().q += d.insn[0].length;
+                retired += 1;
+                d.first(this);
+            } else {
+                this->pc().q += d.length;
+                retired += d.count;
+                d.func(this);
+            }
+        }
+
+        /**
+         * @brief Reads a value from a device through the journal, if there is one
+         */
+        uint64_t journal_read(uint64_t address, uint8_t width);
+
+        /**
+         * @brief Checks whether a physical access can go straight to _memory
+         * @param address The physical address of the access
+         * @param avoid The page flags that send the access down the slow path
+         * @return true if the whole access is inside _memory and on no page with those flags
+         */
+        template<typename T>
+        inline bool is_memory(uint64_t address, uint8_t avoid = page_flag::page_watch) const {
+            auto first = address >> page_shift;
+            auto last = (address + sizeof(T) - 1) >> page_shift;
+
+            return first < this->_page_count && last < this->_page_count &&
+                   !((this->_pages[first] | this->_pages[last]) & avoid);
+        }
+
+        /**
+         * @brief Checks whether an access can go straight to _memory, without translation
+         * @details Writes also avoid pages holding decoded instructions, so that
+         * write_physical() sees every store that makes them stale.
+         * @param address The address of the access
+         * @param avoid The page flags that send the access down the slow path
+         * @return true if paging is off and the whole access is inside _memory
+         */
+        template<typename T>
+        inline bool is_direct(uint64_t address, uint8_t avoid = page_flag::page_watch) const {
+            return this->_tlb == nullptr && this->is_memory<T>(address, avoid);
+        }
+
+        /**
+         * @brief Finds the TLB entry for an access that stays on one page, if it has a host page
+         * @param address The virtual address of the access
+         * @param tag The member of tlb_entry to match for the kind of access
+         * @return The entry, or nullptr to take the slow path
+         */
+        template<typename T>
+        inline tlb_entry *tlb_hit(uint64_t address, uint64_t tlb_entry::*tag) {
+            auto &e = this->_tlb[(address >> page_shift) & (tlb_size - 1)];
+            auto offset = address & (page_size - 1);
+
+            if (e.*tag != address - offset || e.host == nullptr || offset > page_size - sizeof(T)) {
+                return nullptr;
+            }
+
+            cpu_counters::bump(this->_counters.tlb_hits);
+
+            return &e;
+        }
+
+        /**
+         * @brief Reads instruction bytes, which watchpoints do not apply to
+         * @param address The address to read from
+         * @return The value read
+         */
+        template<typename T>
+        inline T fetch(uint64_t address) {
+            auto limit = (uint64_t)this->_page_count << page_shift;
+
+            if (this->_tlb != nullptr) {
+                return (T)this->read_mapped(address, sizeof(T), page_access::access_fetch);
+            }
+
+            if (address < limit && sizeof(T) <= limit - address) {
+                T value;
+                memcpy(&value, this->_memory + address, sizeof(T));
+                return value;
+            }
+
+            return this->read_bus<T>(address);
+        }
+
+        /**
+         * @brief Checks a slow path access against the watchpoints
+         * @param address The address of the access
+         * @param size The size of the access in bytes
+         * @param write Whether the access is a write
+         */
+        void check_watchpoints(uint64_t address, uint64_t size, bool write);
+
+        /**
+         * @brief Sets or clears page_watch on the pages a range touches
+         */
+        void mark_watched(uint64_t address, uint64_t size, bool watched);
+
+        /**
+         * @brief Reads through the page tables, after a TLB miss or for a device or an access across pages
+         * @param address The virtual address to read from
+         * @param size The size of the read in bytes
+         * @param access Whether this is a read or an instruction fetch
+         * @return The value read
+         */
+        uint64_t read_mapped(uint64_t address, uint8_t size, page_access access);
+
+        /**
+         * @brief Writes through the page tables, after a TLB miss or for a device or an access across pages
+         * @param address The virtual address to write to
+         * @param size The size of the write in bytes
+         * @param value The value to write
+         */
+        void write_mapped(uint64_t address, uint8_t size, uint64_t value);
+
+        /**
+         * @brief Reads from a physical address, bypassing the bus when it is in _memory
+         * @param address The physical address to read from
+         * @param size The size of the read in bytes
+         * @param access Instruction fetches ignore watchpoints
+         * @return The value read
+         */
+        uint64_t read_physical(uint64_t address, uint8_t size, page_access access);
+
+        /**
+         * @brief Writes to a physical address, bypassing the bus when it is in _memory
+         * @details A write to a page holding decoded instructions has the cache
+         * flushed before the next instruction is decoded.
+         * @param address The physical address to write to
+         * @param size The size of the write in bytes
+         * @param value The value to write
+         */
+        void write_physical(uint64_t address, uint8_t size, uint64_t value);
+
+        /**
+         * @brief Reads from memory, bypassing the bus when the address is in _memory
+         * @details While paging is on, a TLB hit on a page of _memory is almost
+         * as cheap as a direct access; anything else goes through read_mapped().
+         * @param address The address to read from
+         * @return The value read
+         */
+        template<typename T>
+        inline T read(uint64_t address) {
+            if (this->is_direct<T>(address)) {
+                T value;
+                memcpy(&value, this->_memory + address, sizeof(T));
+                return value;
+            }
+
+            if (this->_tlb != nullptr) {
+                if (auto e = this->tlb_hit<T>(address, &tlb_entry::read)) {
+                    T value;
+                    memcpy(&value, e->host + (address & (page_size - 1)), sizeof(T));
+                    return value;
+                }
+
+                return (T)this->read_mapped(address, sizeof(T), page_access::access_read);
+            }
+
+            return this->read_bus<T>(address);
+        }
+
+        /**
+         * @brief Reads a physical address from the bus
+         * @param address The address to read from
+         * @return The value read
+         */
+        template<typename T>
+        inline T read_bus(uint64_t address) {
+            cpu_counters::bump(this->_counters.reads[cpu_counters::width<T>()]);
+
+            if (!this->_watchpoints.empty()) this->check_watchpoints(address, sizeof(T), false);
+
+            if (this->_journal) return (T)this->journal_read(address, sizeof(T));
+
+            if constexpr (sizeof(T) == 1) return this->_bus->read8(address);
+            else if constexpr (sizeof(T) == 2) return this->_bus->read16(address);
+            else if constexpr (sizeof(T) == 4) return this->_bus->read32(address);
+            else return this->_bus->read64(address);
+        }
+
+        /**
+         * @brief Writes to memory, bypassing the bus when the address is in _memory
+         * @param address The address to write to
+         * @param value The value to write
+         */
+        template<typename T>
+        inline void write(uint64_t address, T value) {
+            if (this->is_direct<T>(address, page_flag::page_watch | page_flag::page_code)) {
+                this->_pages[address >> page_shift] |= page_flag::page_written;
+                this->_pages[(address + sizeof(T) - 1) >> page_shift] |= page_flag::page_written;
+                memcpy(this->_memory + address, &value, sizeof(T));
+                return;
+            }
+
+            if (this->_tlb != nullptr) {
+                if (auto e = this->tlb_hit<T>(address, &tlb_entry::write)) {
+                    this->_pages[e->frame] |= page_flag::page_written;
+                    memcpy(e->host + (address & (page_size - 1)), &value, sizeof(T));
+                    return;
+                }
+
+                this->write_mapped(address, sizeof(T), value);
+                return;
+            }
+
+            this->write_physical(address, sizeof(T), value);
+        }
+
+        /**
+         * @brief Writes a physical address to the bus
+         * @param address The address to write to
+         * @param value The value to write
+         */
+        template<typename T>
+        inline void write_bus(uint64_t address, T value) {
+            cpu_counters::bump(this->_counters.writes[cpu_counters::width<T>()]);
+
+            if (!this->_watchpoints.empty()) this->check_watchpoints(address, sizeof(T), true);
+
+            if constexpr (sizeof(T) == 1) this->_bus->write8(address, value);
+            else if constexpr (sizeof(T) == 2) this->_bus->write16(address, value);
+            else if constexpr (sizeof(T) == 4) this->_bus->write32(address, value);
+            else this->_bus->write64(address, value);
+        }
+
+        /**
+         * @brief Loads a vector register from memory
+         * @param address The address to load from
+         * @param v The register to load into
+         */
+        inline void load_vector(uint64_t address, vreg &v) {
+            if (this->is_direct<vreg>(address)) {
+                memcpy(&v, this->_memory + address, sizeof(v));
+                return;
+            }
+
+            this->probe(address, sizeof(v), page_access::access_read);
+
+            for (auto i = 0; i < 4; i++) {
+                v.q[i] = this->read64(address + i * sizeof(uint64_t));
+            }
+        }
+
+        /**
+         * @brief Stores a vector register to memory
+         * @param address The address to store to
+         * @param v The register to store
+         */
+        inline void store_vector(uint64_t address, const vreg &v) {
+            if (this->is_direct<vreg>(address, page_flag::page_watch | page_flag::page_code)) {
+                this->_pages[address >> page_shift] |= page_flag::page_written;
+                this->_pages[(address + sizeof(v) - 1) >> page_shift] |= page_flag::page_written;
+                memcpy(this->_memory + address, &v, sizeof(v));
+                return;
+            }
+
+            // a store across pages faults before either half is written
+            this->probe(address, sizeof(v), page_access::access_write);
+
+            for (auto i = 0; i < 4; i++) {
+                this->write64(address + i * sizeof(uint64_t), v.q[i]);
+            }
+        }
+
+        inline uint8_t read8(uint64_t address) { return this->read<uint8_t>(address); }
+        inline uint16_t read16(uint64_t address) { return this->read<uint16_t>(address); }
+        inline uint32_t read32(uint64_t address) { return this->read<uint32_t>(address); }
+        inline uint64_t read64(uint64_t address) { return this->read<uint64_t>(address); }
+
+        inline void write8(uint64_t address, uint8_t value) { this->write<uint8_t>(address, value); }
+        inline void write16(uint64_t address, uint16_t value) { this->write<uint16_t>(address, value); }
+        inline void write32(uint64_t address, uint32_t value) { this->write<uint32_t>(address, value); }
+        inline void write64(uint64_t address, uint64_t value) { this->write<uint64_t>(address, value); }
+
     public:
-        std::array<reg, 11> _r;             /* general purpose registers */
+        bus_ptr _attached;                  /* owns the attached bus */
+        bus *_bus = nullptr;                /* the system bus, off cpu_context since only slow paths reach it */
 
-        bus_ptr _bus;                       /* the system bus */
+        uint64_t _instret = 0;              /* instructions retired, updated when a run loop returns */
 
-        cpu_state _state;                   /* the state of the cpu */
+        cpu_counters _counters;             /* counters other threads can take snapshots of */
+
+        uint64_t _vector_table = no_vector_table;   /* the guest address of the exception handlers */
+        uint64_t _unretired = 0;            /* instructions that raised, since the run loop started */
+        bool _fetching = false;             /* decoding, so a page fault is on the instruction fetch */
+        bool _fetch_faulted = false;        /* the last exception raised was on a fetch */
+        bool _delivering = false;           /* pushing an exception frame, so a page fault is a double fault */
+
+        uint64_t _page_table = 0;           /* the physical address of the top-level page table, or 0 */
+        std::array<tlb_entry, 2 * tlb_size> _tlb_entries;  /* supervisor then user entries; _tlb points at one half while paging */
+        std::unordered_set<uint64_t> _code_pages;   /* virtual pages decoded from while paging, for invlpg */
+
+        uint64_t _syscall_entry = 0;        /* msr_syscall_entry */
+        uint64_t _syscall_mask = 0;         /* msr_syscall_mask */
+        uint64_t _syscall_pc = 0;           /* msr_syscall_pc */
+        uint64_t _syscall_flags = 0;        /* msr_syscall_flags */
+        uint64_t _banked_sp = 0;            /* msr_banked_stack */
+
+        bool _irq_refused = false;          /* irq() was refused since the interrupt flag was last cleared */
+        event_func _unmask;                 /* called once the interrupt flag is cleared after a refusal */
+
+        journal_ptr _journal;               /* records or replays nondeterministic input */
+        coverage_ptr _coverage;             /* counts edges from instrumented branches */
+
+        std::unordered_map<uint64_t, decoded> _decoded;    /* decoded instructions by address */
+
+        bool _relink = false;               /* the cache was flushed under a run loop */
+        bool _stale = false;                /* a store hit decoded code; flushed by the next decode() */
+
+        static constexpr size_t return_stack_size = 32;
+
+        std::array<return_entry, return_stack_size> _returns;  /* shadow return-address stack */
+        size_t _return_top = 0;             /* number of pushes, wrapping around the stack */
+        decoded *_return_hint = nullptr;    /* the call entry ret returned to, for the next branch() */
+
+        std::vector<scheduled_event> _events;   /* events waiting for their deadline */
+        uint64_t _event_id = 0;             /* the id of the last scheduled event */
+
+        std::vector<hypercall_func> _hypercalls;    /* host functions by hypercall number */
+
+        std::unordered_set<uint64_t> _breakpoints;  /* only consulted when decoding */
+
+        std::vector<watchpoint> _watchpoints;   /* only consulted on the slow path */
+        watch_hit _watch_hit = {};          /* the access that last trapped the cpu */
+        bool _watch_pending = false;        /* a watchpoint was hit between instructions */
+
+        static constexpr size_t fpu_count = 8;
+
+        std::array<reg, fpu_count> _f = {}; /* floating point registers, used through .f */
+
+        static constexpr size_t vector_count = 8;
+
+        std::array<vreg, vector_count> _v = {};  /* vector registers */
+        const simd_kernels *_simd = &simd_kernels::detect();    /* host kernels for _v */
+
+        uint64_t _stack_page = UINT64_MAX;  /* the page number of the stack window */
+        uint64_t _stack_frame = 0;          /* the physical page number behind it */
+        uint8_t *_stack_window = nullptr;   /* host address of that page in _memory */
 
         static std::map<uint32_t , opcode_func> _opcode_table;   /* the table of opcode implementations */
+        static std::map<uint64_t , opcode_func> _fusion_table;   /* fused handlers for adjacent pairs */
     };
 }
 
@@ -0,0 +1,53 @@
+/**
+ * @file device.h
+ * @brief Interface for memory-mapped devices
+*/
+
+#ifndef __mercury_vm_device_h__
+
+#define __mercury_vm_device_h__
+
+#include <cstdint>
+
+#include <memory>
+
+namespace mercury {
+
+    /**
+     * @brief Interface for a device whose registers are mapped onto a bus
+     * @details Offsets are relative to the address the device is mapped at. A
+     * device is only reached through the bus, never through the cpu's direct
+     * memory path, so every access has its side effects.
+     */
+    class device {
+    public:
+        virtual ~device(void) = default;
+
+        /**
+         * @brief Retrieves the size of the register window
+         * @return The number of bytes of address space the device occupies
+         */
+        virtual uint64_t size(void) const = 0;
+
+        /**
+         * @brief Reads a device register
+         * @param offset The offset into the register window
+         * @param width The width of the access in bytes
+         * @return The value read
+         */
+        virtual uint64_t read(uint64_t offset, uint8_t width) = 0;
+
+        /**
+         * @brief Writes a device register
+         * @param offset The offset into the register window
+         * @param width The width of the access in bytes
+         * @param value The value to write
+         */
+        virtual void write(uint64_t offset, uint8_t width, uint64_t value) = 0;
+    };
+
+    typedef std::shared_ptr<device> device_ptr;
+
+}
+
+#endif /* __mercury_vm_device_h__ */
@@ -0,0 +1,177 @@
+#include "./flat_bus.h"
+
+#include <iterator>
+#include <new>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /**
+     * @brief Creates the bus
+     * @param size The size of the memory in bytes, rounded up to a whole page
+     */
+    flat_bus::flat_bus(uint64_t size)
+        : _memory(nullptr),
+          _size((size + page_size - 1) & ~(page_size - 1)),
+          _pages(_size >> page_shift, 0) {
+        if (size == 0) {
+            throw std::invalid_argument("flat_bus memory must not be empty");
+        }
+
+        auto memory = ::mmap(nullptr, this->_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        this->_memory = (uint8_t *)memory;
+    }
+
+    flat_bus::~flat_bus(void) {
+        ::munmap(this->_memory, this->_size);
+    }
+
+    /**
+     * @brief Copies a block of host data into memory
+     * @param address The address to copy to
+     * @param data The data to copy
+     * @param size The number of bytes to copy
+     */
+    void flat_bus::load(uint64_t address, const void *data, uint64_t size) {
+        if (address > this->_size || size > this->_size - address) {
+            throw std::out_of_range("flat_bus load is outside of memory");
+        }
+
+        memcpy(&this->_memory[address], data, size);
+        this->touch(address, size);
+    }
+
+    /**
+     * @brief Maps a host file over a range of memory, without copying
+     * @param address The first guest address to replace
+     * @param fd The host file, such as a memfd or a regular file
+     * @param offset The offset into the file, aligned to the host page size
+     * @param size The number of bytes to map
+     */
+    void flat_bus::share(uint64_t address, int fd, uint64_t offset, uint64_t size) {
+        this->check_mapping(address, size);
+
+        if (::mmap(this->_memory + address, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, (off_t)offset) == MAP_FAILED) {
+            throw std::runtime_error("flat_bus failed to map the shared memory");
+        }
+
+        this->touch(address, size);
+    }
+
+    /**
+     * @brief Puts private, zeroed memory back over a shared range
+     * @param address The first guest address of the range
+     * @param size The number of bytes
+     */
+    void flat_bus::unshare(uint64_t address, uint64_t size) {
+        this->check_mapping(address, size);
+
+        if (::mmap(this->_memory + address, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            throw std::runtime_error("flat_bus failed to unmap the shared memory");
+        }
+
+        this->touch(address, size);
+    }
+
+    /**
+     * @brief Marks every page as clean
+     */
+    void flat_bus::clean(void) {
+        for (auto &flags : this->_pages) {
+            flags &= ~page_flag::page_dirty;
+        }
+    }
+
+    /**
+     * @brief Maps a device's registers onto the bus
+     * @param base The address of the first register; it must be above the memory
+     * @param device The device
+     */
+    void flat_bus::map(uint64_t base, const device_ptr &device) {
+        auto size = device->size();
+
+        if (base < this->_size || size == 0 || base + size < base) {
+            throw std::invalid_argument("flat_bus device must be mapped above memory");
+        }
+
+        auto next = this->_devices.lower_bound(base);
+
+        if ((next != this->_devices.end() && next->first < base + size) ||
+            (next != this->_devices.begin() && std::prev(next)->first + std::prev(next)->second->size() > base)) {
+            throw std::invalid_argument("flat_bus device overlaps another device");
+        }
+
+        this->_devices.emplace(base, device);
+    }
+
+    /**
+     * @brief Finds the device mapped at an address
+     * @param address The address of the access
+     * @param width The width of the access in bytes
+     * @return The device and its base address, or a null device
+     */
+    std::pair<uint64_t, device *> flat_bus::find_device(uint64_t address, uint8_t width) const {
+        auto it = this->_devices.upper_bound(address);
+
+        if (it == this->_devices.begin()) {
+            return { 0, nullptr };
+        }
+
+        --it;
+
+        if (address - it->first > it->second->size() - width) {
+            return { 0, nullptr };
+        }
+
+        return { it->first, it->second.get() };
+    }
+
+    uint64_t flat_bus::read_device(uint64_t address, uint8_t width) {
+        auto [base, dev] = this->find_device(address, width);
+
+        return dev ? dev->read(address - base, width) : 0;
+    }
+
+    void flat_bus::write_device(uint64_t address, uint8_t width, uint64_t value) {
+        auto [base, dev] = this->find_device(address, width);
+
+        if (dev) {
+            dev->write(address - base, width, value);
+        }
+    }
+
+    /**
+     * @brief Checks that a range of memory can be remapped
+     */
+    void flat_bus::check_mapping(uint64_t address, uint64_t size) const {
+        auto host_page = (uint64_t)::sysconf(_SC_PAGESIZE);
+
+        if (size == 0 || address > this->_size || size > this->_size - address) {
+            throw std::out_of_range("flat_bus mapping is outside of memory");
+        }
+
+        if (address % host_page != 0 || size % host_page != 0) {
+            throw std::invalid_argument("flat_bus mapping is not aligned to host pages");
+        }
+    }
+
+    /**
+     * @brief Marks a range of pages as written
+     */
+    void flat_bus::touch(uint64_t address, uint64_t size) {
+        for (auto page = address >> page_shift; size && page <= (address + size - 1) >> page_shift; page++) {
+            this->_pages[page] |= page_flag::page_written;
+        }
+    }
+
+}
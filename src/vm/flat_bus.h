@@ -0,0 +1,179 @@
+/**
+ * @file flat_bus.h
+ * @brief A bus backed by a flat block of host memory
+*/
+
+#ifndef __mercury_vm_flat_bus_h__
+
+#define __mercury_vm_flat_bus_h__
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "bus.h"
+#include "device.h"
+
+namespace mercury {
+
+    /**
+     * @brief A bus backed by a flat block of host memory
+     * @details Devices can be mapped at addresses above the memory. Reads that
+     * hit neither the memory nor a device return zero, and such writes are
+     * dropped. Every write to memory marks its page dirty.
+     *
+     * The memory is mapped from the host a page at a time, so ranges of it can
+     * be replaced with host files or shared memory with share().
+     */
+    class flat_bus : public bus {
+    public:
+        /**
+         * @brief Creates the bus
+         * @param size The size of the memory in bytes, rounded up to a whole page
+         */
+        explicit flat_bus(uint64_t size);
+        ~flat_bus(void) override;
+
+        flat_bus(const flat_bus &) = delete;
+        flat_bus &operator=(const flat_bus &) = delete;
+
+        void write8(uint64_t address, uint8_t value) override { this->write(address, value); }
+        void write16(uint64_t address, uint16_t value) override { this->write(address, value); }
+        void write32(uint64_t address, uint32_t value) override { this->write(address, value); }
+        void write64(uint64_t address, uint64_t value) override { this->write(address, value); }
+
+        uint8_t read8(uint64_t address) override { return this->read<uint8_t>(address); }
+        uint16_t read16(uint64_t address) override { return this->read<uint16_t>(address); }
+        uint32_t read32(uint64_t address) override { return this->read<uint32_t>(address); }
+        uint64_t read64(uint64_t address) override { return this->read<uint64_t>(address); }
+
+        /**
+         * @brief Copies a block of host data into memory
+         * @param address The address to copy to
+         * @param data The data to copy
+         * @param size The number of bytes to copy
+         */
+        void load(uint64_t address, const void *data, uint64_t size);
+
+        /**
+         * @brief Maps a host file over a range of memory, without copying
+         * @details The guest and the host, or any other process that maps the
+         * same file, then see each other's writes directly. The range must be
+         * aligned to the host page size. Its pages are marked written; a cpu
+         * that has run code from the range must flush its decoded instructions.
+         * @param address The first guest address to replace
+         * @param fd The host file, such as a memfd or a regular file
+         * @param offset The offset into the file, aligned to the host page size
+         * @param size The number of bytes to map
+         */
+        void share(uint64_t address, int fd, uint64_t offset, uint64_t size);
+
+        /**
+         * @brief Puts private, zeroed memory back over a shared range
+         * @param address The first guest address of the range
+         * @param size The number of bytes
+         */
+        void unshare(uint64_t address, uint64_t size);
+
+        /**
+         * @brief Retrieves the host memory backing the bus
+         * @return The first byte of memory
+         */
+        uint8_t *memory(void) override { return this->_memory; }
+
+        /**
+         * @brief Retrieves the size of the memory
+         * @return The size of the memory in bytes
+         */
+        uint64_t size(void) const override { return this->_size; }
+
+        /**
+         * @brief Retrieves the page flags
+         * @return One page_flag byte for each page of memory
+         */
+        uint8_t *pages(void) override { return this->_pages.data(); }
+
+        /**
+         * @brief Retrieves the number of pages of memory
+         * @return The number of pages
+         */
+        uint64_t page_count(void) const { return this->_pages.size(); }
+
+        /**
+         * @brief Checks whether a page has been written since it was last cleaned
+         * @param page The page index
+         * @return true if the page is dirty
+         */
+        bool is_dirty(uint64_t page) const { return this->_pages[page] & page_flag::page_dirty; }
+
+        /**
+         * @brief Marks every page as clean
+         */
+        void clean(void);
+
+        /**
+         * @brief Maps a device's registers onto the bus
+         * @param base The address of the first register; it must be above the memory
+         * @param device The device
+         */
+        void map(uint64_t base, const device_ptr &device);
+
+    private:
+        template<typename T>
+        inline void write(uint64_t address, T value) {
+            if (address <= this->_size - sizeof(T)) {
+                this->_pages[address >> page_shift] |= page_flag::page_written;
+                this->_pages[(address + sizeof(T) - 1) >> page_shift] |= page_flag::page_written;
+                memcpy(&this->_memory[address], &value, sizeof(T));
+            } else {
+                this->write_device(address, sizeof(T), value);
+            }
+        }
+
+        template<typename T>
+        inline T read(uint64_t address) {
+            T value = 0;
+
+            if (address <= this->_size - sizeof(T)) {
+                memcpy(&value, &this->_memory[address], sizeof(T));
+            } else {
+                value = (T)this->read_device(address, sizeof(T));
+            }
+
+            return value;
+        }
+
+        /**
+         * @brief Finds the device mapped at an address
+         * @param address The address of the access
+         * @param width The width of the access in bytes
+         * @return The device and its base address, or a null device
+         */
+        std::pair<uint64_t, device *> find_device(uint64_t address, uint8_t width) const;
+
+        uint64_t read_device(uint64_t address, uint8_t width);
+        void write_device(uint64_t address, uint8_t width, uint64_t value);
+
+        /**
+         * @brief Checks that a range of memory can be remapped
+         */
+        void check_mapping(uint64_t address, uint64_t size) const;
+
+        /**
+         * @brief Marks a range of pages as written
+         */
+        void touch(uint64_t address, uint64_t size);
+
+        uint8_t *_memory;                   /* the backing memory */
+        uint64_t _size;
+        std::vector<uint8_t> _pages;        /* page_flag bytes, one per page */
+
+        std::map<uint64_t, device_ptr> _devices;    /* mapped devices by base address */
+    };
+
+    typedef std::shared_ptr<flat_bus> flat_bus_ptr;
+
+}
+
+#endif /* __mercury_vm_flat_bus_h__ */
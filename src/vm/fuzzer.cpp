@@ -0,0 +1,201 @@
+#include "./fuzzer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mercury {
+
+    /**
+     * @brief Creates a fuzzer for a cpu attached to a bus
+     * @param cpu The cpu; it must outlive the fuzzer
+     * @param bus The memory of the guest; it must outlive the fuzzer
+     * @param input The guest address to copy each input to
+     * @param capacity The largest input in bytes; longer inputs are truncated
+     */
+    fuzzer::fuzzer(cpu &cpu, flat_bus &bus, uint64_t input, uint64_t capacity)
+        : _cpu(cpu), _bus(bus), _input(input), _capacity(capacity) {
+        if (input > bus.size() || capacity > bus.size() - input) {
+            throw fuzz_exception("Fuzz input must lie inside memory");
+        }
+    }
+
+    /**
+     * @brief Runs the guest up to a marker, then takes the snapshot there
+     * @details The marker is reached through a breakpoint, which is cleared
+     * again unless it was already set.
+     * @param marker The address the guest is ready to take input at
+     * @param limit The most instructions to run before giving up
+     */
+    void fuzzer::boot(uint64_t marker, uint64_t limit) {
+        auto had = this->_cpu.has_breakpoint(marker);
+
+        this->_cpu.add_breakpoint(marker);
+
+        try {
+            this->_cpu.run(limit);
+        } catch (const halted_exception &) {
+            // fall through to the check below
+        } catch (const addressing_exception &) {
+            // as above
+        } catch (const fault_exception &) {
+            // as above
+        }
+
+        if (!had) {
+            this->_cpu.remove_breakpoint(marker);
+        }
+
+        if (this->_cpu.state() != cpu_state::trapped || this->_cpu.pc().q != marker) {
+            throw fuzz_exception("Guest did not reach the fuzzing marker");
+        }
+
+        this->snapshot();
+    }
+
+    /**
+     * @brief Takes the snapshot at the cpu's current state
+     * @details The dirty flags are cleared, so that from here on they mark
+     * the pages a run has to have restored.
+     */
+    void fuzzer::snapshot(void) {
+        assert(this->_cpu.state() != cpu_state::running);
+
+        this->_memory.assign(this->_bus.memory(), this->_bus.memory() + this->_bus.size());
+        this->_r = this->_cpu._r;
+        this->_f = this->_cpu._f;
+        this->_v = this->_cpu._v;
+
+        for (uint64_t i = 0; i < msr_count; i++) {
+            this->_msrs[i] = this->_cpu.msr(static_cast<cpu_msr>(i));
+        }
+
+        this->_bus.clean();
+        this->_snapshotted = true;
+    }
+
+    /**
+     * @brief Runs the guest from the snapshot on one input
+     * @details The cpu and memory are left as the run ended, for inspection,
+     * until the next run restores them.
+     * @param data The input
+     * @param size The size of the input in bytes
+     * @return How the run ended
+     */
+    fuzz_outcome fuzzer::run(const uint8_t *data, uint64_t size) {
+        if (!this->_snapshotted) {
+            throw fuzz_exception("Fuzzer has no snapshot to run from");
+        }
+
+        // the registers go first, so that restore() picks the TLB for their mode
+        this->_cpu._r = this->_r;
+        this->_cpu._f = this->_f;
+        this->_cpu._v = this->_v;
+        this->_cpu._state = cpu_state::stopped;
+
+        this->restore();
+
+        size = std::min(size, this->_capacity);
+        this->_bus.load(this->_input, data, size);
+
+        this->_cpu.r0().q = size;
+        this->_cpu.r1().q = this->_input;
+
+        auto start = this->_cpu.instret();
+        auto outcome = fuzz_outcome::fuzz_exit;
+
+        this->_executions++;
+
+        try {
+            this->_cpu.run(this->_budget);
+
+            if (this->_cpu.state() == cpu_state::stopped) {
+                outcome = fuzz_outcome::fuzz_timeout;
+            }
+        } catch (const halted_exception &) {
+            // exceptions the guest does not handle leave pc at the instruction
+            if (this->_cpu.flags().q & cpu_flag::illegal) {
+                outcome = fuzz_outcome::fuzz_illegal;
+                this->crash(outcome, this->_cpu.pc().q, data, size);
+            }
+        } catch (const addressing_exception &) {
+            outcome = fuzz_outcome::fuzz_fault;
+            this->crash(outcome, this->_cpu.pc().q, data, size);
+        } catch (const fault_exception &) {
+            outcome = fuzz_outcome::fuzz_fault;
+            this->crash(outcome, this->_cpu.pc().q, data, size);
+        }
+
+        this->_retired = this->_cpu.instret() - start;
+
+        return outcome;
+    }
+
+    /**
+     * @brief Copies the pages dirtied since the snapshot back from it
+     * @details The flags are scanned eight pages at a time, since most runs
+     * only dirty a few pages of memory. The decoded instructions are only
+     * discarded when a restored page held code, or when the guest moved its
+     * page tables. Restored pages may hold page tables, so a paging guest
+     * always starts with an empty TLB. The other MSRs are simply copied back.
+     */
+    void fuzzer::restore(void) {
+        static constexpr uint64_t dirty8 = 0x0101010101010101ull * page_flag::page_dirty;
+
+        auto pages = this->_bus.pages();
+        auto count = this->_bus.page_count();
+        auto memory = this->_bus.memory();
+        bool code = false;
+
+        for (uint64_t group = 0; group < count; group += 8) {
+            if (group + 8 <= count) {
+                uint64_t flags;
+                memcpy(&flags, pages + group, sizeof(flags));
+
+                if (!(flags & dirty8)) {
+                    continue;
+                }
+            }
+
+            for (auto page = group; page < std::min(group + 8, count); page++) {
+                if (pages[page] & page_flag::page_dirty) {
+                    memcpy(memory + (page << page_shift), this->_memory.data() + (page << page_shift), page_size);
+                    code |= (pages[page] & page_flag::page_code) != 0;
+                    pages[page] &= ~page_flag::page_dirty;
+                }
+            }
+        }
+
+        for (uint64_t i = 0; i < msr_count; i++) {
+            if (i != cpu_msr::msr_page_table) {
+                this->_cpu.set_msr(static_cast<cpu_msr>(i), this->_msrs[i]);
+            }
+        }
+
+        auto page_table = this->_msrs[cpu_msr::msr_page_table];
+
+        if (this->_cpu.page_table() != page_table) {
+            this->_cpu.set_page_table(page_table);
+        } else if (code) {
+            this->_cpu.flush_decode_cache();
+        }
+
+        if (page_table != 0) {
+            this->_cpu.flush_tlb();
+        }
+    }
+
+    /**
+     * @brief Records a crash, keeping the first input for each address
+     */
+    void fuzzer::crash(fuzz_outcome outcome, uint64_t pc, const uint8_t *data, uint64_t size) {
+        auto it = this->_crashes.find(pc);
+
+        if (it != this->_crashes.end()) {
+            it->second.count++;
+            return;
+        }
+
+        this->_crashes.emplace(pc, fuzz_crash{ outcome, pc, 1, std::vector<uint8_t>(data, data + size) });
+    }
+
+}
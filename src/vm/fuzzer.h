@@ -0,0 +1,142 @@
+/**
+ * @file fuzzer.h
+ * @brief Snapshot-based fuzzing of guest programs
+*/
+
+#ifndef __mercury_vm_fuzzer_h__
+
+#define __mercury_vm_fuzzer_h__
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "cpu.h"
+#include "flat_bus.h"
+
+#include "../exc/fuzz_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief How a run of the guest on one input ended
+     */
+    enum fuzz_outcome {
+        fuzz_exit,                  /* the guest halted */
+        fuzz_timeout,               /* the guest used up its instruction budget */
+        fuzz_illegal,               /* the guest ran an illegal instruction */
+        fuzz_fault,                 /* the guest raised another exception it does not handle */
+    };
+
+    /**
+     * @brief A distinct crash, the first input that caused it and how often it recurred
+     */
+    struct fuzz_crash {
+        fuzz_outcome outcome;
+        uint64_t pc;                /* the address of the crashing instruction */
+        uint64_t count;             /* the number of inputs that crashed here */
+        std::vector<uint8_t> input; /* the first input that crashed here */
+    };
+
+    /**
+     * @brief Runs a guest over many inputs from a snapshot, in process
+     * @details The guest is booted once, up to a marker address, and the cpu
+     * and memory are snapshotted there. Each input is then copied into guest
+     * memory, with its size in r0 and its address in r1, and run from the
+     * snapshot with an instruction budget. Afterwards only the pages the run
+     * dirtied are copied back from the snapshot. The decoded instructions are
+     * kept unless the guest wrote to its own code. A short run therefore costs
+     * a few page copies on top of the guest's own instructions.
+     *
+     * Crashes are exceptions the guest does not handle itself, such as illegal
+     * instructions, invalid addressing modes and division by zero. They are
+     * deduplicated by the address of the crashing instruction.
+     *
+     * The fuzzer uses the bus's dirty flags, so it cannot share a bus with a
+     * checkpoint chain. Devices and scheduled events are not part of the
+     * snapshot, so guests under test should only use memory.
+     */
+    class fuzzer {
+    public:
+        /**
+         * @brief Creates a fuzzer for a cpu attached to a bus
+         * @param cpu The cpu; it must outlive the fuzzer
+         * @param bus The memory of the guest; it must outlive the fuzzer
+         * @param input The guest address to copy each input to
+         * @param capacity The largest input in bytes; longer inputs are truncated
+         */
+        fuzzer(cpu &cpu, flat_bus &bus, uint64_t input, uint64_t capacity);
+
+        /**
+         * @brief Runs the guest up to a marker, then takes the snapshot there
+         * @param marker The address the guest is ready to take input at
+         * @param limit The most instructions to run before giving up
+         */
+        void boot(uint64_t marker, uint64_t limit = UINT64_MAX);
+
+        /**
+         * @brief Takes the snapshot at the cpu's current state
+         */
+        void snapshot(void);
+
+        /**
+         * @brief Runs the guest from the snapshot on one input
+         * @param data The input
+         * @param size The size of the input in bytes
+         * @return How the run ended
+         */
+        fuzz_outcome run(const uint8_t *data, uint64_t size);
+
+        /**
+         * @brief Sets the most instructions a run may retire before it times out
+         */
+        void set_budget(uint64_t budget) { this->_budget = budget; }
+
+        /**
+         * @brief Retrieves the number of instructions the last run retired
+         */
+        uint64_t retired(void) const { return this->_retired; }
+
+        /**
+         * @brief Retrieves the number of inputs run
+         */
+        uint64_t executions(void) const { return this->_executions; }
+
+        /**
+         * @brief Retrieves the distinct crashes, by the address of the crashing instruction
+         */
+        const std::map<uint64_t, fuzz_crash> &crashes(void) const { return this->_crashes; }
+
+    private:
+        /**
+         * @brief Copies the pages dirtied since the snapshot back from it
+         */
+        void restore(void);
+
+        /**
+         * @brief Records a crash, keeping the first input for each address
+         */
+        void crash(fuzz_outcome outcome, uint64_t pc, const uint8_t *data, uint64_t size);
+
+        cpu &_cpu;
+        flat_bus &_bus;
+        uint64_t _input;
+        uint64_t _capacity;
+
+        uint64_t _budget = 1 << 20;
+        uint64_t _retired = 0;
+        uint64_t _executions = 0;
+
+        bool _snapshotted = false;
+        std::vector<uint8_t> _memory;       /* memory as of the snapshot */
+        decltype(cpu::_r) _r;               /* registers as of the snapshot */
+        decltype(cpu::_f) _f;
+        decltype(cpu::_v) _v;
+        uint64_t _msrs[msr_count] = {};     /* the model-specific registers as of the snapshot */
+
+        std::map<uint64_t, fuzz_crash> _crashes;
+    };
+
+}
+
+#endif /* __mercury_vm_fuzzer_h__ */
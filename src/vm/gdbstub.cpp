@@ -0,0 +1,734 @@
+#include "./gdbstub.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mercury {
+
+    /* registers in the order of the g packet and the target description */
+    static constexpr uint64_t general_count = 11;
+    static constexpr uint64_t register_count = general_count + 8;
+
+    static const char hex_digits[] = "0123456789abcdef";
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    /**
+     * @brief Parses a big-endian hex number, as used for addresses and lengths
+     * @param text The text to parse
+     * @param at The position to start at, moved past the number
+     */
+    static uint64_t parse_hex(const std::string &text, size_t &at) {
+        uint64_t value = 0;
+
+        for (int digit; at < text.size() && (digit = hex_value(text[at])) >= 0; at++) {
+            value = value << 4 | (uint64_t)digit;
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Encodes a register as target-order (little-endian) hex
+     */
+    static std::string register_hex(uint64_t value) {
+        std::string hex;
+
+        for (int i = 0; i < 8; i++, value >>= 8) {
+            hex += hex_digits[(value >> 4) & 0xf];
+            hex += hex_digits[value & 0xf];
+        }
+
+        return hex;
+    }
+
+    /**
+     * @brief Decodes hex byte pairs into bytes
+     * @return false if the text is not all hex byte pairs
+     */
+    static bool decode_hex(const std::string &hex, size_t at, uint8_t *out, size_t size) {
+        if (hex.size() - std::min(at, hex.size()) < size * 2) {
+            return false;
+        }
+
+        for (size_t i = 0; i < size; i++) {
+            auto hi = hex_value(hex[at + 2 * i]), lo = hex_value(hex[at + 2 * i + 1]);
+
+            if (hi < 0 || lo < 0) {
+                return false;
+            }
+
+            out[i] = (uint8_t)(hi << 4 | lo);
+        }
+
+        return true;
+    }
+
+    static const char target_description[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+        "<target version=\"1.0\">\n"
+        "  <feature name=\"org.mercury.core\">\n"
+        "    <reg name=\"r0\" bitsize=\"64\" type=\"uint64\" regnum=\"0\"/>\n"
+        "    <reg name=\"r1\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r2\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r3\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r4\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r5\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r6\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"r7\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"sp\" bitsize=\"64\" type=\"data_ptr\"/>\n"
+        "    <reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\"/>\n"
+        "    <reg name=\"flags\" bitsize=\"64\" type=\"uint64\"/>\n"
+        "    <reg name=\"f0\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f1\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f2\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f3\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f4\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f5\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f6\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "    <reg name=\"f7\" bitsize=\"64\" type=\"ieee_double\"/>\n"
+        "  </feature>\n"
+        "</target>\n";
+
+    gdbstub::~gdbstub(void) {
+        this->close_client();
+
+        if (this->_listener >= 0) {
+            ::close(this->_listener);
+        }
+
+        if (!this->_unix_path.empty()) {
+            ::unlink(this->_unix_path.c_str());
+        }
+    }
+
+    /**
+     * @brief Listens for a debugger on a TCP port on the loopback interface
+     * @param port The port
+     */
+    void gdbstub::listen_tcp(uint16_t port) {
+        auto fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (fd < 0 ||
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            ::bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            ::listen(fd, 1) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+
+            throw gdb_exception("Failed to listen for a debugger on the TCP port");
+        }
+
+        if (this->_listener >= 0) {
+            ::close(this->_listener);
+        }
+
+        this->_listener = fd;
+    }
+
+    /**
+     * @brief Listens for a debugger on a Unix socket
+     * @param path The path of the socket, replaced if it exists
+     */
+    void gdbstub::listen_unix(const std::string &path) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            throw gdb_exception("Unix socket path is too long");
+        }
+
+        memcpy(addr.sun_path, path.c_str(), path.size());
+        ::unlink(path.c_str());
+
+        auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0 ||
+            ::bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            ::listen(fd, 1) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+
+            throw gdb_exception("Failed to listen for a debugger on the Unix socket");
+        }
+
+        if (this->_listener >= 0) {
+            ::close(this->_listener);
+        }
+
+        this->_listener = fd;
+        this->_unix_path = path;
+    }
+
+    /**
+     * @brief Waits for a debugger, then serves it until it detaches or kills the guest
+     * @return true if the debugger detached, false if it killed the guest or went away
+     */
+    bool gdbstub::serve(void) {
+        if (this->_listener < 0) {
+            throw gdb_exception("Debugger stub is not listening");
+        }
+
+        do {
+            this->_client = ::accept4(this->_listener, nullptr, nullptr, SOCK_CLOEXEC);
+        } while (this->_client < 0 && errno == EINTR);
+
+        if (this->_client < 0) {
+            throw gdb_exception("Failed to accept a debugger");
+        }
+
+        // packets are small and each waits for a reply; fails harmlessly on Unix sockets
+        int one = 1;
+        ::setsockopt(this->_client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        this->_input.clear();
+        this->_ack = true;
+        this->_done = false;
+        this->_detached = false;
+        this->_stop = "S05";
+
+        std::string packet;
+
+        while (!this->_done && this->receive(packet)) {
+            if (packet == "k") {
+                break;
+            }
+
+            this->send(this->handle(packet));
+
+            if (packet == "QStartNoAckMode") {
+                this->_ack = false;
+            }
+        }
+
+        for (auto address : this->_breakpoints) {
+            this->_cpu.remove_breakpoint(address);
+        }
+
+        this->_breakpoints.clear();
+
+        for (auto &w : this->_watchpoints) {
+            this->_cpu.remove_watchpoint(w.address, w.size, w.kind);
+        }
+
+        this->_watchpoints.clear();
+        this->close_client();
+
+        return this->_detached;
+    }
+
+    /**
+     * @brief Reads the next packet, acknowledging it
+     * @param packet Receives the packet's data
+     * @return false if the debugger has gone
+     */
+    bool gdbstub::receive(std::string &packet) {
+        for (;;) {
+            auto start = this->_input.find('$');
+            auto end = start == std::string::npos ? start : this->_input.find('#', start);
+
+            if (end != std::string::npos && end + 2 < this->_input.size()) {
+                packet = this->_input.substr(start + 1, end - start - 1);
+
+                size_t at = end + 1;
+                std::string checksum = this->_input.substr(at, 2);
+                this->_input.erase(0, end + 3);
+
+                uint8_t sum = 0, expected;
+
+                for (auto c : packet) {
+                    sum += (uint8_t)c;
+                }
+
+                if (this->_ack) {
+                    auto good = decode_hex(checksum, 0, &expected, 1) && expected == sum;
+
+                    ::send(this->_client, good ? "+" : "-", 1, MSG_NOSIGNAL);
+
+                    if (!good) {
+                        continue;
+                    }
+                }
+
+                return true;
+            }
+
+            // acks and interrupts from before the packet need no answer here
+            if (start == std::string::npos) {
+                this->_input.clear();
+            }
+
+            if (!this->fill(true)) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * @brief Sends a packet
+     * @details Replies are not resent on a nak: the debugger is always local,
+     * and the stream is reliable.
+     * @param data The packet's data
+     */
+    void gdbstub::send(const std::string &data) {
+        uint8_t sum = 0;
+
+        for (auto c : data) {
+            sum += (uint8_t)c;
+        }
+
+        std::string packet = "$" + data + "#";
+        packet += hex_digits[sum >> 4];
+        packet += hex_digits[sum & 0xf];
+
+        for (size_t sent = 0; sent < packet.size(); ) {
+            auto n = ::send(this->_client, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                this->_done = true;
+                return;
+            }
+
+            sent += (size_t)n;
+        }
+    }
+
+    /**
+     * @brief Handles a packet
+     * @param packet The packet's data
+     * @return The reply
+     */
+    std::string gdbstub::handle(const std::string &packet) {
+        if (packet.empty()) {
+            return "";
+        }
+
+        size_t at = 1;
+
+        switch (packet[0]) {
+            case '?':
+                return this->_stop;
+
+            case 'g': {
+                std::string reply;
+
+                for (uint64_t n = 0; n < register_count; n++) {
+                    reply += this->read_register(n);
+                }
+
+                return reply;
+            }
+
+            case 'G':
+                for (uint64_t n = 0; n < register_count && at < packet.size(); n++, at += 16) {
+                    if (!this->write_register(n, packet.substr(at, 16))) {
+                        return "E01";
+                    }
+                }
+
+                return "OK";
+
+            case 'p': {
+                auto reply = this->read_register(parse_hex(packet, at));
+                return reply.empty() ? "E00" : reply;
+            }
+
+            case 'P': {
+                auto n = parse_hex(packet, at);
+
+                if (at >= packet.size() || packet[at] != '=') {
+                    return "E01";
+                }
+
+                return this->write_register(n, packet.substr(at + 1)) ? "OK" : "E00";
+            }
+
+            case 'm': {
+                auto address = parse_hex(packet, at);
+                auto size = packet[at] == ',' ? parse_hex(packet, ++at) : 0;
+                auto reply = this->read_memory(address, size);
+
+                return reply.empty() && size != 0 ? "E14" : reply;
+            }
+
+            case 'M': {
+                auto address = parse_hex(packet, at);
+                auto size = packet[at] == ',' ? parse_hex(packet, ++at) : 0;
+
+                if (at >= packet.size() || packet[at] != ':') {
+                    return "E01";
+                }
+
+                return this->write_memory(address, size, packet.substr(at + 1)) ? "OK" : "E14";
+            }
+
+            case 'c':
+            case 's':
+                if (at < packet.size()) {
+                    this->_cpu.pc().q = parse_hex(packet, at);
+                }
+
+                return this->_stop = this->resume(packet[0] == 's');
+
+            case 'Z':
+            case 'z': {
+                auto type = parse_hex(packet, at);
+                auto address = packet[at] == ',' ? parse_hex(packet, ++at) : 0;
+
+                auto size = packet[at] == ',' ? parse_hex(packet, ++at) : 0;
+
+                if (type >= 2 && type <= 4) {
+                    return this->watch(packet[0] == 'Z', address, size, type);
+                }
+
+                if (type > 1) {
+                    return "";
+                }
+
+                if (packet[0] == 'z') {
+                    if (this->_breakpoints.erase(address)) {
+                        this->_cpu.remove_breakpoint(address);
+                    }
+                } else if (!this->_breakpoints.count(address) && !this->_cpu.has_breakpoint(address)) {
+                    // a breakpoint the host set stays the host's
+                    this->_cpu.add_breakpoint(address);
+                    this->_breakpoints.insert(address);
+                }
+
+                return "OK";
+            }
+
+            case 'q':
+                if (packet.rfind("qSupported", 0) == 0) {
+                    return "PacketSize=4000;qXfer:features:read+;QStartNoAckMode+";
+                }
+
+                if (packet.rfind("qXfer:features:read:", 0) == 0) {
+                    at = packet.find(':', 20);
+
+                    if (at == std::string::npos) {
+                        return "E00";
+                    }
+
+                    auto annex = packet.substr(20, at - 20);
+                    auto offset = parse_hex(packet, ++at);
+                    auto length = packet[at] == ',' ? parse_hex(packet, ++at) : 0;
+
+                    return this->target_xml(annex, offset, length);
+                }
+
+                if (packet == "qAttached") {
+                    return "1";
+                }
+
+                if (packet == "qC") {
+                    return "QC1";
+                }
+
+                if (packet == "qfThreadInfo") {
+                    return "m1";
+                }
+
+                if (packet == "qsThreadInfo") {
+                    return "l";
+                }
+
+                return "";
+
+            case 'Q':
+                return packet == "QStartNoAckMode" ? "OK" : "";
+
+            case 'H':
+            case 'T':
+                return "OK";
+
+            case 'D':
+                this->_done = true;
+                this->_detached = true;
+                return "OK";
+
+            default:
+                return "";
+        }
+    }
+
+    /**
+     * @brief Runs or steps the cpu until it stops
+     * @details A breakpoint at the program counter is lifted for the first
+     * instruction, so that resuming from it does not trap straight away.
+     * @param step Whether to run one instruction only
+     * @return The stop reply
+     */
+    std::string gdbstub::resume(bool step) {
+        auto from = this->_cpu.pc().q;
+        auto lifted = this->_cpu.has_breakpoint(from);
+
+        try {
+            if (lifted) {
+                this->_cpu.remove_breakpoint(from);
+                this->_cpu.run(1);
+                this->_cpu.add_breakpoint(from);
+                lifted = false;
+            } else {
+                this->_cpu.run(step ? 1 : gdbstub::slice);
+            }
+
+            while (!step && this->_cpu.state() == cpu_state::stopped) {
+                if (this->interrupted()) {
+                    return "S02";
+                }
+
+                this->_cpu.run(gdbstub::slice);
+            }
+        } catch (const halted_exception &) {
+            if (lifted) {
+                this->_cpu.add_breakpoint(from);
+            }
+
+            return this->_cpu.flags().q & cpu_flag::illegal ? "S04" : "W00";
+        } catch (const addressing_exception &) {
+            if (lifted) {
+                this->_cpu.add_breakpoint(from);
+            }
+
+            return "S0b";
+        } catch (const fault_exception &e) {
+            if (lifted) {
+                this->_cpu.add_breakpoint(from);
+            }
+
+            return e.vector() == cpu_vector::vector_divide ? "S08" : "S0b";
+        }
+
+        auto &hit = this->_cpu.watched();
+
+        if (this->_cpu.state() == cpu_state::trapped && hit.kind != watch_kind::watch_none) {
+            const char *name = hit.kind == watch_kind::watch_write ? "watch" :
+                               hit.kind == watch_kind::watch_read ? "rwatch" : "awatch";
+            char reply[64];
+
+            snprintf(reply, sizeof(reply), "T05%s:%llx;", name, (unsigned long long)hit.address);
+            return reply;
+        }
+
+        return "S05";
+    }
+
+    /**
+     * @brief Sets or clears a watchpoint for a Z2 to Z4 packet
+     * @param add Whether to set the watchpoint
+     * @param address The first address to watch
+     * @param size The number of bytes to watch
+     * @param type 2 for writes, 3 for reads or 4 for both
+     * @return The reply
+     */
+    std::string gdbstub::watch(bool add, uint64_t address, uint64_t size, uint64_t type) {
+        auto kind = type == 2 ? watch_kind::watch_write :
+                    type == 3 ? watch_kind::watch_read : watch_kind::watch_access;
+
+        auto it = std::find_if(this->_watchpoints.begin(), this->_watchpoints.end(), [&](const watchpoint &w) {
+            return w.address == address && w.size == size && w.kind == kind;
+        });
+
+        if (!add) {
+            if (it != this->_watchpoints.end()) {
+                this->_watchpoints.erase(it);
+                this->_cpu.remove_watchpoint(address, size, kind);
+            }
+
+            return "OK";
+        }
+
+        if (it == this->_watchpoints.end()) {
+            try {
+                this->_cpu.add_watchpoint(address, size, kind);
+            } catch (const std::invalid_argument &) {
+                return "E16";
+            }
+
+            this->_watchpoints.push_back({ address, size, kind });
+        }
+
+        return "OK";
+    }
+
+    /**
+     * @brief Checks, without waiting, whether the debugger has asked to interrupt the guest
+     * @details A debugger that has gone counts as an interrupt, ending the session.
+     */
+    bool gdbstub::interrupted(void) {
+        if (!this->fill(false)) {
+            this->_done = true;
+            return true;
+        }
+
+        auto at = this->_input.find('\x03');
+
+        if (at == std::string::npos) {
+            return false;
+        }
+
+        this->_input.erase(at, 1);
+        return true;
+    }
+
+    /**
+     * @brief Reads whatever the debugger has sent into the input buffer
+     * @param wait Whether to wait for something to arrive
+     * @return false if the debugger has gone
+     */
+    bool gdbstub::fill(bool wait) {
+        struct pollfd pfd = { this->_client, POLLIN, 0 };
+        int ready;
+
+        while ((ready = ::poll(&pfd, 1, wait ? -1 : 0)) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+
+        if (ready == 0) {
+            return true;
+        }
+
+        char buffer[4096];
+        ssize_t n;
+
+        do {
+            n = ::recv(this->_client, buffer, sizeof(buffer), 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0) {
+            return false;
+        }
+
+        this->_input.append(buffer, (size_t)n);
+        return true;
+    }
+
+    std::string gdbstub::read_register(uint64_t number) {
+        if (number < general_count) {
+            return register_hex(this->_cpu._r[number].q);
+        }
+
+        if (number < register_count) {
+            return register_hex((&this->_cpu.f0())[number - general_count].q);
+        }
+
+        return "";
+    }
+
+    bool gdbstub::write_register(uint64_t number, const std::string &hex) {
+        uint8_t bytes[8];
+        uint64_t value = 0;
+
+        if (number >= register_count || !decode_hex(hex, 0, bytes, sizeof(bytes))) {
+            return false;
+        }
+
+        for (int i = 7; i >= 0; i--) {
+            value = value << 8 | bytes[i];
+        }
+
+        if (number < general_count) {
+            this->_cpu._r[number].q = value;
+        } else {
+            (&this->_cpu.f0())[number - general_count].q = value;
+        }
+
+        return true;
+    }
+
+    std::string gdbstub::read_memory(uint64_t address, uint64_t size) {
+        // the reply must fit in PacketSize
+        size = std::min<uint64_t>(size, 0x1000);
+
+        auto memory = this->_cpu.guest_memory(address, size, false);
+        std::string hex;
+
+        if (memory == nullptr) {
+            return hex;
+        }
+
+        for (uint64_t i = 0; i < size; i++) {
+            hex += hex_digits[memory[i] >> 4];
+            hex += hex_digits[memory[i] & 0xf];
+        }
+
+        return hex;
+    }
+
+    bool gdbstub::write_memory(uint64_t address, uint64_t size, const std::string &hex) {
+        if (hex.size() != size * 2) {
+            return false;
+        }
+
+        std::vector<uint8_t> bytes(size);
+
+        if (!decode_hex(hex, 0, bytes.data(), size)) {
+            return false;
+        }
+
+        // guest_memory() discards instructions decoded from the range
+        auto memory = this->_cpu.guest_memory(address, size, true);
+
+        if (memory == nullptr) {
+            return false;
+        }
+
+        memcpy(memory, bytes.data(), size);
+        return true;
+    }
+
+    std::string gdbstub::target_xml(const std::string &annex, uint64_t offset, uint64_t length) const {
+        if (annex != "target.xml") {
+            return "E00";
+        }
+
+        std::string xml(target_description);
+
+        if (offset >= xml.size()) {
+            return "l";
+        }
+
+        auto chunk = xml.substr(offset, length);
+        return (offset + chunk.size() < xml.size() ? "m" : "l") + chunk;
+    }
+
+    void gdbstub::close_client(void) {
+        if (this->_client >= 0) {
+            ::close(this->_client);
+            this->_client = -1;
+        }
+    }
+
+}
@@ -0,0 +1,148 @@
+/**
+ * @file gdbstub.h
+ * @brief GDB remote serial protocol server
+*/
+
+#ifndef __mercury_vm_gdbstub_h__
+
+#define __mercury_vm_gdbstub_h__
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+
+#include "../exc/gdb_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief Lets GDB debug a guest over a local TCP or Unix socket
+     * @details The stub only touches the cpu while a debugger is attached and
+     * serve() is running, and breakpoints are trap entries patched into the
+     * decoded instruction cache, so neither a detached stub nor one that is
+     * waiting for the guest adds anything to the cost of an instruction. While
+     * the guest runs, the stub checks for an interrupt from GDB every
+     * slice instructions.
+     *
+     * Supported: registers (g, G, p, P), memory (m, M), continue and single
+     * step (c, s), software and hardware breakpoints (Z0, Z1), write, read
+     * and access watchpoints (Z2, Z3, Z4), a target description for the
+     * register layout, and no-ack mode. Memory access is limited to RAM, so
+     * reading memory never has a device's side effects.
+     */
+    class gdbstub {
+    public:
+        static constexpr uint64_t slice = 1 << 16;
+
+        /**
+         * @brief Creates a stub for a cpu
+         * @param cpu The cpu to debug; it must outlive the stub
+         */
+        explicit gdbstub(cpu &cpu) : _cpu(cpu) {}
+        ~gdbstub(void);
+
+        gdbstub(const gdbstub &) = delete;
+        gdbstub &operator=(const gdbstub &) = delete;
+
+        /**
+         * @brief Listens for a debugger on a TCP port on the loopback interface
+         * @param port The port
+         */
+        void listen_tcp(uint16_t port);
+
+        /**
+         * @brief Listens for a debugger on a Unix socket
+         * @param path The path of the socket, replaced if it exists
+         */
+        void listen_unix(const std::string &path);
+
+        /**
+         * @brief Waits for a debugger, then serves it until it detaches or kills the guest
+         * @details The cpu is left where the debugger last stopped it, with the
+         * debugger's breakpoints removed.
+         * @return true if the debugger detached, false if it killed the guest or went away
+         */
+        bool serve(void);
+
+    private:
+        /**
+         * @brief Reads the next packet, acknowledging it
+         * @param packet Receives the packet's data
+         * @return false if the debugger has gone
+         */
+        bool receive(std::string &packet);
+
+        /**
+         * @brief Sends a packet
+         * @param data The packet's data
+         */
+        void send(const std::string &data);
+
+        /**
+         * @brief Handles a packet
+         * @param packet The packet's data
+         * @return The reply
+         */
+        std::string handle(const std::string &packet);
+
+        /**
+         * @brief Runs or steps the cpu until it stops
+         * @param step Whether to run one instruction only
+         * @return The stop reply
+         */
+        std::string resume(bool step);
+
+        /**
+         * @brief Sets or clears a watchpoint for a Z2 to Z4 packet
+         * @param add Whether to set the watchpoint
+         * @param address The first address to watch
+         * @param size The number of bytes to watch
+         * @param type 2 for writes, 3 for reads or 4 for both
+         * @return The reply
+         */
+        std::string watch(bool add, uint64_t address, uint64_t size, uint64_t type);
+
+        /**
+         * @brief Checks, without waiting, whether the debugger has asked to interrupt the guest
+         */
+        bool interrupted(void);
+
+        /**
+         * @brief Reads whatever the debugger has sent into the input buffer
+         * @param wait Whether to wait for something to arrive
+         * @return false if the debugger has gone
+         */
+        bool fill(bool wait);
+
+        std::string read_register(uint64_t number);
+        bool write_register(uint64_t number, const std::string &hex);
+
+        std::string read_memory(uint64_t address, uint64_t size);
+        bool write_memory(uint64_t address, uint64_t size, const std::string &hex);
+
+        std::string target_xml(const std::string &annex, uint64_t offset, uint64_t length) const;
+
+        void close_client(void);
+
+        cpu &_cpu;
+
+        int _listener = -1;
+        int _client = -1;
+        std::string _unix_path;             /* the socket to unlink when done, if any */
+
+        std::string _input;                 /* received bytes not handled yet */
+        bool _ack = true;                   /* whether packets are acknowledged */
+        bool _done = false;                 /* the session is over */
+        bool _detached = false;             /* the session ended with a detach */
+
+        std::set<uint64_t> _breakpoints;    /* breakpoints set by the debugger */
+        std::vector<watchpoint> _watchpoints;   /* watchpoints set by the debugger */
+        std::string _stop = "S05";          /* the last stop reply */
+    };
+
+}
+
+#endif /* __mercury_vm_gdbstub_h__ */
@@ -0,0 +1,208 @@
+#include "./journal.h"
+
+namespace mercury {
+
+    static constexpr size_t journal_buffer_size = 64 * 1024;
+
+    /**
+     * @brief Creates a journal that records into a stream
+     * @param out The stream to append to; it must outlive the journal
+     */
+    journal_ptr journal::record(std::ostream &out) {
+        auto j = journal_ptr(new journal());
+
+        j->_out = &out;
+        j->_buffer.reserve(journal_buffer_size);
+
+        return j;
+    }
+
+    /**
+     * @brief Creates a journal that replays a recording
+     * @param in The stream holding the recording
+     */
+    journal_ptr journal::replay(std::istream &in) {
+        auto j = journal_ptr(new journal());
+        uint64_t instret = 0;
+
+        j->_in_replay = true;
+
+        for (int kind = in.get(); kind != std::char_traits<char>::eof(); kind = in.get()) {
+            switch (kind) {
+                case ev_irq:
+                case ev_nmi: {
+                    instret += journal::get(in);
+
+                    auto vector = in.get();
+
+                    if (vector == std::char_traits<char>::eof()) {
+                        throw journal_exception("Journal is truncated");
+                    }
+
+                    j->_interrupts.push_back({(event_kind)kind, instret, (uint8_t)vector});
+                    break;
+                }
+
+                case ev_read:
+                case ev_value:
+                    j->_values.push_back({(event_kind)kind, journal::get(in)});
+                    break;
+
+                default:
+                    throw journal_exception("Journal event is invalid");
+            }
+        }
+
+        return j;
+    }
+
+    journal::~journal(void) {
+        this->flush();
+    }
+
+    /**
+     * @brief Writes any buffered events to the stream
+     */
+    void journal::flush(void) {
+        if (this->_out == nullptr) {
+            return;
+        }
+
+        this->_out->write(this->_buffer.data(), this->_buffer.size());
+        this->_out->flush();
+        this->_buffer.clear();
+    }
+
+    /**
+     * @brief Decides whether an interrupt raised on the cpu goes ahead
+     * @param cpu The cpu being interrupted
+     * @param kind ev_irq or ev_nmi
+     * @param vector The interrupt vector
+     * @return true if the interrupt should be delivered
+     */
+    bool journal::admit(const cpu &cpu, event_kind kind, uint8_t vector) {
+        if (cpu.state() == cpu_state::running) {
+            return true;
+        }
+
+        if (this->_in_replay) {
+            return this->_injecting;
+        }
+
+        this->_buffer.push_back((char)kind);
+        this->put(cpu.instret() - this->_last_instret);
+        this->_buffer.push_back((char)vector);
+        this->_last_instret = cpu.instret();
+
+        if (this->_buffer.size() >= journal_buffer_size) {
+            this->flush();
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Records a value, or replaces it with the recorded one
+     * @param kind ev_read or ev_value
+     * @param value The live value (ignored while replaying)
+     * @return The value the guest should see
+     */
+    uint64_t journal::value(event_kind kind, uint64_t value) {
+        if (this->_in_replay) {
+            if (this->_values.empty() || this->_values.front().kind != kind) {
+                throw journal_exception("Replay has diverged from the recording");
+            }
+
+            value = this->_values.front().value;
+            this->_values.pop_front();
+
+            return value;
+        }
+
+        this->_buffer.push_back((char)kind);
+        this->put(value);
+
+        if (this->_buffer.size() >= journal_buffer_size) {
+            this->flush();
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Runs a cpu, injecting the recorded interrupts at the instruction counts they were recorded at
+     * @details Returns early, like cpu::run(), if the cpu halts or traps.
+     * @param cpu The cpu to run; it must start from the same state as the recording
+     * @param limit The maximum number of instructions to retire
+     * @return The number of instructions retired
+     */
+    uint64_t journal::run(cpu &cpu, uint64_t limit) {
+        uint64_t retired = 0;
+
+        while (retired < limit) {
+            if (this->_interrupts.empty()) {
+                return retired + cpu.run(limit - retired);
+            }
+
+            auto &next = this->_interrupts.front();
+
+            if (next.instret < cpu.instret()) {
+                throw journal_exception("Replay has passed a recorded interrupt");
+            }
+
+            if (next.instret > cpu.instret()) {
+                auto ran = cpu.run(std::min(next.instret - cpu.instret(), limit - retired));
+                retired += ran;
+
+                // halted, trapped or failed before the interrupt; the host has to act first
+                if (ran == 0 || cpu.state() != cpu_state::stopped) {
+                    break;
+                }
+
+                continue;
+            }
+
+            this->_injecting = true;
+
+            if (next.kind == ev_irq) {
+                cpu.irq(next.vector);
+            } else {
+                cpu.nmi(next.vector);
+            }
+
+            this->_injecting = false;
+            this->_interrupts.pop_front();
+        }
+
+        return retired;
+    }
+
+    void journal::put(uint64_t value) {
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            this->_buffer.push_back((char)(byte | (value ? 0x80 : 0)));
+        } while (value);
+    }
+
+    uint64_t journal::get(std::istream &in) {
+        uint64_t value = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = in.get();
+
+            if (byte == std::char_traits<char>::eof()) {
+                throw journal_exception("Journal is truncated");
+            }
+
+            value |= (uint64_t)(byte & 0x7f) << shift;
+
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+
+        throw journal_exception("Journal varint is too long");
+    }
+
+}
@@ -0,0 +1,125 @@
+/**
+ * @file journal.h
+ * @brief Record and replay of nondeterministic cpu input
+*/
+
+#ifndef __mercury_vm_journal_h__
+
+#define __mercury_vm_journal_h__
+
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "cpu.h"
+
+#include "../exc/journal_exc.h"
+
+namespace mercury {
+
+    /**
+     * @brief Records or replays everything nondeterministic that enters a cpu
+     * @details Three kinds of input are journalled:
+     * - interrupts raised by the host while the cpu is not running, with the
+     *   instruction count they were raised at;
+     * - reads that miss the cpu's direct memory path (device registers);
+     * - values passed through cpu::external() (times, host ids).
+     *
+     * Interrupts raised by a device during an instruction are a deterministic
+     * result of the guest's own execution, so they are not journalled.
+     *
+     * The log is append-only. Each event is a kind byte followed by LEB128
+     * varints, and interrupt positions are stored as deltas, so most events
+     * take two or three bytes.
+     */
+    class journal {
+    public:
+        enum event_kind : uint8_t {
+            ev_irq = 1,
+            ev_nmi,
+            ev_read,
+            ev_value,
+        };
+
+        /**
+         * @brief Creates a journal that records into a stream
+         * @param out The stream to append to; it must outlive the journal
+         */
+        static journal_ptr record(std::ostream &out);
+
+        /**
+         * @brief Creates a journal that replays a recording
+         * @param in The stream holding the recording
+         */
+        static journal_ptr replay(std::istream &in);
+
+        ~journal(void);
+
+        bool replaying(void) const { return this->_in_replay; }
+
+        /**
+         * @brief Writes any buffered events to the stream
+         */
+        void flush(void);
+
+        /**
+         * @brief Decides whether an interrupt raised on the cpu goes ahead
+         * @details Records host interrupts. While replaying, host interrupts are
+         * dropped and only the ones injected by run() go ahead.
+         * @param cpu The cpu being interrupted
+         * @param kind ev_irq or ev_nmi
+         * @param vector The interrupt vector
+         * @return true if the interrupt should be delivered
+         */
+        bool admit(const cpu &cpu, event_kind kind, uint8_t vector);
+
+        /**
+         * @brief Records a value, or replaces it with the recorded one
+         * @param kind ev_read or ev_value
+         * @param value The live value (ignored while replaying)
+         * @return The value the guest should see
+         */
+        uint64_t value(event_kind kind, uint64_t value);
+
+        /**
+         * @brief Runs a cpu, injecting the recorded interrupts at the instruction counts they were recorded at
+         * @details Returns early, like cpu::run(), if the cpu halts or traps.
+         * @param cpu The cpu to run; it must start from the same state as the recording
+         * @param limit The maximum number of instructions to retire
+         * @return The number of instructions retired
+         */
+        uint64_t run(cpu &cpu, uint64_t limit = UINT64_MAX);
+
+    private:
+        struct interrupt_event {
+            event_kind kind;
+            uint64_t instret;
+            uint8_t vector;
+        };
+
+        struct value_event {
+            event_kind kind;
+            uint64_t value;
+        };
+
+        journal(void) = default;
+
+        void put(uint64_t value);
+        static uint64_t get(std::istream &in);
+
+        bool _in_replay = false;
+        bool _injecting = false;
+
+        std::ostream *_out = nullptr;       /* the recording stream */
+        std::string _buffer;                /* encoded events not yet written */
+        uint64_t _last_instret = 0;         /* instret of the previous interrupt */
+
+        std::deque<interrupt_event> _interrupts;    /* interrupts still to replay */
+        std::deque<value_event> _values;            /* values still to replay */
+    };
+
+}
+
+#endif /* __mercury_vm_journal_h__ */
@@ -0,0 +1,430 @@
+/**
+ * @brief Paging and privilege: page table walks, the software TLB, user mode
+ * and model-specific registers
+ * @details Translation only starts once msr_page_table is set. Until then the
+ * TLB pointer in the context is null, and every access takes the same direct
+ * path to memory as before paging existed.
+ */
+
+#include "./cpu.h"
+
+#include <utility>
+
+namespace mercury {
+
+    /**
+     * @brief Points the MMU at a top-level page table, turning paging on or off
+     * @param address The physical address of the table, or 0 to turn paging off
+     */
+    void cpu::set_page_table(uint64_t address) {
+        this->_page_table = address & pte_flag::pte_address;
+
+        this->flush_tlb();
+        this->flush_decode_cache();
+    }
+
+    /**
+     * @brief Points _tlb at the current mode's entries, or at nothing while paging is off
+     * @details The stack window was opened through the other mode's entries.
+     */
+    void cpu::select_tlb(void) {
+        this->_tlb = this->_page_table == 0 ? nullptr :
+                     this->_tlb_entries.data() + (this->user_mode() ? tlb_size : 0);
+
+        this->close_stack_window();
+    }
+
+    /**
+     * @brief Enters supervisor or user mode
+     * @param user Whether to enter user mode
+     */
+    void cpu::switch_mode(bool user) {
+        if (user == this->user_mode()) {
+            return;
+        }
+
+        std::swap(this->_r[cpu_reg::sp].q, this->_banked_sp);
+        this->set_flag(cpu_flag::user, user);
+        this->select_tlb();
+
+        // return predictions made in the other mode would skip the check too
+        this->_relink = true;
+        this->_return_top = 0;
+        this->_return_hint = nullptr;
+    }
+
+    /**
+     * @brief Discards every cached translation
+     * @details The stack window is a cached translation too. Afterwards _tlb
+     * points at the entries of the mode in the flags, which the host may have
+     * loaded directly.
+     */
+    void cpu::flush_tlb(void) {
+        for (auto &e : this->_tlb_entries) {
+            e = { tlb_invalid, tlb_invalid, tlb_invalid, 0, nullptr, false };
+        }
+
+        this->select_tlb();
+    }
+
+    /**
+     * @brief Drops the cached translation of one virtual page, as invlpg does
+     * @details Instructions decoded from the page are discarded as well, since
+     * the page may now hold other code.
+     * @param address An address in the page
+     */
+    void cpu::invalidate_page(uint64_t address) {
+        auto page = address & ~(page_size - 1);
+
+        for (auto half : { (uint64_t)0, tlb_size }) {
+            auto &e = this->_tlb_entries[half + ((address >> page_shift) & (tlb_size - 1))];
+
+            if (e.read == page || e.write == page || e.fetch == page) {
+                e = { tlb_invalid, tlb_invalid, tlb_invalid, 0, nullptr, false };
+            }
+        }
+
+        if (this->_stack_page == address >> page_shift) {
+            this->close_stack_window();
+        }
+
+        if (this->_code_pages.count(address >> page_shift)) {
+            this->flush_decode_cache();
+        }
+    }
+
+    /**
+     * @brief Translates a virtual address, walking the page tables on a TLB miss
+     * @param address The virtual address
+     * @param access The kind of access
+     * @return The physical address
+     */
+    uint64_t cpu::translate(uint64_t address, page_access access) {
+        auto &e = this->_tlb[(address >> page_shift) & (tlb_size - 1)];
+        auto offset = address & (page_size - 1);
+        auto tag = access == page_access::access_read ? e.read :
+                   access == page_access::access_write ? e.write : e.fetch;
+
+        if (tag == address - offset) {
+            cpu_counters::bump(this->_counters.tlb_hits);
+            return (e.frame << page_shift) | offset;
+        }
+
+        auto physical = this->walk(address, access);
+
+        if (physical == UINT64_MAX) {
+            this->page_fault(address);
+        }
+
+        return physical;
+    }
+
+    /**
+     * @brief Walks the page tables for an address and fills its TLB entry
+     * @details Each level is indexed by 9 bits of the address, from bit 39
+     * down to bit 12, so addresses above 48 bits are never mapped. The
+     * accessed bit is set at every level used, and the dirty bit on the leaf
+     * when the access is a write. User mode also needs the user bit at every
+     * level. Nothing is cached for an access that is not allowed.
+     * @param address The virtual address
+     * @param access The kind of access
+     * @return The physical address, or UINT64_MAX if the access is not allowed
+     */
+    uint64_t cpu::walk(uint64_t address, page_access access) {
+        cpu_counters::bump(this->_counters.tlb_misses);
+
+        if (address >> (page_shift + 9 * page_levels)) {
+            return UINT64_MAX;
+        }
+
+        auto write = access == page_access::access_write;
+        auto user = this->user_mode();
+        auto table = this->_page_table;
+        uint64_t allowed = pte_flag::pte_writable | pte_flag::pte_user;
+        uint64_t denied = 0;
+        uint64_t entry = 0;
+
+        for (auto level = page_levels - 1; level >= 0; level--) {
+            auto slot = table + ((address >> (page_shift + 9 * level)) & 511) * sizeof(uint64_t);
+
+            entry = this->read_physical(slot, sizeof(uint64_t), page_access::access_read);
+
+            if (!(entry & pte_flag::pte_present)) {
+                return UINT64_MAX;
+            }
+
+            allowed &= entry;
+            denied |= entry & pte_flag::pte_no_execute;
+
+            if ((write && !(allowed & pte_flag::pte_writable)) ||
+                (user && !(allowed & pte_flag::pte_user)) ||
+                (access == page_access::access_fetch && denied)) {
+                return UINT64_MAX;
+            }
+
+            auto update = entry | pte_flag::pte_accessed | (level == 0 && write ? (uint64_t)pte_flag::pte_dirty : 0);
+
+            if (update != entry) {
+                this->write_physical(slot, sizeof(uint64_t), update);
+                entry = update;
+            }
+
+            table = entry & pte_flag::pte_address;
+        }
+
+        auto page = address & ~(page_size - 1);
+        auto frame = table >> page_shift;
+        auto &e = this->_tlb[(address >> page_shift) & (tlb_size - 1)];
+
+        e.read = page;
+        // stores to decoded code must reach write_physical(), so it gets no write tag
+        e.write = (allowed & pte_flag::pte_writable) && (entry & pte_flag::pte_dirty) &&
+                  !(frame < this->_page_count && (this->_pages[frame] & page_flag::page_code)) ? page : tlb_invalid;
+        e.fetch = denied ? tlb_invalid : page;
+        e.frame = frame;
+        e.host = frame < this->_page_count && !(this->_pages[frame] & page_flag::page_watch) ?
+                 this->_memory + (frame << page_shift) : nullptr;
+        e.user = (allowed & pte_flag::pte_user) != 0;
+
+        return table | (address & (page_size - 1));
+    }
+
+    /**
+     * @brief Raises a page fault for an access the page tables do not allow, abandoning the instruction
+     * @param address The virtual address of the access
+     */
+    void cpu::page_fault(uint64_t address) {
+        if (this->_delivering || this->_state != cpu_state::running) {
+            auto vector = this->_delivering ? cpu_vector::vector_double_fault : cpu_vector::vector_page_fault;
+
+            this->_delivering = false;
+            this->_fetching = false;
+            this->set_state(cpu_state::error);
+
+            throw fault_exception(vector, address);
+        }
+
+        this->raise(cpu_vector::vector_page_fault, address);
+
+        throw unwind();
+    }
+
+    /**
+     * @brief Reads through the page tables
+     * @details An access across two pages translates both before reading
+     * either, since they need not be next to each other in physical memory.
+     * @param address The virtual address to read from
+     * @param size The size of the read in bytes
+     * @param access Whether this is a read or an instruction fetch
+     * @return The value read
+     */
+    uint64_t cpu::read_mapped(uint64_t address, uint8_t size, page_access access) {
+        auto head = page_size - (address & (page_size - 1));
+
+        if (size <= head) {
+            return this->read_physical(this->translate(address, access), size, access);
+        }
+
+        auto first = this->translate(address, access);
+        auto second = this->translate(address + head, access);
+        uint64_t value = 0;
+
+        for (uint64_t i = 0; i < size; i++) {
+            auto physical = i < head ? first + i : second + (i - head);
+
+            value |= this->read_physical(physical, 1, access) << (i * 8);
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Writes through the page tables
+     * @details An access across two pages translates both before writing
+     * either, so that a page fault leaves memory untouched.
+     * @param address The virtual address to write to
+     * @param size The size of the write in bytes
+     * @param value The value to write
+     */
+    void cpu::write_mapped(uint64_t address, uint8_t size, uint64_t value) {
+        auto head = page_size - (address & (page_size - 1));
+
+        if (size <= head) {
+            this->write_physical(this->translate(address, page_access::access_write), size, value);
+            return;
+        }
+
+        auto first = this->translate(address, page_access::access_write);
+        auto second = this->translate(address + head, page_access::access_write);
+
+        for (uint64_t i = 0; i < size; i++) {
+            auto physical = i < head ? first + i : second + (i - head);
+
+            this->write_physical(physical, 1, (value >> (i * 8)) & 0xff);
+        }
+    }
+
+    /**
+     * @brief Reads from a physical address, bypassing the bus when it is in _memory
+     * @param address The physical address to read from
+     * @param size The size of the read in bytes
+     * @param access Instruction fetches ignore watchpoints
+     * @return The value read
+     */
+    uint64_t cpu::read_physical(uint64_t address, uint8_t size, page_access access) {
+        auto limit = (uint64_t)this->_page_count << page_shift;
+
+        if (address < limit && size <= limit - address &&
+            (access == page_access::access_fetch ||
+             !((this->_pages[address >> page_shift] | this->_pages[(address + size - 1) >> page_shift]) & page_flag::page_watch))) {
+            uint64_t value = 0;
+            memcpy(&value, this->_memory + address, size);
+            return value;
+        }
+
+        switch (size) {
+            case 1: return this->read_bus<uint8_t>(address);
+            case 2: return this->read_bus<uint16_t>(address);
+            case 4: return this->read_bus<uint32_t>(address);
+            default: return this->read_bus<uint64_t>(address);
+        }
+    }
+
+    /**
+     * @brief Writes to a physical address, bypassing the bus when it is in _memory
+     * @param address The physical address to write to
+     * @param size The size of the write in bytes
+     * @param value The value to write
+     */
+    void cpu::write_physical(uint64_t address, uint8_t size, uint64_t value) {
+        auto limit = (uint64_t)this->_page_count << page_shift;
+
+        if (address < limit && size <= limit - address) {
+            auto flags = this->_pages[address >> page_shift] | this->_pages[(address + size - 1) >> page_shift];
+
+            // the instruction doing the store may be cached too, so the flush waits for decode()
+            if (flags & page_flag::page_code) {
+                this->_stale = true;
+                this->_relink = true;
+            }
+
+            if (!(flags & page_flag::page_watch)) {
+                this->_pages[address >> page_shift] |= page_flag::page_written;
+                this->_pages[(address + size - 1) >> page_shift] |= page_flag::page_written;
+                memcpy(this->_memory + address, &value, size);
+                return;
+            }
+        }
+
+        switch (size) {
+            case 1: this->write_bus<uint8_t>(address, value); break;
+            case 2: this->write_bus<uint16_t>(address, value); break;
+            case 4: this->write_bus<uint32_t>(address, value); break;
+            default: this->write_bus<uint64_t>(address, value); break;
+        }
+    }
+
+    /**
+     * @brief Reads a model-specific register from the host
+     * @param number The register
+     * @return The value of the register
+     */
+    uint64_t cpu::msr(cpu_msr number) const {
+        switch (number) {
+            case cpu_msr::msr_vector_table:
+                return this->_vector_table;
+
+            case cpu_msr::msr_page_table:
+                return this->_page_table;
+
+            case cpu_msr::msr_syscall_entry:
+                return this->_syscall_entry;
+
+            case cpu_msr::msr_syscall_mask:
+                return this->_syscall_mask;
+
+            case cpu_msr::msr_syscall_pc:
+                return this->_syscall_pc;
+
+            case cpu_msr::msr_syscall_flags:
+                return this->_syscall_flags;
+
+            case cpu_msr::msr_banked_stack:
+                return this->_banked_sp;
+
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * @brief Writes a model-specific register from the host, as wrmsr does
+     * @details Writing msr_page_table, even with its current value, discards
+     * every cached translation.
+     * @param number The register
+     * @param value The value to write
+     */
+    void cpu::set_msr(cpu_msr number, uint64_t value) {
+        switch (number) {
+            case cpu_msr::msr_vector_table:
+                this->_vector_table = value;
+                break;
+
+            case cpu_msr::msr_page_table:
+                this->set_page_table(value);
+                break;
+
+            case cpu_msr::msr_syscall_entry:
+                this->_syscall_entry = value;
+                break;
+
+            case cpu_msr::msr_syscall_mask:
+                this->_syscall_mask = value;
+                break;
+
+            case cpu_msr::msr_syscall_pc:
+                this->_syscall_pc = value;
+                break;
+
+            case cpu_msr::msr_syscall_flags:
+                this->_syscall_flags = value;
+                break;
+
+            case cpu_msr::msr_banked_stack:
+                this->_banked_sp = value;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /**
+     * @brief Reads a model-specific register for rdmsr
+     * @details An unknown register is a protection fault.
+     * @param number The register, a cpu_msr
+     * @return The value of the register
+     */
+    uint64_t cpu::read_msr(uint64_t number) {
+        if (number >= cpu_msr::msr_count) {
+            this->fault(number);
+        }
+
+        return this->msr(static_cast<cpu_msr>(number));
+    }
+
+    /**
+     * @brief Writes a model-specific register for wrmsr
+     * @details An unknown register is a protection fault.
+     * @param number The register, a cpu_msr
+     * @param value The value to write
+     */
+    void cpu::write_msr(uint64_t number, uint64_t value) {
+        if (number >= cpu_msr::msr_count) {
+            this->fault(number);
+        }
+
+        this->set_msr(static_cast<cpu_msr>(number), value);
+    }
+
+}
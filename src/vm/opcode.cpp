@@ -6,6 +6,11 @@
 #include <iostream>
 #include "cpu.h"
 
+#define opdef_1(name) \
+    { opc1(opcode::_##name, addressing::register_direct), &cpu::_##name }, \
+    { opc1(opcode::_##name, addressing::register_indirect), &cpu::_##name }, \
+    { opc1(opcode::_##name, addressing::direct), &cpu::_##name }
+
 #define opdef_2(name) \
     { opc2(opcode::_##name, addressing::register_direct, addressing::register_direct), &cpu::_##name }, \
     { opc2(opcode::_##name, addressing::direct, addressing::register_direct), &cpu::_##name }, \
@@ -15,6 +20,64 @@
     { opc2(opcode::_##name, addressing::register_indirect, addressing::immediate), &cpu::_##name }, \
     { opc2(opcode::_##name, addressing::direct, addressing::immediate), &cpu::_##name }
 
+#define opdef_j(name) \
+    { opc1(opcode::_##name, addressing::immediate), &cpu::_##name }, \
+    { opc1(opcode::_##name, addressing::register_direct), &cpu::_##name }, \
+    { opc1(opcode::_##name, addressing::register_indirect), &cpu::_##name }, \
+    { opc1(opcode::_##name, addressing::direct), &cpu::_##name }
+
+#define opdef_f(name) \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::register_direct), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::immediate), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::direct), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::register_indirect), &cpu::_##name }
+
+#define opdef_fst(name) \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::register_direct), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::direct, addressing::register_direct), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::register_indirect, addressing::register_direct), &cpu::_##name }
+
+#define opdef_v3(name) \
+    { opc3(opcode::_##name, addressing::register_direct, addressing::register_direct, addressing::register_direct), &cpu::_##name }
+
+#define opdef_vi(name) \
+    { opc3(opcode::_##name, addressing::register_direct, addressing::register_direct, addressing::immediate), &cpu::_##name }
+
+#define opdef_vmov(name, mode) \
+    { opc2(opcode::_##name, addressing::register_direct, addressing::mode), &cpu::_##name }, \
+    { opc2(opcode::_##name, addressing::mode, addressing::register_direct), &cpu::_##name }
+
+#define fusedef(first, second, func) \
+    { (uint64_t)(first) << 32 | (second), &cpu::func }
+
+#define fusedef_jcc(first, func) \
+    fusedef(first, opc1(opcode::_ja, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jae, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jb, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jbe, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jc, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_je, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jg, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jge, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jl, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jle, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jna, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnae, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnb, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnbe, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnc, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jne, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jng, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnge, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnl, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnle, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jno, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jns, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jnz, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jo, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_js, addressing::immediate), func), \
+    fusedef(first, opc1(opcode::_jz, addressing::immediate), func)
+
 
 namespace mercury {
 
@@ -36,9 +99,168 @@ namespace mercury {
             opdef_2(sub),
             opdef_2(xor),
 
+            opdef_1(dec),
+            opdef_1(div),
+            opdef_1(idiv),
+            opdef_1(inc),
+
+            opdef_j(call),
+            opdef_j(ja),
+            opdef_j(jae),
+            opdef_j(jb),
+            opdef_j(jbe),
+            opdef_j(jc),
+            opdef_j(jcxz),
+            opdef_j(je),
+            opdef_j(jg),
+            opdef_j(jge),
+            opdef_j(jl),
+            opdef_j(jle),
+            opdef_j(jmp),
+            opdef_j(jna),
+            opdef_j(jnae),
+            opdef_j(jnb),
+            opdef_j(jnbe),
+            opdef_j(jnc),
+            opdef_j(jne),
+            opdef_j(jng),
+            opdef_j(jnge),
+            opdef_j(jnl),
+            opdef_j(jnle),
+            opdef_j(jno),
+            opdef_j(jns),
+            opdef_j(jnz),
+            opdef_j(jo),
+            opdef_j(js),
+            opdef_j(jz),
+            opdef_j(loop),
+            opdef_j(loope),
+            opdef_j(loopne),
+
+            { opc1(opcode::_jecxz, addressing::immediate), &cpu::_jcxz},
+            { opc1(opcode::_loopz, addressing::immediate), &cpu::_loope},
+            { opc1(opcode::_loopnz, addressing::immediate), &cpu::_loopne},
+
+            opdef_1(pop),
+            opdef_1(push),
+            { opc1(opcode::_push, addressing::immediate), &cpu::_push},
+
+            { opc0(opcode::_popa), &cpu::_popa},
+            { opc0(opcode::_popad), &cpu::_popa},
+            { opc0(opcode::_popf), &cpu::_popf},
+            { opc0(opcode::_popfd), &cpu::_popf},
+            { opc0(opcode::_pusha), &cpu::_pusha},
+            { opc0(opcode::_pushad), &cpu::_pusha},
+            { opc0(opcode::_pushf), &cpu::_pushf},
+            { opc0(opcode::_pushfd), &cpu::_pushf},
+
+            opdef_f(fadd),
+            opdef_f(fcom),
+            opdef_f(fdiv),
+            opdef_f(fild),
+            opdef_f(fld),
+            opdef_f(fmul),
+            opdef_f(fsqrt),
+            opdef_f(fsub),
+            opdef_fst(fist),
+            opdef_fst(fst),
+
+            { opc2(opcode::_fucom, addressing::register_direct, addressing::register_direct), &cpu::_fcom},
+            { opc2(opcode::_fxch, addressing::register_direct, addressing::register_direct), &cpu::_fxch},
+            { opc1(opcode::_fabs, addressing::register_direct), &cpu::_fabs},
+            { opc1(opcode::_fchs, addressing::register_direct), &cpu::_fchs},
+            { opc1(opcode::_fld1, addressing::register_direct), &cpu::_fld1},
+            { opc1(opcode::_fldpi, addressing::register_direct), &cpu::_fldpi},
+            { opc1(opcode::_fldz, addressing::register_direct), &cpu::_fldz},
+            { opc0(opcode::_finit), &cpu::_finit},
+            { opc0(opcode::_fninit), &cpu::_finit},
+
+            opdef_v3(vaddpd),
+            opdef_v3(vaddps),
+            opdef_v3(vcmpeqpd),
+            opdef_v3(vcmpeqps),
+            opdef_v3(vcmpltpd),
+            opdef_v3(vcmpltps),
+            opdef_v3(vmulpd),
+            opdef_v3(vmulps),
+            opdef_v3(vpaddb),
+            opdef_v3(vpaddd),
+            opdef_v3(vpaddq),
+            opdef_v3(vpaddw),
+            opdef_v3(vpand),
+            opdef_v3(vpcmpeqb),
+            opdef_v3(vpcmpeqd),
+            opdef_v3(vpcmpgtd),
+            opdef_v3(vpmulld),
+            opdef_v3(vpmullw),
+            opdef_v3(vpor),
+            opdef_v3(vpshufb),
+            opdef_v3(vpsubd),
+            opdef_v3(vpsubq),
+            opdef_v3(vpxor),
+            opdef_v3(vsubpd),
+            opdef_v3(vsubps),
+            opdef_vi(vpermq),
+            opdef_vi(vpshufd),
+
+            { opc2(opcode::_vmovdqu, addressing::register_direct, addressing::register_direct), &cpu::_vmovdqu},
+            opdef_vmov(vmovdqu, direct),
+            opdef_vmov(vmovdqu, register_indirect),
+            opdef_vmov(vmovdqu, indexed),
+            opdef_vmov(vmovdqu, based_indexed),
+
+            { opc2(opcode::_vpbroadcastq, addressing::register_direct, addressing::immediate), &cpu::_vpbroadcastq},
+            { opc2(opcode::_vpbroadcastq, addressing::register_direct, addressing::register_direct), &cpu::_vpbroadcastq},
+            { opc2(opcode::_vpbroadcastq, addressing::register_direct, addressing::register_indirect), &cpu::_vpbroadcastq},
+            { opc2(opcode::_vpbroadcastq, addressing::register_direct, addressing::direct), &cpu::_vpbroadcastq},
+            { opc3(opcode::_vpextrq, addressing::register_direct, addressing::register_direct, addressing::immediate), &cpu::_vpextrq},
+            { opc3(opcode::_vpextrq, addressing::register_indirect, addressing::register_direct, addressing::immediate), &cpu::_vpextrq},
+            { opc3(opcode::_vpextrq, addressing::direct, addressing::register_direct, addressing::immediate), &cpu::_vpextrq},
+
+            { opc2(opcode::_cpuid, addressing::register_direct, addressing::immediate), &cpu::_cpuid},
+            { opc2(opcode::_cpuid, addressing::register_direct, addressing::register_direct), &cpu::_cpuid},
+            { opc1(opcode::_invlpg, addressing::direct), &cpu::_invlpg},
+            { opc1(opcode::_invlpg, addressing::register_indirect), &cpu::_invlpg},
+            { opc1(opcode::_invlpg, addressing::indexed), &cpu::_invlpg},
+            { opc1(opcode::_invlpg, addressing::based_indexed), &cpu::_invlpg},
+            { opc2(opcode::_rdmsr, addressing::register_direct, addressing::immediate), &cpu::_rdmsr},
+            { opc2(opcode::_rdmsr, addressing::register_direct, addressing::register_direct), &cpu::_rdmsr},
+            { opc2(opcode::_wrmsr, addressing::immediate, addressing::immediate), &cpu::_wrmsr},
+            { opc2(opcode::_wrmsr, addressing::immediate, addressing::register_direct), &cpu::_wrmsr},
+            { opc2(opcode::_wrmsr, addressing::register_direct, addressing::register_direct), &cpu::_wrmsr},
+            { opc0(opcode::_syscall), &cpu::_syscall},
+            { opc0(opcode::_sysret), &cpu::_sysret},
 
             { opc0(opcode::_nop), &cpu::_nop},
             { opc0(opcode::_hlt), &cpu::_hlt},
+            { opc0(opcode::_vmcall), &cpu::_vmcall},
+            { opc0(opcode::_iret), &cpu::_iret},
+            { opc0(opcode::_iretd), &cpu::_iret},
+            { opc0(opcode::_ret), &cpu::_ret},
+            { opc0(opcode::_retn), &cpu::_ret},
+    };
+
+    std::map<uint64_t, opcode_func> cpu::_fusion_table = {
+            fusedef(opc2(opcode::_shl, addressing::register_direct, addressing::immediate),
+                    opc2(opcode::_add, addressing::register_direct, addressing::register_direct), _shl_add),
+            fusedef(opc2(opcode::_shl, addressing::register_direct, addressing::immediate),
+                    opc2(opcode::_add, addressing::register_direct, addressing::immediate), _shl_add_imm),
+            fusedef(opc2(opcode::_sal, addressing::register_direct, addressing::immediate),
+                    opc2(opcode::_add, addressing::register_direct, addressing::register_direct), _shl_add),
+            fusedef(opc2(opcode::_sal, addressing::register_direct, addressing::immediate),
+                    opc2(opcode::_add, addressing::register_direct, addressing::immediate), _shl_add_imm),
+
+            fusedef_jcc(opc2(opcode::_cmp, addressing::register_direct, addressing::register_direct), _cmp_jcc),
+            fusedef_jcc(opc2(opcode::_cmp, addressing::register_direct, addressing::immediate), _cmp_jcc_imm),
+
+            fusedef(opc1(opcode::_dec, addressing::register_direct),
+                    opc1(opcode::_jnz, addressing::immediate), _dec_jnz),
+            fusedef(opc1(opcode::_dec, addressing::register_direct),
+                    opc1(opcode::_jne, addressing::immediate), _dec_jnz),
+            fusedef(opc1(opcode::_inc, addressing::register_direct),
+                    opc1(opcode::_jnz, addressing::immediate), _inc_jnz),
+            fusedef(opc1(opcode::_inc, addressing::register_direct),
+                    opc1(opcode::_jne, addressing::immediate), _inc_jnz),
     };
 
 }
\ No newline at end of file
@@ -336,6 +336,43 @@ namespace mercury {
         _xchg,	        /* Exchange */
         _xlat,	        /* Translate */
         _xor,	        /* Exclusive-OR */
+
+        // later opcodes are appended rather than sorted in, so that the value
+        // of every opcode above stays the same and existing code still decodes
+        _jmp,	        /* Jump */
+        _vaddpd,	        /* Add Packed Double-Precision Values */
+        _vaddps,	        /* Add Packed Single-Precision Values */
+        _vcmpeqpd,	    /* Compare Packed Double-Precision Values for Equal */
+        _vcmpeqps,	    /* Compare Packed Single-Precision Values for Equal */
+        _vcmpltpd,	    /* Compare Packed Double-Precision Values for Less Than */
+        _vcmpltps,	    /* Compare Packed Single-Precision Values for Less Than */
+        _vmovdqu,	    /* Move Unaligned Packed Integer Values */
+        _vmulpd,	        /* Multiply Packed Double-Precision Values */
+        _vmulps,	        /* Multiply Packed Single-Precision Values */
+        _vpaddb,	        /* Add Packed Bytes */
+        _vpaddd,	        /* Add Packed Doublewords */
+        _vpaddq,	        /* Add Packed Quadwords */
+        _vpaddw,	        /* Add Packed Words */
+        _vpand,	        /* Logical AND of Packed Values */
+        _vpbroadcastq,	    /* Broadcast Quadword */
+        _vpcmpeqb,	    /* Compare Packed Bytes for Equal */
+        _vpcmpeqd,	    /* Compare Packed Doublewords for Equal */
+        _vpcmpgtd,	    /* Compare Packed Signed Doublewords for Greater Than */
+        _vpermq,	        /* Permute Quadwords */
+        _vpextrq,	    /* Extract Quadword */
+        _vpmulld,	    /* Multiply Packed Doublewords, Low Result */
+        _vpmullw,	    /* Multiply Packed Words, Low Result */
+        _vpor,	        /* Logical OR of Packed Values */
+        _vpshufb,	    /* Shuffle Packed Bytes */
+        _vpshufd,	    /* Shuffle Packed Doublewords */
+        _vpsubd,	        /* Subtract Packed Doublewords */
+        _vpsubq,	        /* Subtract Packed Quadwords */
+        _vpxor,	        /* Logical XOR of Packed Values */
+        _vsubpd,	        /* Subtract Packed Double-Precision Values */
+        _vsubps,	        /* Subtract Packed Single-Precision Values */
+        _vmcall,	    /* Call to VM Monitor */
+        _syscall,	    /* Fast System Call */
+        _sysret,	    /* Return From Fast System Call */
     };
 
 }
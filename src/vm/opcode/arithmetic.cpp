@@ -77,15 +77,14 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->set_flag(cpu_flag::zero, p1 == p2);
-        cpu->set_flag(cpu_flag::negative, p1 < p2);
+        cpu->set_compare_flags(p1, p2);
     }
 
     void cpu::_cmpsb(cpu *cpu) {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->_bus->write8(cpu->_r[cpu_reg::r6].q, cpu->_bus->read8(cpu->_r[cpu_reg::r7].q));
+        cpu->write8(cpu->_r[cpu_reg::r6].q, cpu->read8(cpu->_r[cpu_reg::r7].q));
         cpu->_r[cpu_reg::r6].q += p1;
         cpu->_r[cpu_reg::r7].q += p2;
     }
@@ -94,7 +93,7 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->_bus->write16(cpu->_r[cpu_reg::r6].q, cpu->_bus->read16(cpu->_r[cpu_reg::r7].q));
+        cpu->write16(cpu->_r[cpu_reg::r6].q, cpu->read16(cpu->_r[cpu_reg::r7].q));
         cpu->_r[cpu_reg::r6].q += p1;
         cpu->_r[cpu_reg::r7].q += p2;
     }
@@ -103,7 +102,7 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->_bus->write32(cpu->_r[cpu_reg::r6].q, cpu->_bus->read32(cpu->_r[cpu_reg::r7].q));
+        cpu->write32(cpu->_r[cpu_reg::r6].q, cpu->read32(cpu->_r[cpu_reg::r7].q));
         cpu->_r[cpu_reg::r6].q += p1;
         cpu->_r[cpu_reg::r7].q += p2;
     }
@@ -112,7 +111,7 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->_bus->write64(cpu->_r[cpu_reg::r6].q, cpu->_bus->read64(cpu->_r[cpu_reg::r7].q));
+        cpu->write64(cpu->_r[cpu_reg::r6].q, cpu->read64(cpu->_r[cpu_reg::r7].q));
         cpu->_r[cpu_reg::r6].q += p1;
         cpu->_r[cpu_reg::r7].q += p2;
     }
@@ -143,21 +142,33 @@ namespace mercury {
     void cpu::_dec(cpu *cpu) {
         auto p1 = cpu->get_op_1();
 
+        cpu->set_step_flags(p1 - 1, p1 == 0x8000000000000000);
         cpu->set_op_1(p1 - 1);
     }
 
     void cpu::_div(cpu *cpu) {
         auto p1 = cpu->get_op_1();
 
+        if (p1 == 0) {
+            return cpu->raise(cpu_vector::vector_divide, 0);
+        }
+
         cpu->_r[cpu_reg::r0].q /= p1;
         cpu->_r[cpu_reg::r1].q %= p1;
     }
 
     void cpu::_idiv(cpu *cpu) {
-        auto p1 = cpu->get_op_1();
+        auto p1 = (int64_t)cpu->get_op_1();
+        auto &r0 = cpu->_r[cpu_reg::r0].q;
+        auto &r1 = cpu->_r[cpu_reg::r1].q;
 
-        cpu->_r[cpu_reg::r0].q /= p1;
-        cpu->_r[cpu_reg::r1].q %= p1;
+        // INT64_MIN / -1 does not fit, and traps on the host
+        if (p1 == 0 || (p1 == -1 && (r0 == (uint64_t)INT64_MIN || r1 == (uint64_t)INT64_MIN))) {
+            return cpu->raise(cpu_vector::vector_divide, 0);
+        }
+
+        r0 = (uint64_t)((int64_t)r0 / p1);
+        r1 = (uint64_t)((int64_t)r1 % p1);
     }
 
     void cpu::_imul(cpu *cpu) {
@@ -169,12 +180,17 @@ namespace mercury {
     void cpu::_inc(cpu *cpu) {
         auto p1 = cpu->get_op_1();
 
+        cpu->set_step_flags(p1 + 1, p1 == 0x7fffffffffffffff);
         cpu->set_op_1(p1 + 1);
     }
 
     void cpu::_mod(cpu *cpu) {
         auto p1 = cpu->get_op_1();
 
+        if (p1 == 0) {
+            return cpu->raise(cpu_vector::vector_divide, 0);
+        }
+
         cpu->_r[cpu_reg::r0].q %= p1;
     }
 
@@ -205,9 +221,9 @@ namespace mercury {
 
     void cpu::_rcl(cpu *cpu) {
         auto p1 = cpu->get_op_1();
-        auto p2 = cpu->get_op_2();
+        auto p2 = cpu->get_op_2() & shift_mask;
 
-        for (auto i = 0; i < p2; i++) {
+        for (uint64_t i = 0; i < p2; i++) {
             auto carry = cpu->get_flag(cpu_flag::carry);
 
             cpu->set_flag(cpu_flag::carry, (p1 >> (64 - 1)) & 1);
@@ -219,13 +235,13 @@ namespace mercury {
 
     void cpu::_rcr(cpu *cpu) {
         auto p1 = cpu->get_op_1();
-        auto p2 = cpu->get_op_2();
+        auto p2 = cpu->get_op_2() & shift_mask;
 
-        for (auto i = 0; i < p2; i++) {
+        for (uint64_t i = 0; i < p2; i++) {
             auto carry = cpu->get_flag(cpu_flag::carry);
 
             cpu->set_flag(cpu_flag::carry, p1 & 1);
-            p1 = (p1 >> 1) | (carry << (64 - 1));
+            p1 = (p1 >> 1) | ((uint64_t)carry << (64 - 1));
         }
 
         cpu->set_op_1(p1);
@@ -233,9 +249,9 @@ namespace mercury {
 
     void cpu::_rol(cpu *cpu) {
         auto p1 = cpu->get_op_1();
-        auto p2 = cpu->get_op_2();
+        auto p2 = cpu->get_op_2() & shift_mask;
 
-        for (auto i = 0; i < p2; i++) {
+        for (uint64_t i = 0; i < p2; i++) {
             auto carry = cpu->get_flag(cpu_flag::carry);
 
             cpu->set_flag(cpu_flag::carry, (p1 >> (64 - 1)) & 1);
@@ -247,13 +263,13 @@ namespace mercury {
 
     void cpu::_ror(cpu *cpu) {
         auto p1 = cpu->get_op_1();
-        auto p2 = cpu->get_op_2();
+        auto p2 = cpu->get_op_2() & shift_mask;
 
-        for (auto i = 0; i < p2; i++) {
+        for (uint64_t i = 0; i < p2; i++) {
             auto carry = cpu->get_flag(cpu_flag::carry);
 
             cpu->set_flag(cpu_flag::carry, p1 & 1);
-            p1 = (p1 >> 1) | (carry << (64 - 1));
+            p1 = (p1 >> 1) | ((uint64_t)carry << (64 - 1));
         }
 
         cpu->set_op_1(p1);
@@ -263,16 +279,14 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->set_flag(cpu_flag::carry, (p1 >> (64 - p2)) & 1);
-        cpu->set_op_1(p1 << p2);
+        cpu->set_op_1(cpu->shift_left(p1, p2));
     }
 
     void cpu::_sar(cpu *cpu) {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->set_flag(cpu_flag::carry, (p1 >> (p2 - 1)) & 1);
-        cpu->set_op_1(p1 >> p2);
+        cpu->set_op_1(cpu->shift_right(p1, p2));
     }
 
     void cpu::_sbb(cpu *cpu) {
@@ -286,16 +300,14 @@ namespace mercury {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->set_flag(cpu_flag::carry, (p1 >> (64 - p2)) & 1);
-        cpu->set_op_1(p1 << p2);
+        cpu->set_op_1(cpu->shift_left(p1, p2));
     }
 
     void cpu::_shr(cpu *cpu) {
         auto p1 = cpu->get_op_1();
         auto p2 = cpu->get_op_2();
 
-        cpu->set_flag(cpu_flag::carry, (p1 >> (p2 - 1)) & 1);
-        cpu->set_op_1(p1 >> p2);
+        cpu->set_op_1(cpu->shift_right(p1, p2));
     }
 
     void cpu::_sub(cpu *cpu) {
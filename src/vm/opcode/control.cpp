@@ -1,12 +1,268 @@
 /**
  * @brief Control flow opcode implementations
+ * @details Jump targets are absolute addresses taken from the first operand.
+ * The program counter already points at the next instruction when a handler
+ * runs, so that is the return address for call and the fall-through for a
+ * jump that is not taken.
  */
 
+#include "../coverage.h"
 #include "../cpu.h"
 
+#define jcc(name) \
+    void cpu::_##name(cpu *cpu) { \
+        auto target = cpu->get_op_1(); \
+        if (cpu->condition(opcode::_##name)) { \
+            cpu->jump(target); \
+        } \
+    }
+
 namespace mercury {
 
+    /**
+     * @brief Evaluates a conditional jump against the flags
+     * @param op The jcc opcode
+     * @return true if the jump is taken
+     */
+    bool cpu::condition(uint16_t op) {
+        auto cf = this->get_flag(cpu_flag::carry);
+        auto zf = this->get_flag(cpu_flag::zero);
+        auto sf = this->get_flag(cpu_flag::negative);
+        auto of = this->get_flag(cpu_flag::overflow);
+
+        switch (op) {
+            case opcode::_ja:
+            case opcode::_jnbe:
+                return !cf && !zf;
+            case opcode::_jae:
+            case opcode::_jnb:
+            case opcode::_jnc:
+                return !cf;
+            case opcode::_jb:
+            case opcode::_jc:
+            case opcode::_jnae:
+                return cf;
+            case opcode::_jbe:
+            case opcode::_jna:
+                return cf || zf;
+            case opcode::_je:
+            case opcode::_jz:
+                return zf;
+            case opcode::_jne:
+            case opcode::_jnz:
+                return !zf;
+            case opcode::_jg:
+            case opcode::_jnle:
+                return !zf && sf == of;
+            case opcode::_jge:
+            case opcode::_jnl:
+                return sf == of;
+            case opcode::_jl:
+            case opcode::_jnge:
+                return sf != of;
+            case opcode::_jle:
+            case opcode::_jng:
+                return zf || sf != of;
+            case opcode::_jo:
+                return of;
+            case opcode::_jno:
+                return !of;
+            case opcode::_js:
+                return sf;
+            case opcode::_jns:
+                return !sf;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * @brief Evaluates a conditional jump straight from the operands of a cmp
+     * @param op The jcc opcode
+     * @param p1 The first operand of the cmp
+     * @param p2 The second operand of the cmp
+     * @return true if the jump is taken
+     */
+    bool cpu::compare_condition(uint16_t op, uint64_t p1, uint64_t p2) {
+        auto s1 = (int64_t)p1;
+        auto s2 = (int64_t)p2;
+        auto result = p1 - p2;
+
+        switch (op) {
+            case opcode::_ja:
+            case opcode::_jnbe:
+                return p1 > p2;
+            case opcode::_jae:
+            case opcode::_jnb:
+            case opcode::_jnc:
+                return p1 >= p2;
+            case opcode::_jb:
+            case opcode::_jc:
+            case opcode::_jnae:
+                return p1 < p2;
+            case opcode::_jbe:
+            case opcode::_jna:
+                return p1 <= p2;
+            case opcode::_je:
+            case opcode::_jz:
+                return p1 == p2;
+            case opcode::_jne:
+            case opcode::_jnz:
+                return p1 != p2;
+            case opcode::_jg:
+            case opcode::_jnle:
+                return s1 > s2;
+            case opcode::_jge:
+            case opcode::_jnl:
+                return s1 >= s2;
+            case opcode::_jl:
+            case opcode::_jnge:
+                return s1 < s2;
+            case opcode::_jle:
+            case opcode::_jng:
+                return s1 <= s2;
+            case opcode::_jo:
+                return ((p1 ^ p2) & (p1 ^ result)) >> 63;
+            case opcode::_jno:
+                return !(((p1 ^ p2) & (p1 ^ result)) >> 63);
+            case opcode::_js:
+                return result >> 63;
+            case opcode::_jns:
+                return !(result >> 63);
+            default:
+                return false;
+        }
+    }
+
+    void cpu::_call(cpu *cpu) {
+        auto target = cpu->get_op_1();
+        auto ret = cpu->pc().q;
+        auto from = cpu->current();
+
+        cpu->push(ret);
+
+        // remember the call, so that branch() can predict the return
+        cpu->_returns[cpu->_return_top++ % return_stack_size] = { ret, from };
+
+        cpu->jump(target);
+    }
+
     void cpu::_hlt(cpu *cpu) {
+        cpu->privileged();
         cpu->halt();
     }
-}
\ No newline at end of file
+
+    /**
+     * @brief Runs a branch translated with coverage on, then counts its edge
+     */
+    void cpu::_cover(cpu *cpu) {
+        auto d = cpu->current();
+        auto site = d->cover;
+
+        // the handler may flush the decoded cache, and d with it
+        d->first(cpu);
+        cpu->_coverage->hit(site, cpu->pc().q);
+    }
+
+    void cpu::_trap(cpu *cpu) {
+        cpu->_watch_hit = {};
+        cpu->set_state(cpu_state::trapped);
+    }
+
+    jcc(ja)
+    jcc(jae)
+    jcc(jb)
+    jcc(jbe)
+    jcc(jc)
+
+    void cpu::_jcxz(cpu *cpu) {
+        auto target = cpu->get_op_1();
+
+        if (cpu->_r[cpu_reg::r2].q == 0) {
+            cpu->jump(target);
+        }
+    }
+
+    jcc(je)
+    jcc(jg)
+    jcc(jge)
+    jcc(jl)
+    jcc(jle)
+
+    void cpu::_jmp(cpu *cpu) {
+        cpu->jump(cpu->get_op_1());
+    }
+
+    jcc(jna)
+    jcc(jnae)
+    jcc(jnb)
+    jcc(jnbe)
+    jcc(jnc)
+    jcc(jne)
+    jcc(jng)
+    jcc(jnge)
+    jcc(jnl)
+    jcc(jnle)
+    jcc(jno)
+    jcc(jns)
+    jcc(jnz)
+    jcc(jo)
+    jcc(js)
+    jcc(jz)
+
+    void cpu::_loop(cpu *cpu) {
+        auto target = cpu->get_op_1();
+
+        if (--cpu->_r[cpu_reg::r2].q != 0) {
+            cpu->jump(target);
+        }
+    }
+
+    void cpu::_loope(cpu *cpu) {
+        auto target = cpu->get_op_1();
+
+        if (--cpu->_r[cpu_reg::r2].q != 0 && cpu->get_flag(cpu_flag::zero)) {
+            cpu->jump(target);
+        }
+    }
+
+    void cpu::_loopne(cpu *cpu) {
+        auto target = cpu->get_op_1();
+
+        if (--cpu->_r[cpu_reg::r2].q != 0 && !cpu->get_flag(cpu_flag::zero)) {
+            cpu->jump(target);
+        }
+    }
+
+    /**
+     * @brief Returns from an exception or interrupt handler
+     * @details Pops the flags and then the return address. An exception
+     * handler pops its code first. Flags with the user bit set return to user
+     * mode, and user mode can only return to itself.
+     */
+    void cpu::_iret(cpu *cpu) {
+        cpu->probe(cpu->_r[cpu_reg::sp].q, 2 * sizeof(uint64_t), page_access::access_read);
+
+        auto flags = cpu->pop();
+        auto pc = cpu->pop();
+
+        // the kernel's stack is left behind once the frame is popped
+        cpu->load_flags(flags);
+        cpu->switch_mode(cpu->user_mode() || (flags & cpu_flag::user));
+        cpu->jump(pc);
+    }
+
+    void cpu::_ret(cpu *cpu) {
+        auto ret = cpu->pop();
+
+        if (cpu->_return_top > 0) {
+            auto &top = cpu->_returns[--cpu->_return_top % return_stack_size];
+
+            if (top.address == ret) {
+                cpu->_return_hint = top.call;
+            }
+        }
+
+        cpu->jump(ret);
+    }
+}
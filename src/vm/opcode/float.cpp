@@ -0,0 +1,133 @@
+/**
+ * @brief Floating point opcode implementations
+ * @details The eight floating point registers are a flat register file of host
+ * doubles rather than an x87 stack, so every instruction is one host operation.
+ * The destination is always a register; sources can be a register, the bits of
+ * a double in an immediate, or a double in memory.
+ */
+
+#include <cmath>
+
+#include "../cpu.h"
+
+/**
+ * fop fA, src
+ * fA = fA op src
+ */
+#define float_binary(name, op) \
+    void cpu::_##name(cpu *cpu) { \
+        auto value = cpu->get_float_op_2(); \
+        cpu->float_reg(cpu->_insn->operand[0]).f op value; \
+    }
+
+namespace mercury {
+
+    /**
+     * @brief Converts a double to a signed 64-bit integer, truncating toward zero
+     * @details NaN and values out of range give 0x8000000000000000, like the
+     * host's cvttsd2si, instead of being undefined.
+     */
+    static inline uint64_t float_to_integer(double value) {
+        if (!(value >= -9223372036854775808.0 && value < 9223372036854775808.0)) {
+            return 0x8000000000000000;
+        }
+
+        return (uint64_t)(int64_t)value;
+    }
+
+    float_binary(fadd, +=)
+    float_binary(fdiv, /=)
+    float_binary(fmul, *=)
+    float_binary(fsub, -=)
+
+    void cpu::_fabs(cpu *cpu) {
+        auto &a = cpu->float_reg(cpu->_insn->operand[0]);
+        a.f = std::fabs(a.f);
+    }
+
+    void cpu::_fchs(cpu *cpu) {
+        auto &a = cpu->float_reg(cpu->_insn->operand[0]);
+        a.f = -a.f;
+    }
+
+    /**
+     * fcom fA, src
+     * Sets the flags like fcomi: CF when less, ZF when equal, and CF, ZF and OF
+     * when unordered (OF standing in for the parity flag), so the unsigned
+     * conditional jumps test the result.
+     */
+    void cpu::_fcom(cpu *cpu) {
+        auto a = cpu->get_float_op_1();
+        auto b = cpu->get_float_op_2();
+        auto &f = cpu->_r[cpu_reg::flags].q;
+
+        f &= ~(uint64_t)(cpu_flag::carry | cpu_flag::zero | cpu_flag::negative | cpu_flag::overflow);
+
+        if (std::isunordered(a, b)) {
+            f |= cpu_flag::carry | cpu_flag::zero | cpu_flag::overflow;
+        } else if (a < b) {
+            f |= cpu_flag::carry;
+        } else if (a == b) {
+            f |= cpu_flag::zero;
+        }
+    }
+
+    /**
+     * fild fA, src
+     * The source is an ordinary signed integer operand.
+     */
+    void cpu::_fild(cpu *cpu) {
+        auto value = (int64_t)cpu->get_op_2();
+        cpu->float_reg(cpu->_insn->operand[0]).f = (double)value;
+    }
+
+    void cpu::_finit(cpu *cpu) {
+        cpu->_f = {};
+    }
+
+    /**
+     * fist dst, fB
+     * The destination is an ordinary integer operand.
+     */
+    void cpu::_fist(cpu *cpu) {
+        cpu->set_op_1(float_to_integer(cpu->float_reg(cpu->_insn->operand[1]).f));
+    }
+
+    void cpu::_fld(cpu *cpu) {
+        cpu->float_reg(cpu->_insn->operand[0]).f = cpu->get_float_op_2();
+    }
+
+    void cpu::_fld1(cpu *cpu) {
+        cpu->float_reg(cpu->_insn->operand[0]).f = 1.0;
+    }
+
+    void cpu::_fldpi(cpu *cpu) {
+        cpu->float_reg(cpu->_insn->operand[0]).f = 3.14159265358979323846;
+    }
+
+    void cpu::_fldz(cpu *cpu) {
+        cpu->float_reg(cpu->_insn->operand[0]).f = 0.0;
+    }
+
+    /**
+     * fsqrt fA, src
+     * fA = sqrt(src)
+     */
+    void cpu::_fsqrt(cpu *cpu) {
+        cpu->float_reg(cpu->_insn->operand[0]).f = std::sqrt(cpu->get_float_op_2());
+    }
+
+    /**
+     * fst dst, fB
+     */
+    void cpu::_fst(cpu *cpu) {
+        cpu->set_float_op_1(cpu->float_reg(cpu->_insn->operand[1]).f);
+    }
+
+    void cpu::_fxch(cpu *cpu) {
+        std::swap(cpu->float_reg(cpu->_insn->operand[0]), cpu->float_reg(cpu->_insn->operand[1]));
+    }
+
+}
+
+#undef float_binary
@@ -0,0 +1,112 @@
+/**
+ * @brief Fused instruction pair implementations
+ * @details Each handler here executes two adjacent instructions that were matched
+ * against the fusion table at decode time. The addressing modes are part of the
+ * table key, so the handlers can go straight to the operands without the generic
+ * addressing switch. The first instruction is at `_insn[0]` and the second is at
+ * `_insn[1]`.
+ */
+
+#include "../cpu.h"
+
+namespace mercury {
+
+    /**
+     * shl rA, imm
+     * add rB, rC
+     */
+    void cpu::_shl_add(cpu *cpu) {
+        auto &shl = cpu->_insn[0];
+        auto &add = cpu->_insn[1];
+
+        cpu->_r[shl.operand[0]].q = cpu->shift_left(cpu->_r[shl.operand[0]].q, shl.operand[1]);
+
+        cpu->_r[add.operand[0]].q += cpu->_r[add.operand[1]].q;
+    }
+
+    /**
+     * shl rA, imm
+     * add rB, imm
+     */
+    void cpu::_shl_add_imm(cpu *cpu) {
+        auto &shl = cpu->_insn[0];
+        auto &add = cpu->_insn[1];
+
+        cpu->_r[shl.operand[0]].q = cpu->shift_left(cpu->_r[shl.operand[0]].q, shl.operand[1]);
+
+        cpu->_r[add.operand[0]].q += add.operand[1];
+    }
+
+    /**
+     * cmp rA, rB
+     * jcc imm
+     * The branch is decided from the operands, not from the flags; the flags
+     * are still set because code after the branch may read them.
+     */
+    void cpu::_cmp_jcc(cpu *cpu) {
+        auto &cmp = cpu->_insn[0];
+        auto &jcc = cpu->_insn[1];
+
+        auto p1 = cpu->_r[cmp.operand[0]].q;
+        auto p2 = cpu->_r[cmp.operand[1]].q;
+
+        cpu->set_compare_flags(p1, p2);
+
+        if (cpu::compare_condition(jcc.word >> 16, p1, p2)) {
+            cpu->jump(jcc.operand[0]);
+        }
+    }
+
+    /**
+     * cmp rA, imm
+     * jcc imm
+     */
+    void cpu::_cmp_jcc_imm(cpu *cpu) {
+        auto &cmp = cpu->_insn[0];
+        auto &jcc = cpu->_insn[1];
+
+        auto p1 = cpu->_r[cmp.operand[0]].q;
+        auto p2 = cmp.operand[1];
+
+        cpu->set_compare_flags(p1, p2);
+
+        if (cpu::compare_condition(jcc.word >> 16, p1, p2)) {
+            cpu->jump(jcc.operand[0]);
+        }
+    }
+
+    /**
+     * dec rA
+     * jnz imm
+     */
+    void cpu::_dec_jnz(cpu *cpu) {
+        auto &dec = cpu->_insn[0];
+        auto &jnz = cpu->_insn[1];
+
+        auto result = --cpu->_r[dec.operand[0]].q;
+
+        cpu->set_step_flags(result, result == 0x7fffffffffffffff);
+
+        if (result != 0) {
+            cpu->jump(jnz.operand[0]);
+        }
+    }
+
+    /**
+     * inc rA
+     * jnz imm
+     */
+    void cpu::_inc_jnz(cpu *cpu) {
+        auto &inc = cpu->_insn[0];
+        auto &jnz = cpu->_insn[1];
+
+        auto result = ++cpu->_r[inc.operand[0]].q;
+
+        cpu->set_step_flags(result, result == 0x8000000000000000);
+
+        if (result != 0) {
+            cpu->jump(jnz.operand[0]);
+        }
+    }
+
+}
@@ -6,8 +6,32 @@
 
 namespace mercury {
 
+    /**
+     * Stands in for an instruction with an operand naming no register, raising
+     * #GP with that operand as the code
+     */
+    void cpu::_bad_register(cpu *cpu) {
+        cpu->fault(cpu->_insn->operand[cpu::register_past(*cpu->_insn, cpu_reg::flags)]);
+    }
+
+    void cpu::_illegal(cpu *cpu) {
+        cpu->raise(cpu_vector::vector_invalid_opcode, cpu->_insn->word);
+    }
+
     void cpu::_nop(cpu *cpu) {
         // no-operation
     }
 
+    /**
+     * Calls a host function; only the kernel may, since host functions work
+     * on whatever guest memory they are handed
+     */
+    void cpu::_vmcall(cpu *cpu) {
+        cpu->privileged();
+        auto number = cpu->_r[cpu_reg::r0].q;
+        auto &calls = cpu->_hypercalls;
+
+        cpu->_r[cpu_reg::r0].q = number < calls.size() && calls[number] ? calls[number](*cpu) : UINT64_MAX;
+    }
+
 }
\ No newline at end of file
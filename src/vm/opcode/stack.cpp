@@ -0,0 +1,65 @@
+/**
+ * @brief Stack opcode implementations
+ */
+
+#include "../cpu.h"
+
+namespace mercury {
+
+    /**
+     * Pops into a register or memory; a page fault on a memory destination
+     * comes before sp moves, so that returning from the handler pops the same slot
+     */
+    void cpu::_pop(cpu *cpu) {
+        auto mode = static_cast<addressing>(cpu->_insn->word & 0x7);
+
+        if (mode != addressing::register_direct) {
+            auto sp = cpu->_r[cpu_reg::sp].q;
+
+            // the destination is addressed with sp past the slot, as set_op_1 will see it
+            cpu->_r[cpu_reg::sp].q = sp + sizeof(uint64_t);
+            auto address = cpu->effective_address(mode, cpu->_insn->operand[0]);
+            cpu->_r[cpu_reg::sp].q = sp;
+
+            cpu->probe(sp, sizeof(uint64_t), page_access::access_read);
+            cpu->probe(address, sizeof(uint64_t), page_access::access_write);
+        }
+
+        cpu->set_op_1(cpu->pop());
+    }
+
+    /**
+     * Pops r7 down to r0, undoing pusha; a page fault comes before the first pop
+     */
+    void cpu::_popa(cpu *cpu) {
+        cpu->probe(cpu->_r[cpu_reg::sp].q, 8 * sizeof(uint64_t), page_access::access_read);
+
+        for (auto i = (int)cpu_reg::r7; i >= (int)cpu_reg::r0; i--) {
+            cpu->_r[i].q = cpu->pop();
+        }
+    }
+
+    void cpu::_popf(cpu *cpu) {
+        cpu->load_flags(cpu->pop());
+    }
+
+    void cpu::_push(cpu *cpu) {
+        cpu->push(cpu->get_op_1());
+    }
+
+    /**
+     * Pushes r0 up to r7; a page fault comes before the first push
+     */
+    void cpu::_pusha(cpu *cpu) {
+        cpu->probe(cpu->_r[cpu_reg::sp].q - 8 * sizeof(uint64_t), 8 * sizeof(uint64_t), page_access::access_write);
+
+        for (auto i = (int)cpu_reg::r0; i <= (int)cpu_reg::r7; i++) {
+            cpu->push(cpu->_r[i].q);
+        }
+    }
+
+    void cpu::_pushf(cpu *cpu) {
+        cpu->push(cpu->_r[cpu_reg::flags].q);
+    }
+
+}
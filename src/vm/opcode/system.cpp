@@ -6,7 +6,77 @@
 
 namespace mercury {
 
+    /**
+     * Reads a leaf of cpu information: leaf 0 is the highest leaf, leaf 1 the
+     * feature bits. Other leaves read as 0.
+     */
     void cpu::_cpuid(cpu *cpu) {
+        switch (cpu->get_op_2()) {
+            case 0:
+                cpu->set_op_1(1);
+                break;
+
+            case 1:
+                cpu->set_op_1(cpu::features);
+                break;
+
+            default:
+                cpu->set_op_1(0);
+                break;
+        }
+    }
+
+    /**
+     * Drops the translation of the page holding the operand's address
+     */
+    void cpu::_invlpg(cpu *cpu) {
+        cpu->privileged();
+        cpu->invalidate_page(cpu->effective_address(
+            static_cast<addressing>(cpu->_insn->word & 0x7),
+            cpu->_insn->operand[0]
+        ));
+    }
+
+    void cpu::_rdmsr(cpu *cpu) {
+        cpu->privileged();
+        cpu->set_op_1(cpu->read_msr(cpu->get_op_2()));
+    }
+
+    /**
+     * Enters the kernel at msr_syscall_entry, saving pc and the flags to
+     * MSRs rather than to the stack; illegal until the entry is set
+     */
+    void cpu::_syscall(cpu *cpu) {
+        if (cpu->_syscall_entry == 0) {
+            cpu->raise(cpu_vector::vector_invalid_opcode, cpu->_insn->word);
+            return;
+        }
+
+        cpu->_syscall_pc = cpu->_r[cpu_reg::pc].q;
+        cpu->_syscall_flags = cpu->_r[cpu_reg::flags].q;
+
+        cpu->switch_mode(false);
+        cpu->_r[cpu_reg::flags].q &= ~cpu->_syscall_mask;
+        cpu->check_unmask();
+        cpu->jump(cpu->_syscall_entry);
+    }
+
+    /**
+     * Returns from syscall to the saved pc, flags and mode
+     */
+    void cpu::_sysret(cpu *cpu) {
+        cpu->privileged();
+
+        auto flags = cpu->_syscall_flags;
+
+        cpu->load_flags(flags);
+        cpu->switch_mode((flags & cpu_flag::user) != 0);
+        cpu->jump(cpu->_syscall_pc);
+    }
+
+    void cpu::_wrmsr(cpu *cpu) {
+        cpu->privileged();
+        cpu->write_msr(cpu->get_op_1(), cpu->get_op_2());
     }
 
-}
\ No newline at end of file
+}
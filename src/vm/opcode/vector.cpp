@@ -0,0 +1,106 @@
+/**
+ * @brief Vector opcode implementations
+ * @details Register-direct operands name vector registers, except where noted.
+ * The element-wise work is done by the host kernels selected with
+ * cpu::use_simd().
+ */
+
+#include "../cpu.h"
+
+/**
+ * vop vA, vB, vC
+ * vA = vB op vC
+ */
+#define vector_binary(name, kernel) \
+    void cpu::_##name(cpu *cpu) { \
+        auto &op = cpu->_insn->operand; \
+        cpu->_simd->kernel(cpu->vector(op[0]), cpu->vector(op[1]), cpu->vector(op[2])); \
+    }
+
+/**
+ * vop vA, vB, imm
+ * vA = shuffle of vB by imm
+ */
+#define vector_shuffle(name, kernel) \
+    void cpu::_##name(cpu *cpu) { \
+        auto &op = cpu->_insn->operand; \
+        cpu->_simd->kernel(cpu->vector(op[0]), cpu->vector(op[1]), (uint8_t)op[2]); \
+    }
+
+namespace mercury {
+
+    vector_binary(vaddpd, addpd)
+    vector_binary(vaddps, addps)
+    vector_binary(vcmpeqpd, cmpeqpd)
+    vector_binary(vcmpeqps, cmpeqps)
+    vector_binary(vcmpltpd, cmpltpd)
+    vector_binary(vcmpltps, cmpltps)
+    vector_binary(vmulpd, mulpd)
+    vector_binary(vmulps, mulps)
+    vector_binary(vpaddb, paddb)
+    vector_binary(vpaddd, paddd)
+    vector_binary(vpaddq, paddq)
+    vector_binary(vpaddw, paddw)
+    vector_binary(vpand, pand)
+    vector_binary(vpcmpeqb, pcmpeqb)
+    vector_binary(vpcmpeqd, pcmpeqd)
+    vector_binary(vpcmpgtd, pcmpgtd)
+    vector_binary(vpmulld, pmulld)
+    vector_binary(vpmullw, pmullw)
+    vector_binary(vpor, por)
+    vector_binary(vpshufb, pshufb)
+    vector_binary(vpsubd, psubd)
+    vector_binary(vpsubq, psubq)
+    vector_binary(vpxor, pxor)
+    vector_binary(vsubpd, subpd)
+    vector_binary(vsubps, subps)
+
+    vector_shuffle(vpermq, permq)
+    vector_shuffle(vpshufd, pshufd)
+
+    /**
+     * vmovdqu vA, vB
+     * vmovdqu vA, [mem]
+     * vmovdqu [mem], vB
+     */
+    void cpu::_vmovdqu(cpu *cpu) {
+        auto &insn = *cpu->_insn;
+        auto dst = static_cast<addressing>(insn.word & 0x7);
+        auto src = static_cast<addressing>((insn.word >> 3) & 0x7);
+
+        if (dst != addressing::register_direct) {
+            cpu->store_vector(cpu->effective_address(dst, insn.operand[0]), cpu->vector(insn.operand[1]));
+        } else if (src != addressing::register_direct) {
+            cpu->load_vector(cpu->effective_address(src, insn.operand[1]), cpu->vector(insn.operand[0]));
+        } else {
+            cpu->vector(insn.operand[0]) = cpu->vector(insn.operand[1]);
+        }
+    }
+
+    /**
+     * vpbroadcastq vA, op
+     * The source is an ordinary operand, so a register-direct source is a general register.
+     */
+    void cpu::_vpbroadcastq(cpu *cpu) {
+        auto value = cpu->get_op_2();
+        auto &v = cpu->vector(cpu->_insn->operand[0]);
+
+        for (auto &q : v.q) {
+            q = value;
+        }
+    }
+
+    /**
+     * vpextrq op, vB, imm
+     * The destination is an ordinary operand, so a register-direct destination is a general register.
+     */
+    void cpu::_vpextrq(cpu *cpu) {
+        auto &op = cpu->_insn->operand;
+
+        cpu->set_op_1(cpu->vector(op[1]).q[op[2] & 3]);
+    }
+
+}
+
+#undef vector_binary
+#undef vector_shuffle
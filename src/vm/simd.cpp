@@ -0,0 +1,275 @@
+/**
+ * @file simd.cpp
+ * @brief Host kernels behind the guest vector instructions
+ * @details The SSE2 and AVX2 kernels are compiled with per-function target
+ * attributes, so the library itself does not need to be built for those
+ * instruction sets; they are only called once detect() has found them.
+ */
+
+#include "./simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MERCURY_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace mercury {
+
+    /** Portable kernels */
+
+#define portable_op(name, in, type, out, expr) \
+    static void portable_##name(vreg &d, const vreg &a, const vreg &b) { \
+        for (unsigned i = 0; i < sizeof(vreg) / sizeof(a.in[0]); i++) { \
+            type x = a.in[i], y = b.in[i]; \
+            d.out[i] = (expr); \
+        } \
+    }
+
+    portable_op(paddb, b, uint8_t, b, x + y)
+    portable_op(paddw, w, uint16_t, w, x + y)
+    portable_op(paddd, d, uint32_t, d, x + y)
+    portable_op(paddq, q, uint64_t, q, x + y)
+    portable_op(psubd, d, uint32_t, d, x - y)
+    portable_op(psubq, q, uint64_t, q, x - y)
+    portable_op(pmullw, w, uint32_t, w, x * y)
+    portable_op(pmulld, d, uint32_t, d, x * y)
+    portable_op(pand, q, uint64_t, q, x & y)
+    portable_op(por, q, uint64_t, q, x | y)
+    portable_op(pxor, q, uint64_t, q, x ^ y)
+    portable_op(pcmpeqb, b, uint8_t, b, x == y ? 0xff : 0)
+    portable_op(pcmpeqd, d, uint32_t, d, x == y ? 0xffffffff : 0)
+    portable_op(pcmpgtd, d, int32_t, d, x > y ? 0xffffffff : 0)
+
+    portable_op(addps, ps, float, ps, x + y)
+    portable_op(subps, ps, float, ps, x - y)
+    portable_op(mulps, ps, float, ps, x * y)
+    portable_op(cmpeqps, ps, float, d, x == y ? 0xffffffff : 0)
+    portable_op(cmpltps, ps, float, d, x < y ? 0xffffffff : 0)
+    portable_op(addpd, pd, double, pd, x + y)
+    portable_op(subpd, pd, double, pd, x - y)
+    portable_op(mulpd, pd, double, pd, x * y)
+    portable_op(cmpeqpd, pd, double, q, x == y ? ~(uint64_t)0 : 0)
+    portable_op(cmpltpd, pd, double, q, x < y ? ~(uint64_t)0 : 0)
+
+#undef portable_op
+
+    /**
+     * Shuffles the bytes of each 128-bit lane of a by the bytes of b; a control
+     * byte with the top bit set selects zero.
+     */
+    static void portable_pshufb(vreg &d, const vreg &a, const vreg &b) {
+        vreg r;
+
+        for (unsigned i = 0; i < 32; i++) {
+            auto c = b.b[i];
+            r.b[i] = (c & 0x80) ? 0 : a.b[(i & ~15u) | (c & 15)];
+        }
+
+        d = r;
+    }
+
+    /**
+     * Shuffles the doublewords of each 128-bit lane, two control bits per element
+     */
+    static void portable_pshufd(vreg &d, const vreg &a, uint8_t control) {
+        vreg r;
+
+        for (unsigned i = 0; i < 8; i++) {
+            r.d[i] = a.d[(i & ~3u) | ((control >> ((i & 3) * 2)) & 3)];
+        }
+
+        d = r;
+    }
+
+    /**
+     * Shuffles the quadwords across the whole register, two control bits per element
+     */
+    static void portable_permq(vreg &d, const vreg &a, uint8_t control) {
+        vreg r;
+
+        for (unsigned i = 0; i < 4; i++) {
+            r.q[i] = a.q[(control >> (i * 2)) & 3];
+        }
+
+        d = r;
+    }
+
+#define kernel_set(prefix, name) { \
+        name, \
+        prefix##_paddb, prefix##_paddw, prefix##_paddd, prefix##_paddq, \
+        prefix##_psubd, prefix##_psubq, \
+        prefix##_pmullw, prefix##_pmulld, \
+        prefix##_pand, prefix##_por, prefix##_pxor, \
+        prefix##_pcmpeqb, prefix##_pcmpeqd, prefix##_pcmpgtd, \
+        prefix##_pshufb, \
+        prefix##_addps, prefix##_subps, prefix##_mulps, prefix##_cmpeqps, prefix##_cmpltps, \
+        prefix##_addpd, prefix##_subpd, prefix##_mulpd, prefix##_cmpeqpd, prefix##_cmpltpd, \
+        prefix##_pshufd, prefix##_permq, \
+    }
+
+    const simd_kernels &simd_kernels::portable(void) {
+        static const simd_kernels kernels = kernel_set(portable, "portable");
+        return kernels;
+    }
+
+#if defined(MERCURY_SIMD_X86)
+
+    /** SSE2 kernels, two 128-bit halves per register */
+
+#define sse2_op(name, type, load, store, step, expr) \
+    __attribute__((target("sse2"))) static void sse2_##name(vreg &d, const vreg &a, const vreg &b) { \
+        for (unsigned i = 0; i < 2; i++) { \
+            auto x = load((const type *)&a + i * step); \
+            auto y = load((const type *)&b + i * step); \
+            store((type *)&d + i * step, expr); \
+        } \
+    }
+
+#define sse2_int(name, intrin) sse2_op(name, __m128i, _mm_load_si128, _mm_store_si128, 1, intrin(x, y))
+#define sse2_ps(name, intrin) sse2_op(name, float, _mm_load_ps, _mm_store_ps, 4, intrin(x, y))
+#define sse2_pd(name, intrin) sse2_op(name, double, _mm_load_pd, _mm_store_pd, 2, intrin(x, y))
+
+    sse2_int(paddb, _mm_add_epi8)
+    sse2_int(paddw, _mm_add_epi16)
+    sse2_int(paddd, _mm_add_epi32)
+    sse2_int(paddq, _mm_add_epi64)
+    sse2_int(psubd, _mm_sub_epi32)
+    sse2_int(psubq, _mm_sub_epi64)
+    sse2_int(pmullw, _mm_mullo_epi16)
+    sse2_int(pand, _mm_and_si128)
+    sse2_int(por, _mm_or_si128)
+    sse2_int(pxor, _mm_xor_si128)
+    sse2_int(pcmpeqb, _mm_cmpeq_epi8)
+    sse2_int(pcmpeqd, _mm_cmpeq_epi32)
+    sse2_int(pcmpgtd, _mm_cmpgt_epi32)
+
+    sse2_ps(addps, _mm_add_ps)
+    sse2_ps(subps, _mm_sub_ps)
+    sse2_ps(mulps, _mm_mul_ps)
+    sse2_ps(cmpeqps, _mm_cmpeq_ps)
+    sse2_ps(cmpltps, _mm_cmplt_ps)
+    sse2_pd(addpd, _mm_add_pd)
+    sse2_pd(subpd, _mm_sub_pd)
+    sse2_pd(mulpd, _mm_mul_pd)
+    sse2_pd(cmpeqpd, _mm_cmpeq_pd)
+    sse2_pd(cmpltpd, _mm_cmplt_pd)
+
+    // SSE2 has no 32-bit multiply, byte shuffle or variable dword shuffle
+    static constexpr simd_binary sse2_pmulld = portable_pmulld;
+    static constexpr simd_binary sse2_pshufb = portable_pshufb;
+    static constexpr simd_shuffle sse2_pshufd = portable_pshufd;
+    static constexpr simd_shuffle sse2_permq = portable_permq;
+
+    const simd_kernels *simd_kernels::sse2(void) {
+        static const simd_kernels kernels = kernel_set(sse2, "sse2");
+        return __builtin_cpu_supports("sse2") ? &kernels : nullptr;
+    }
+
+    /** AVX2 kernels, one 256-bit operation per register */
+
+#define avx2_op(name, type, load, store, expr) \
+    __attribute__((target("avx2"))) static void avx2_##name(vreg &d, const vreg &a, const vreg &b) { \
+        auto x = load((const type *)&a); \
+        auto y = load((const type *)&b); \
+        store((type *)&d, expr); \
+    }
+
+#define avx2_int(name, intrin) avx2_op(name, __m256i, _mm256_load_si256, _mm256_store_si256, intrin(x, y))
+#define avx2_ps(name, expr) avx2_op(name, float, _mm256_load_ps, _mm256_store_ps, expr)
+#define avx2_pd(name, expr) avx2_op(name, double, _mm256_load_pd, _mm256_store_pd, expr)
+
+    avx2_int(paddb, _mm256_add_epi8)
+    avx2_int(paddw, _mm256_add_epi16)
+    avx2_int(paddd, _mm256_add_epi32)
+    avx2_int(paddq, _mm256_add_epi64)
+    avx2_int(psubd, _mm256_sub_epi32)
+    avx2_int(psubq, _mm256_sub_epi64)
+    avx2_int(pmullw, _mm256_mullo_epi16)
+    avx2_int(pmulld, _mm256_mullo_epi32)
+    avx2_int(pand, _mm256_and_si256)
+    avx2_int(por, _mm256_or_si256)
+    avx2_int(pxor, _mm256_xor_si256)
+    avx2_int(pcmpeqb, _mm256_cmpeq_epi8)
+    avx2_int(pcmpeqd, _mm256_cmpeq_epi32)
+    avx2_int(pcmpgtd, _mm256_cmpgt_epi32)
+    avx2_int(pshufb, _mm256_shuffle_epi8)
+
+    avx2_ps(addps, _mm256_add_ps(x, y))
+    avx2_ps(subps, _mm256_sub_ps(x, y))
+    avx2_ps(mulps, _mm256_mul_ps(x, y))
+    avx2_ps(cmpeqps, _mm256_cmp_ps(x, y, _CMP_EQ_OQ))
+    avx2_ps(cmpltps, _mm256_cmp_ps(x, y, _CMP_LT_OQ))
+    avx2_pd(addpd, _mm256_add_pd(x, y))
+    avx2_pd(subpd, _mm256_sub_pd(x, y))
+    avx2_pd(mulpd, _mm256_mul_pd(x, y))
+    avx2_pd(cmpeqpd, _mm256_cmp_pd(x, y, _CMP_EQ_OQ))
+    avx2_pd(cmpltpd, _mm256_cmp_pd(x, y, _CMP_LT_OQ))
+
+    /**
+     * The immediate forms of vpshufd/vpermq need a compile-time control, so the
+     * control is expanded into a dword index vector for vpermd instead.
+     */
+    __attribute__((target("avx2"))) static void avx2_pshufd(vreg &d, const vreg &a, uint8_t control) {
+        alignas(32) uint32_t index[8];
+
+        for (unsigned i = 0; i < 8; i++) {
+            index[i] = (i & ~3u) | ((control >> ((i & 3) * 2)) & 3);
+        }
+
+        auto x = _mm256_load_si256((const __m256i *)&a);
+        auto idx = _mm256_load_si256((const __m256i *)index);
+        _mm256_store_si256((__m256i *)&d, _mm256_permutevar8x32_epi32(x, idx));
+    }
+
+    __attribute__((target("avx2"))) static void avx2_permq(vreg &d, const vreg &a, uint8_t control) {
+        alignas(32) uint32_t index[8];
+
+        for (unsigned i = 0; i < 4; i++) {
+            auto q = (control >> (i * 2)) & 3;
+            index[i * 2] = q * 2;
+            index[i * 2 + 1] = q * 2 + 1;
+        }
+
+        auto x = _mm256_load_si256((const __m256i *)&a);
+        auto idx = _mm256_load_si256((const __m256i *)index);
+        _mm256_store_si256((__m256i *)&d, _mm256_permutevar8x32_epi32(x, idx));
+    }
+
+    const simd_kernels *simd_kernels::avx2(void) {
+        static const simd_kernels kernels = kernel_set(avx2, "avx2");
+        return __builtin_cpu_supports("avx2") ? &kernels : nullptr;
+    }
+
+#undef sse2_op
+#undef sse2_int
+#undef sse2_ps
+#undef sse2_pd
+#undef avx2_op
+#undef avx2_int
+#undef avx2_ps
+#undef avx2_pd
+
+#else
+
+    const simd_kernels *simd_kernels::sse2(void) {
+        return nullptr;
+    }
+
+    const simd_kernels *simd_kernels::avx2(void) {
+        return nullptr;
+    }
+
+#endif
+
+#undef kernel_set
+
+    const simd_kernels &simd_kernels::detect(void) {
+        static const simd_kernels *best =
+                simd_kernels::avx2() ? simd_kernels::avx2() :
+                simd_kernels::sse2() ? simd_kernels::sse2() :
+                &simd_kernels::portable();
+
+        return *best;
+    }
+
+}
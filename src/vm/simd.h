@@ -0,0 +1,78 @@
+/**
+ * @file simd.h
+ * @brief Host kernels behind the guest vector instructions
+*/
+
+#ifndef __mercury_vm_simd_h__
+
+#define __mercury_vm_simd_h__
+
+#include <cstdint>
+
+namespace mercury {
+
+    /**
+     * @brief A 256-bit vector register
+     */
+    union alignas(32) vreg {
+        uint8_t  b[32];
+        uint16_t w[16];
+        uint32_t d[8];
+        uint64_t q[4];
+        float    ps[8];
+        double   pd[4];
+    };
+
+    typedef void (*simd_binary)(vreg &d, const vreg &a, const vreg &b);
+    typedef void (*simd_shuffle)(vreg &d, const vreg &a, uint8_t control);
+
+    /**
+     * @brief One implementation of every vector kernel
+     * @details A set is built for each host instruction set the library knows
+     * about, and detect() picks the widest one the running host supports. Every
+     * set gives bit-identical results, so guests cannot tell which one ran.
+     * Destination and source registers may be the same.
+     */
+    struct simd_kernels {
+        const char *name;
+
+        simd_binary paddb, paddw, paddd, paddq;
+        simd_binary psubd, psubq;
+        simd_binary pmullw, pmulld;
+        simd_binary pand, por, pxor;
+        simd_binary pcmpeqb, pcmpeqd, pcmpgtd;
+        simd_binary pshufb;
+
+        simd_binary addps, subps, mulps, cmpeqps, cmpltps;
+        simd_binary addpd, subpd, mulpd, cmpeqpd, cmpltpd;
+
+        simd_shuffle pshufd, permq;
+
+        /**
+         * @brief Retrieves the plain C++ kernels, which build and run everywhere
+         * @return The portable kernels
+         */
+        static const simd_kernels &portable(void);
+
+        /**
+         * @brief Retrieves the 128-bit SSE2 kernels
+         * @return The kernels, or nullptr if the host does not support them
+         */
+        static const simd_kernels *sse2(void);
+
+        /**
+         * @brief Retrieves the 256-bit AVX2 kernels
+         * @return The kernels, or nullptr if the host does not support them
+         */
+        static const simd_kernels *avx2(void);
+
+        /**
+         * @brief Picks the widest kernels the host supports
+         * @return The kernels
+         */
+        static const simd_kernels &detect(void);
+    };
+
+}
+
+#endif /* __mercury_vm_simd_h__ */
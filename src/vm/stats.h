@@ -0,0 +1,160 @@
+/**
+ * @file stats.h
+ * @brief Runtime counters of a cpu
+*/
+
+#ifndef __mercury_vm_stats_h__
+
+#define __mercury_vm_stats_h__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace mercury {
+
+    /**
+     * @brief The widths bus accesses are counted by
+     */
+    enum access_width {
+        width_8,
+        width_16,
+        width_32,
+        width_64,
+        width_count,
+    };
+
+    /**
+     * @brief A snapshot of a cpu's counters
+     * @details Bus reads and writes are the accesses that leave the direct
+     * path to RAM: devices, unmapped addresses and watched pages. RAM accesses
+     * are not counted, so they cost nothing extra. Snapshots of several cpus
+     * can be summed with +=, for totals across a machine.
+     */
+    struct cpu_stats {
+        uint64_t retired;           /* instructions retired, as of the last run loop to return */
+        uint64_t run_ns;            /* host time spent in run(), in nanoseconds */
+        uint64_t reads[width_count];    /* bus reads by access_width */
+        uint64_t writes[width_count];   /* bus writes by access_width */
+        uint64_t decode_hits;       /* decoded-cache lookups that found an entry */
+        uint64_t decode_misses;     /* decoded-cache lookups that had to decode */
+        uint64_t tlb_hits;          /* address translations found in the TLB */
+        uint64_t tlb_misses;        /* address translations that walked the page tables */
+        uint64_t interrupts;        /* interrupts delivered, maskable or not */
+        uint64_t halts;             /* times the cpu halted, including on illegal instructions */
+        uint64_t illegal;           /* illegal instructions */
+        uint64_t faults;            /* other exceptions: divide errors, protection and page faults */
+
+        /**
+         * @brief Computes millions of instructions retired per second spent in run()
+         */
+        double mips(void) const {
+            return this->run_ns ? (double)this->retired * 1e3 / (double)this->run_ns : 0.0;
+        }
+
+        /**
+         * @brief Computes the share of decoded-cache lookups that found an entry
+         */
+        double decode_hit_rate(void) const {
+            auto lookups = this->decode_hits + this->decode_misses;
+
+            return lookups ? (double)this->decode_hits / (double)lookups : 0.0;
+        }
+
+        cpu_stats &operator+=(const cpu_stats &other) {
+            auto a = reinterpret_cast<uint64_t *>(this);
+            auto b = reinterpret_cast<const uint64_t *>(&other);
+
+            for (size_t i = 0; i < sizeof(cpu_stats) / sizeof(uint64_t); i++) {
+                a[i] += b[i];
+            }
+
+            return *this;
+        }
+    };
+
+    /**
+     * @brief The live counters behind cpu_stats
+     * @details Only the cpu's own thread increments them, so an increment is a
+     * relaxed load and store rather than a locked read-modify-write, and costs
+     * the same as a plain add. Any other thread can take a snapshot() at any
+     * time without locking; each counter in it is exact, although they are
+     * not read at a single instant.
+     */
+    struct cpu_counters {
+        std::atomic<uint64_t> retired{0};
+        std::atomic<uint64_t> run_ns{0};
+        std::atomic<uint64_t> reads[width_count] = {};
+        std::atomic<uint64_t> writes[width_count] = {};
+        std::atomic<uint64_t> decode_hits{0};
+        std::atomic<uint64_t> decode_misses{0};
+        std::atomic<uint64_t> tlb_hits{0};
+        std::atomic<uint64_t> tlb_misses{0};
+        std::atomic<uint64_t> interrupts{0};
+        std::atomic<uint64_t> halts{0};
+        std::atomic<uint64_t> illegal{0};
+        std::atomic<uint64_t> faults{0};
+
+        /**
+         * @brief Adds to a counter from the cpu's own thread
+         */
+        static inline void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Retrieves the access_width of an access of a type
+         */
+        template<typename T>
+        static constexpr access_width width(void) {
+            return sizeof(T) == 1 ? width_8 :
+                   sizeof(T) == 2 ? width_16 :
+                   sizeof(T) == 4 ? width_32 : width_64;
+        }
+
+        /**
+         * @brief Reads every counter into a snapshot
+         */
+        cpu_stats snapshot(void) const {
+            cpu_stats s = {};
+
+            s.retired = this->retired.load(std::memory_order_relaxed);
+            s.run_ns = this->run_ns.load(std::memory_order_relaxed);
+
+            for (size_t i = 0; i < width_count; i++) {
+                s.reads[i] = this->reads[i].load(std::memory_order_relaxed);
+                s.writes[i] = this->writes[i].load(std::memory_order_relaxed);
+            }
+
+            s.decode_hits = this->decode_hits.load(std::memory_order_relaxed);
+            s.decode_misses = this->decode_misses.load(std::memory_order_relaxed);
+            s.tlb_hits = this->tlb_hits.load(std::memory_order_relaxed);
+            s.tlb_misses = this->tlb_misses.load(std::memory_order_relaxed);
+            s.interrupts = this->interrupts.load(std::memory_order_relaxed);
+            s.halts = this->halts.load(std::memory_order_relaxed);
+            s.illegal = this->illegal.load(std::memory_order_relaxed);
+            s.faults = this->faults.load(std::memory_order_relaxed);
+
+            return s;
+        }
+
+        /**
+         * @brief Zeroes every counter, from the cpu's own thread
+         */
+        void clear(void) {
+            for (auto c : { &this->retired, &this->run_ns, &this->decode_hits, &this->decode_misses,
+                            &this->tlb_hits, &this->tlb_misses, &this->interrupts, &this->halts,
+                            &this->illegal, &this->faults }) {
+                c->store(0, std::memory_order_relaxed);
+            }
+
+            for (size_t i = 0; i < width_count; i++) {
+                this->reads[i].store(0, std::memory_order_relaxed);
+                this->writes[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+}
+
+#endif /* __mercury_vm_stats_h__ */
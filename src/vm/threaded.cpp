@@ -0,0 +1,146 @@
+/**
+ * @brief Threaded-code run loop
+ * @details Uses the GCC/Clang labels-as-values extension. Every label finishes
+ * with its own indirect jump to the next instruction's label, so the branch
+ * predictor sees one indirect jump per handler instead of one shared call site.
+ * The bodies inlined here must behave exactly like the handlers in opcode/.
+ */
+
+#include "./cpu.h"
+
+#if defined(__GNUC__)
+
+namespace mercury {
+
+    uint64_t cpu::run_threaded(uint64_t limit) {
+        assert(this->_state != cpu_state::running);
+
+        this->set_state(cpu_state::running);
+
+        // in the same order as threaded_op
+        static const void *labels[] = {
+            &&do_call,
+            &&do_nop,
+            &&do_add_rr,
+            &&do_add_ri,
+            &&do_sub_rr,
+            &&do_sub_ri,
+            &&do_inc_r,
+            &&do_dec_r,
+            &&do_fadd_ff,
+            &&do_fsub_ff,
+            &&do_fmul_ff,
+            &&do_fdiv_ff,
+        };
+
+        auto &r = this->_r;
+        auto &f = this->_f;
+        decoded *d;
+        uint64_t retired = 0;
+
+        // a fused entry that would overrun the limit is split
+#define enter() \
+        if (d->count > limit - retired) goto do_split; \
+        r[cpu_reg::pc].q += d->length; \
+        retired += d->count; \
+        goto *labels[d->thread]
+
+#define dispatch() \
+        if (retired >= limit || this->_state != cpu_state::running) goto done; \
+        d = this->follow(d); \
+        enter()
+
+#define op(n) d->insn[0].operand[n]
+
+        // a delivered exception leaves the loop, to carry on at its handler
+    resume:
+        try {
+            if (retired >= limit || this->_state != cpu_state::running) goto done;
+
+            this->_relink = false;
+            d = &this->decode(r[cpu_reg::pc].q);
+            enter();
+
+        do_call:
+            this->_insn = d->insn;
+            d->func(this);
+            dispatch();
+
+        do_split:
+            this->_insn = d->insn;
+            r[cpu_reg::pc].q += d->insn[0].length;
+            retired += 1;
+            d->first(this);
+            dispatch();
+
+        do_nop:
+            dispatch();
+
+        do_add_rr:
+            r[op(0)].q += r[op(1)].q;
+            dispatch();
+
+        do_add_ri:
+            r[op(0)].q += op(1);
+            dispatch();
+
+        do_sub_rr:
+            r[op(0)].q -= r[op(1)].q;
+            dispatch();
+
+        do_sub_ri:
+            r[op(0)].q -= op(1);
+            dispatch();
+
+        do_inc_r:
+            r[op(0)].q += 1;
+            this->set_step_flags(r[op(0)].q, r[op(0)].q == 0x8000000000000000);
+            dispatch();
+
+        do_dec_r:
+            r[op(0)].q -= 1;
+            this->set_step_flags(r[op(0)].q, r[op(0)].q == 0x7fffffffffffffff);
+            dispatch();
+
+        do_fadd_ff:
+            f[op(0) & (fpu_count - 1)].f += f[op(1) & (fpu_count - 1)].f;
+            dispatch();
+
+        do_fsub_ff:
+            f[op(0) & (fpu_count - 1)].f -= f[op(1) & (fpu_count - 1)].f;
+            dispatch();
+
+        do_fmul_ff:
+            f[op(0) & (fpu_count - 1)].f *= f[op(1) & (fpu_count - 1)].f;
+            dispatch();
+
+        do_fdiv_ff:
+            f[op(0) & (fpu_count - 1)].f /= f[op(1) & (fpu_count - 1)].f;
+            dispatch();
+
+        done:
+            ;
+        } catch (const unwind &) {
+            retired += this->charge_fetch_fault();
+            goto resume;
+        } catch (...) {
+            this->retire(retired);
+            throw;
+        }
+
+#undef op
+#undef dispatch
+#undef enter
+
+        retired = this->retire(retired);
+
+        if (this->_state == cpu_state::running) {
+            this->set_state(cpu_state::stopped);
+        }
+
+        return retired;
+    }
+
+}
+
+#endif